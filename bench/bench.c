@@ -0,0 +1,125 @@
+/*
+ bench.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/iosupport.h>
+#include <sys/time.h>
+#include "bench.h"
+#include "mock_server.h"
+
+#define BENCH_FILES 64 // One per thread of bench_qd
+#define BENCH_FILE_STRUCT 16384
+
+// The devoptab functions take the address of the file struct as file descriptor, so these have to stay
+// below 2 GB. The harness is linked without PIE for that.
+static char filestructs[BENCH_FILES][BENCH_FILE_STRUCT] __attribute__((aligned(16)));
+static const devoptab_t *filedevs[BENCH_FILES];
+
+static int bench_slot(int fd)
+{
+	int i;
+	for (i = 0; i < BENCH_FILES; i++) {
+		if ((int) (intptr_t) filestructs[i] == fd) return i;
+	}
+	return -1;
+}
+
+bool bench_mount(const char *name, nfsMountOpts *opts)
+{
+	opts->portmapperport = htons(mock_portmapper_port());
+	return nfsMountWithOpts(name, "127.0.0.1", MOCK_EXPORT, opts);
+}
+
+int bench_open(const char *path, int flags)
+{
+	struct _reent r = {0};
+	const devoptab_t *devops = GetDeviceOpTab(path);
+	int i;
+	if (devops == NULL || devops->structSize > BENCH_FILE_STRUCT) return -1;
+
+	for (i = 0; i < BENCH_FILES && filedevs[i] != NULL; i++);
+	if (i == BENCH_FILES) return -1;
+
+	if (devops->open_r(&r, filestructs[i], path, flags, 0666) != 0) return -1;
+	filedevs[i] = devops;
+	return (int) (intptr_t) filestructs[i];
+}
+
+ssize_t bench_read(int fd, void *buf, size_t len)
+{
+	struct _reent r = {0};
+	int slot = bench_slot(fd);
+	return slot < 0 ? -1 : filedevs[slot]->read_r(&r, fd, buf, len);
+}
+
+ssize_t bench_write(int fd, const void *buf, size_t len)
+{
+	struct _reent r = {0};
+	int slot = bench_slot(fd);
+	return slot < 0 ? -1 : filedevs[slot]->write_r(&r, fd, buf, len);
+}
+
+off_t bench_seek(int fd, off_t pos, int dir)
+{
+	struct _reent r = {0};
+	int slot = bench_slot(fd);
+	return slot < 0 ? -1 : filedevs[slot]->seek_r(&r, fd, pos, dir);
+}
+
+int bench_fsync(int fd)
+{
+	struct _reent r = {0};
+	int slot = bench_slot(fd);
+	return slot < 0 ? -1 : filedevs[slot]->fsync_r(&r, fd);
+}
+
+int bench_close(int fd)
+{
+	struct _reent r = {0};
+	int slot = bench_slot(fd);
+	if (slot < 0) return -1;
+	int ret = filedevs[slot]->close_r(&r, fd);
+	filedevs[slot] = NULL;
+	return ret;
+}
+
+int bench_stat(const char *path, struct stat *st)
+{
+	struct _reent r = {0};
+	const devoptab_t *devops = GetDeviceOpTab(path);
+	return devops == NULL ? -1 : devops->stat_r(&r, path, st);
+}
+
+uint64_t bench_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
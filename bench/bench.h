@@ -0,0 +1,55 @@
+/*
+ bench.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Helpers of the benchmarks, which run the library against the stand-in server on the loopback interface
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <nfs.h>
+
+// Mounts the export of the stand-in server on name, with the ports of the stand-in filled into opts
+bool bench_mount(const char *name, nfsMountOpts *opts);
+
+// Open, read, write and close go straight to the device of the path, like newlib does for open() and friends
+int bench_open(const char *path, int flags);
+ssize_t bench_read(int fd, void *buf, size_t len);
+ssize_t bench_write(int fd, const void *buf, size_t len);
+off_t bench_seek(int fd, off_t pos, int dir);
+int bench_fsync(int fd);
+int bench_close(int fd);
+int bench_stat(const char *path, struct stat *st);
+
+// Microseconds since some point in the past
+uint64_t bench_now(void);
+
+#endif // _BENCH_H_
@@ -0,0 +1,145 @@
+/*
+ bench_encode.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Measures what it costs to encode the RPC header of a GETATTR call: rpc_create_header, which copies a template made
+// per program, against the encoder of the first releases, which cleared the whole buffer and encoded the credentials
+// for every call. The host has no IOS to ask for its address, so net_gethostip costs less here than on the console.
+// Usage: bench_encode [calls]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <network.h>
+#include "bench.h"
+#include "mock_server.h"
+#include "nfs_net.h"
+#include "rpc.h"
+#include "rpc_mount.h"
+
+static uint32_t baseline_xid;
+
+// The encoder of the first releases, on the buffer of a call
+static int32_t baseline_create_header(NFS_CALL *call, int32_t program, int32_t program_version, int32_t procedure, int32_t auth)
+{
+	NFSMOUNT *nfsmount = call->nfsmount;
+	if (call->bufferlen < 40) return -1;
+	if (auth != AUTH_NULL && auth != AUTH_UNIX) return -2;
+
+	memset(call->buffer, 0, call->bufferlen);
+	uint32_t offset = rpc_write_int(call, 0, ++baseline_xid);
+	offset += rpc_write_int(call, offset, 0);
+	offset += rpc_write_int(call, offset, 2);
+	offset += rpc_write_int(call, offset, program);
+	offset += rpc_write_int(call, offset, program_version);
+	offset += rpc_write_int(call, offset, procedure);
+	offset += rpc_write_int(call, offset, auth);
+
+	if (auth == AUTH_NULL) return offset + 12;
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	uint32_t ip = net_gethostip();
+	struct in_addr addr;
+	addr.s_addr = ip;
+	char *ipAddr = inet_ntoa(addr);
+
+	uint32_t auth_length_offset = offset;
+	offset += 4;
+	offset += rpc_write_int(call, offset, tv.tv_sec);
+	offset += rpc_write_string(call, offset, ipAddr);
+	offset += rpc_write_int(call, offset, nfsmount->uid);
+	offset += rpc_write_int(call, offset, nfsmount->gid);
+	offset += 4;
+	rpc_write_int(call, auth_length_offset, offset - (auth_length_offset + 4));
+	offset += 8;
+	return offset;
+}
+
+// Runs count encodes of a GETATTR header, returns the nanoseconds per call
+static double run(NFS_CALL *call, uint32_t count, int32_t baseline)
+{
+	uint64_t start = bench_now();
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		int32_t offset = baseline ? baseline_create_header(call, PROGRAM_NFS, 3, PROCEDURE_GETATTR, AUTH_UNIX)
+			: rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_GETATTR, AUTH_UNIX);
+		rpc_write_fhandle(call, offset, &call->nfsmount->handle);
+	}
+	return (double) (bench_now() - start) * 1000 / count;
+}
+
+// Both encoders have to write the same header, apart from the xid and the timestamp of the credentials
+static int32_t same_header(NFS_CALL *call)
+{
+	char template[RPC_TEMPLATE_SIZE];
+	int32_t len = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_GETATTR, AUTH_UNIX);
+	memcpy(template, call->buffer, len);
+	if (baseline_create_header(call, PROGRAM_NFS, 3, PROCEDURE_GETATTR, AUTH_UNIX) != len) return 0;
+	return memcmp(template + 4, call->buffer + 4, 28) == 0 && memcmp(template + 36, call->buffer + 36, len - 36) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t count = argc > 1 ? atoi(argv[1]) : 1000000;
+	if (count < 1) count = 1000000;
+
+	if (mock_start(0) != 0) {
+		fprintf(stderr, "Can't start the server\n");
+		return 1;
+	}
+
+	// The buffers of UDP mounts have the default size, those of TCP mounts fit the largest READ reply
+	static const uint32_t flags[] = { 0, NFS_TCP };
+	int failed = 0;
+	uint32_t f;
+	printf("GETATTR header encoding in ns per call, over %u calls\n", count);
+	printf("%-8s %8s %10s %10s\n", "buffer", "bytes", "baseline", "template");
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		nfsMountOpts opts;
+		nfsMountDefaultOpts(&opts);
+		opts.flags = flags[f];
+		if (!bench_mount("bench", &opts)) {
+			fprintf(stderr, "Can't mount\n");
+			return 1;
+		}
+
+		NFS_CALL *call = nfs_call_get(_NFS_get_NfsMountFromPath("bench:/"));
+		if (!same_header(call)) failed = 1;
+		double baseline = run(call, count, 1);
+		double template = run(call, count, 0);
+		printf("%-8s %8u %10.1f %10.1f\n", flags[f] ? "TCP" : "UDP", call->bufferlen, baseline, template);
+		nfs_call_put(call);
+		nfsUnmount("bench");
+	}
+
+	if (failed) printf("The encoders wrote different headers\n");
+	mock_stop();
+	return failed;
+}
@@ -0,0 +1,154 @@
+/*
+ bench_getattr.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Measures the latency of GETATTR calls on the root handle through nfs_sendrecv, against the receive loop of the
+// first releases, which tried the socket and slept 500 us until the reply was there. Usage: bench_getattr [calls]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+#include "bench.h"
+#include "mock_server.h"
+#include "nfs_net.h"
+#include "rpc.h"
+#include "rpc_mount.h"
+
+static uint32_t samples[100000];
+
+static int compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int32_t getattr_header(NFS_CALL *call)
+{
+	int32_t offset = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_GETATTR, AUTH_UNIX);
+	return offset + rpc_write_fhandle(call, offset, &call->nfsmount->handle);
+}
+
+// A GETATTR the way the library does it now, returns the microseconds until the reply was there
+static int32_t getattr_library(NFSMOUNT *nfsmount)
+{
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	uint64_t start = bench_now();
+	int32_t ret = nfs_sendrecv(call, getattr_header(call), nfsmount->transport->nfs_port);
+	uint64_t elapsed = bench_now() - start;
+	nfs_call_put(call);
+	return ret < 0 ? -1 : (int32_t) elapsed;
+}
+
+// The same call through the receive loop of the first releases, on a socket of its own
+static int32_t getattr_polling(NFSMOUNT *nfsmount, int32_t socket, struct sockaddr_in *server)
+{
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	uint64_t start = bench_now();
+	int32_t len = getattr_header(call), ret = -1, tries;
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+
+	net_sendto(socket, call->buffer, len, 0, (struct sockaddr *) server, sizeof(*server));
+	for (tries = 0; tries < 1000; tries++) {
+		ret = net_recvfrom(socket, call->rxbuffer, call->bufferlen, 0, (struct sockaddr *) &from, &fromlen);
+		if (ret >= 24 && *(uint32_t *) call->rxbuffer == call->xid) break;
+		ret = -1;
+		usleep(500);
+	}
+	uint64_t elapsed = bench_now() - start;
+	nfs_call_put(call);
+	return ret < 0 ? -1 : (int32_t) elapsed;
+}
+
+static void report(const char *name, uint32_t count, uint32_t netcalls)
+{
+	uint64_t total = 0;
+	uint32_t i;
+	for (i = 0; i < count; i++) total += samples[i];
+	qsort(samples, count, sizeof(uint32_t), compare);
+	printf("%-10s %8u %8u %8u %8u %10.1f\n", name, (uint32_t) (total / count), samples[count / 2],
+		samples[count * 90 / 100], samples[count * 99 / 100], (double) netcalls / count);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t count = argc > 1 ? atoi(argv[1]) : 2000;
+	if (count < 1 || count > sizeof(samples) / sizeof(samples[0])) count = 2000;
+
+	if (mock_start(0) != 0) {
+		fprintf(stderr, "Can't start the server\n");
+		return 1;
+	}
+
+	nfsMountOpts opts;
+	nfsMountDefaultOpts(&opts);
+	if (!bench_mount("bench", &opts)) {
+		fprintf(stderr, "Can't mount\n");
+		return 1;
+	}
+	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath("bench:/");
+
+	int32_t socket = net_socket(AF_INET, SOCK_DGRAM, 0);
+	int32_t flags = net_fcntl(socket, F_GETFL, 0);
+	net_fcntl(socket, F_SETFL, flags | 0x04); // IOS_O_NONBLOCK
+	struct sockaddr_in server = nfsmount->transport->remote;
+	server.sin_port = nfsmount->transport->nfs_port;
+
+	static const uint32_t latencies[] = { 0, 100, 1000 };
+	int failed = 0;
+	uint32_t l, i;
+	printf("GETATTR latency in us over %u calls, and socket calls per GETATTR\n", count);
+	for (l = 0; l < sizeof(latencies) / sizeof(latencies[0]); l++) {
+		mock_set_latency(latencies[l]);
+		printf("\nreplies held back %u us\n", latencies[l]);
+		printf("%-10s %8s %8s %8s %8s %10s\n", "loop", "mean", "median", "p90", "p99", "net calls");
+
+		host_net_reset();
+		for (i = 0; i < count; i++) {
+			int32_t us = getattr_polling(nfsmount, socket, &server);
+			if (us < 0) failed = 1;
+			samples[i] = us < 0 ? 0 : us;
+		}
+		report("usleep", count, host_net_total());
+
+		host_net_reset();
+		for (i = 0; i < count; i++) {
+			int32_t us = getattr_library(nfsmount);
+			if (us < 0) failed = 1;
+			samples[i] = us < 0 ? 0 : us;
+		}
+		report("library", count, host_net_total());
+	}
+
+	net_close(socket);
+	nfsUnmount("bench");
+	mock_stop();
+	return failed;
+}
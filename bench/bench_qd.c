@@ -0,0 +1,136 @@
+/*
+ bench_qd.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Random 4 KB reads over UDP at queue depths of 1 up to 64, with the sockets polled and with the completion ring,
+// from a server which holds every reply back for a while. Every thread reads from its own open file, so the queue
+// depth is the amount of threads. Usage: bench_qd [latency in us] [reads per depth]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <network.h>
+#include "bench.h"
+#include "mock_server.h"
+
+#define MAX_DEPTH 64
+#define BLOCK 4096
+#define FILE_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+	int fd;
+	uint32_t reads;
+	unsigned int seed;
+	int failed;
+	char buffer[BLOCK];
+} reader;
+
+static reader readers[MAX_DEPTH];
+
+static void *read_random(void *arg)
+{
+	reader *r = (reader *) arg;
+	uint32_t i;
+	for (i = 0; i < r->reads && !r->failed; i++) {
+		uint32_t offset = (rand_r(&r->seed) % (FILE_SIZE / BLOCK)) * BLOCK;
+		if (bench_seek(r->fd, offset, SEEK_SET) != offset || bench_read(r->fd, r->buffer, BLOCK) != BLOCK ||
+			(uint8_t) r->buffer[0] != mock_pattern(offset) || (uint8_t) r->buffer[BLOCK - 1] != mock_pattern(offset + BLOCK - 1)) {
+			r->failed = 1;
+		}
+	}
+	return NULL;
+}
+
+// Returns the reads per second, with the socket calls per read in calls, or -1 when a read failed
+static double bench_depth(uint32_t flags, int32_t depth, uint32_t total, double *calls)
+{
+	pthread_t threads[MAX_DEPTH];
+	nfsMountOpts opts;
+	nfsMountDefaultOpts(&opts);
+	opts.flags = flags;
+	opts.readcache = 0;
+	if (!bench_mount("bench", &opts)) return -1;
+
+	double rate = -1;
+	int32_t i, opened, failed = 0;
+	for (opened = 0; opened < depth; opened++) {
+		reader *r = &readers[opened];
+		r->fd = bench_open("bench:/file.bin", O_RDONLY);
+		if (r->fd == -1) break;
+		r->reads = total / depth;
+		r->seed = opened + 1;
+		r->failed = 0;
+	}
+
+	if (opened == depth) {
+		host_net_reset();
+		uint64_t start = bench_now();
+		for (i = 0; i < depth; i++) pthread_create(&threads[i], NULL, read_random, &readers[i]);
+		for (i = 0; i < depth; i++) {
+			pthread_join(threads[i], NULL);
+			failed |= readers[i].failed;
+		}
+		uint64_t elapsed = bench_now() - start;
+		uint32_t reads = total / depth * depth;
+		*calls = (double) host_net_total() / reads;
+		if (!failed) rate = reads * 1000000.0 / elapsed;
+	}
+
+	for (i = 0; i < opened; i++) bench_close(readers[i].fd);
+	nfsUnmount("bench");
+	return rate;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t latency = argc > 1 ? atoi(argv[1]) : 200;
+	uint32_t total = argc > 2 ? atoi(argv[2]) : 4096;
+
+	if (mock_start(FILE_SIZE) != 0) {
+		fprintf(stderr, "Can't start the server\n");
+		return 1;
+	}
+	mock_set_latency(latency);
+
+	printf("Random %u KB READs over UDP, %u per depth, replies held back %u us\n", BLOCK / 1024, total, latency);
+	printf("depth  poll reads/s  calls/read  ring reads/s  calls/read\n");
+	int failed = 0;
+	int32_t depth;
+	for (depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+		double pollcalls = 0, ringcalls = 0;
+		double poll = bench_depth(NFS_READONLY, depth, total, &pollcalls);
+		double ring = bench_depth(NFS_READONLY | NFS_RING, depth, total, &ringcalls);
+		printf("%5d %13.0f %11.2f %13.0f %11.2f\n", depth, poll, pollcalls, ring, ringcalls);
+		if (poll < 0 || ring < 0) failed = 1;
+	}
+
+	mock_stop();
+	return failed;
+}
@@ -0,0 +1,98 @@
+/*
+ bench_read.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Reads a file with READ windows of 1 up to 16 calls in flight, over UDP and TCP, from a server
+// which holds every reply back for a while. Usage: bench_read [latency in us] [file size in KB]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "mock_server.h"
+
+#define READ_CHUNK (1024 * 1024) // What the application asks for per read()
+
+static char buffer[READ_CHUNK];
+
+// Returns the throughput in MB/s, or a negative value when the data didn't arrive right
+static double bench_window(uint32_t flags, uint32_t window, uint32_t filesize)
+{
+	nfsMountOpts opts;
+	nfsMountDefaultOpts(&opts);
+	opts.flags = flags;
+	opts.readwindow = window;
+	if (!bench_mount("bench", &opts)) return -1;
+
+	double rate = -1;
+	int fd = bench_open("bench:/file.bin", O_RDONLY);
+	if (fd != -1) {
+		uint64_t start = bench_now();
+		uint32_t offset = 0;
+		ssize_t ret;
+		while ((ret = bench_read(fd, buffer, READ_CHUNK)) > 0) {
+			ssize_t i;
+			for (i = 0; i < ret; i++) {
+				if ((uint8_t) buffer[i] != mock_pattern(offset + i)) break;
+			}
+			if (i < ret) break;
+			offset += ret;
+		}
+		uint64_t elapsed = bench_now() - start;
+		if (offset == filesize) rate = (double) filesize / elapsed;
+		bench_close(fd);
+	}
+	nfsUnmount("bench");
+	return rate;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t latency = argc > 1 ? atoi(argv[1]) : 1000;
+	uint32_t filesize = (argc > 2 ? atoi(argv[2]) : 4096) * 1024;
+
+	if (mock_start(filesize) != 0) {
+		fprintf(stderr, "Can't start the server\n");
+		return 1;
+	}
+	mock_set_latency(latency);
+
+	printf("READ of %u KB, replies held back %u us\n", filesize / 1024, latency);
+	printf("window   UDP MB/s   TCP MB/s\n");
+	int failed = 0;
+	uint32_t window;
+	for (window = 1; window <= 16; window++) {
+		double udp = bench_window(NFS_READONLY, window, filesize);
+		double tcp = bench_window(NFS_READONLY | NFS_TCP, window, filesize);
+		printf("%6u %10.2f %10.2f\n", window, udp, tcp);
+		if (udp < 0 || tcp < 0) failed = 1;
+	}
+
+	mock_stop();
+	return failed;
+}
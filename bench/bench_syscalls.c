@@ -0,0 +1,110 @@
+/*
+ bench_syscalls.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Counts the socket calls per MB read and written, over UDP and TCP. Every net_* call goes to IOS on the console,
+// on the host each one is a system call. Usage: bench_syscalls [latency in us] [size in KB]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <network.h>
+#include "bench.h"
+#include "mock_server.h"
+
+#define CHUNK (1024 * 1024) // What the application asks for per read() or write()
+
+static char buffer[CHUNK];
+
+static void report(const char *name, uint32_t size)
+{
+	double mb = (double) size / (1024 * 1024);
+	printf("%-10s %8.1f %8.1f %8.1f %8.1f %8.1f\n", name, host_net_calls.send / mb, host_net_calls.recv / mb,
+		host_net_calls.recvempty / mb, host_net_calls.poll / mb, host_net_total() / mb);
+}
+
+// Reads file.bin and writes it to out.bin, returns -1 when something went wrong
+static int32_t transfer(uint32_t flags, uint32_t size)
+{
+	nfsMountOpts opts;
+	nfsMountDefaultOpts(&opts);
+	opts.flags = flags;
+	opts.readwindow = 8;
+	opts.writewindow = 8;
+	if (!bench_mount("bench", &opts)) return -1;
+
+	const char *proto = (flags & NFS_TCP) ? "TCP" : "UDP";
+	char name[16];
+	int32_t ret = -1;
+	int fd = bench_open("bench:/file.bin", O_RDONLY);
+	if (fd != -1) {
+		uint32_t done = 0;
+		ssize_t len;
+		host_net_reset();
+		while ((len = bench_read(fd, buffer, CHUNK)) > 0) done += len;
+		bench_close(fd);
+		sprintf(name, "%s read", proto);
+		report(name, size);
+		ret = done == size ? 0 : -1;
+	}
+
+	fd = bench_open("bench:/out.bin", O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd != -1) {
+		uint32_t done = 0;
+		host_net_reset();
+		while (done < size && bench_write(fd, buffer, size - done < CHUNK ? size - done : CHUNK) > 0) {
+			done += size - done < CHUNK ? size - done : CHUNK;
+		}
+		if (bench_close(fd) != 0 || done < size) ret = -1;
+		sprintf(name, "%s write", proto);
+		report(name, size);
+	} else ret = -1;
+
+	nfsUnmount("bench");
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t latency = argc > 1 ? atoi(argv[1]) : 200;
+	uint32_t size = (argc > 2 ? atoi(argv[2]) : 4096) * 1024;
+
+	if (mock_start(size) != 0) {
+		fprintf(stderr, "Can't start the server\n");
+		return 1;
+	}
+	mock_set_latency(latency);
+
+	printf("Socket calls per MB, windows of 8, replies held back %u us\n", latency);
+	printf("%-10s %8s %8s %8s %8s %8s\n", "", "send", "recv", "empty", "poll", "total");
+	int failed = transfer(0, size) != 0;
+	failed |= transfer(NFS_TCP, size) != 0;
+
+	mock_stop();
+	return failed;
+}
@@ -0,0 +1,56 @@
+/*
+ gccore.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// The LWP threads, mutexes and conditions of libogc on top of pthreads
+
+#ifndef _GCCORE_H_
+#define _GCCORE_H_
+
+#include <pthread.h>
+#include <time.h>
+#include "gctypes.h"
+
+typedef pthread_mutex_t *mutex_t;
+typedef pthread_cond_t *cond_t;
+typedef pthread_t lwp_t;
+
+s32 LWP_MutexInit(mutex_t *mutex, bool use_recursive);
+s32 LWP_MutexDestroy(mutex_t mutex);
+s32 LWP_MutexLock(mutex_t mutex);
+s32 LWP_MutexUnlock(mutex_t mutex);
+
+s32 LWP_CondInit(cond_t *cond);
+s32 LWP_CondDestroy(cond_t cond);
+s32 LWP_CondTimedWait(cond_t cond, mutex_t mutex, const struct timespec *reltime); // Relative to now, like libogc
+s32 LWP_CondSignal(cond_t cond);
+s32 LWP_CondBroadcast(cond_t cond);
+
+s32 LWP_CreateThread(lwp_t *thethread, void *(*entry)(void *), void *arg, void *stackbase, u32 stack_size, u8 prio);
+s32 LWP_JoinThread(lwp_t thethread, void **value_ptr);
+
+#endif // _GCCORE_H_
@@ -0,0 +1,724 @@
+/*
+ host.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gccore.h>
+#include <network.h>
+#include <sys/iosupport.h>
+#ifdef NET_HAS_RING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define IOS_O_NONBLOCK 0x04
+
+host_net_counters host_net_calls;
+
+void host_net_reset(void)
+{
+	memset(&host_net_calls, 0, sizeof(host_net_calls));
+}
+
+u32 host_net_total(void)
+{
+	return host_net_calls.send + host_net_calls.recv + host_net_calls.poll + host_net_calls.other;
+}
+
+static s32 host_ret(ssize_t ret)
+{
+	return ret < 0 ? -errno : (s32) ret;
+}
+
+s32 net_init(void)
+{
+	return 0;
+}
+
+u32 net_gethostip(void)
+{
+	return inet_addr("127.0.0.1");
+}
+
+s32 net_socket(u32 domain, u32 type, u32 protocol)
+{
+	__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+	s32 s = socket(domain, type, protocol);
+	if (s < 0) return -errno;
+
+	// Several mounts in a row bind the same client ports
+	int reuse = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	// A window of replies arrives in a burst from the stand-in server, don't drop them on the host already
+	int size = 4 * 1024 * 1024;
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	return s;
+}
+
+s32 net_bind(s32 s, struct sockaddr *name, socklen_t namelen)
+{
+	__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+	return host_ret(bind(s, name, namelen));
+}
+
+s32 net_connect(s32 s, struct sockaddr *name, socklen_t namelen)
+{
+	__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+	return host_ret(connect(s, name, namelen));
+}
+
+s32 net_send(s32 s, const void *data, s32 size, u32 flags)
+{
+	__atomic_add_fetch(&host_net_calls.send, 1, __ATOMIC_RELAXED);
+	return host_ret(send(s, data, size, flags | MSG_NOSIGNAL));
+}
+
+s32 net_sendto(s32 s, const void *data, s32 len, u32 flags, struct sockaddr *to, socklen_t tolen)
+{
+	__atomic_add_fetch(&host_net_calls.send, 1, __ATOMIC_RELAXED);
+	return host_ret(sendto(s, data, len, flags | MSG_NOSIGNAL, to, tolen));
+}
+
+#ifdef NET_HAS_IOVEC
+// Sends the pieces as one message, to is NULL on connected sockets
+s32 net_sendmsg(s32 s, const struct net_iovec *iov, s32 iovcnt, u32 flags, struct sockaddr *to, socklen_t tolen)
+{
+	struct iovec vec[NET_MAX_IOV];
+	struct msghdr msg;
+	s32 i;
+	if (iovcnt > NET_MAX_IOV) return -EINVAL;
+
+	__atomic_add_fetch(&host_net_calls.send, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].iov_base = iov[i].base;
+		vec[i].iov_len = iov[i].len;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = to;
+	msg.msg_namelen = to ? tolen : 0;
+	msg.msg_iov = vec;
+	msg.msg_iovlen = iovcnt;
+	return host_ret(sendmsg(s, &msg, flags | MSG_NOSIGNAL));
+}
+#endif
+
+#ifdef NET_HAS_MMSG
+// Sets up the headers of sendmmsg and recvmmsg for the messages
+static void host_mmsg(struct mmsghdr *hdrs, struct iovec (*vec)[NET_MAX_IOV], struct net_msg *msgs, s32 count)
+{
+	s32 i, j;
+	memset(hdrs, 0, count * sizeof(struct mmsghdr));
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < msgs[i].iovcnt; j++) {
+			vec[i][j].iov_base = msgs[i].iov[j].base;
+			vec[i][j].iov_len = msgs[i].iov[j].len;
+		}
+		hdrs[i].msg_hdr.msg_name = msgs[i].addr;
+		hdrs[i].msg_hdr.msg_namelen = msgs[i].addr ? msgs[i].addrlen : 0;
+		hdrs[i].msg_hdr.msg_iov = vec[i];
+		hdrs[i].msg_hdr.msg_iovlen = msgs[i].iovcnt;
+	}
+}
+
+// Sends several messages in one call, returns how many were sent
+s32 net_sendmmsg(s32 s, struct net_msg *msgs, s32 count, u32 flags)
+{
+	struct mmsghdr hdrs[NET_MAX_MSGS];
+	struct iovec vec[NET_MAX_MSGS][NET_MAX_IOV];
+	s32 i;
+	if (count > NET_MAX_MSGS) count = NET_MAX_MSGS;
+	for (i = 0; i < count; i++) if (msgs[i].iovcnt > NET_MAX_IOV) return -EINVAL;
+
+	__atomic_add_fetch(&host_net_calls.send, 1, __ATOMIC_RELAXED);
+	host_mmsg(hdrs, vec, msgs, count);
+	s32 ret = host_ret(sendmmsg(s, hdrs, count, flags | MSG_NOSIGNAL));
+	for (i = 0; i < ret; i++) msgs[i].len = hdrs[i].msg_len;
+	return ret;
+}
+#endif
+
+s32 net_recv(s32 s, void *mem, s32 len, u32 flags)
+{
+	__atomic_add_fetch(&host_net_calls.recv, 1, __ATOMIC_RELAXED);
+	s32 ret = host_ret(recv(s, mem, len, flags));
+	if (ret == -EAGAIN) __atomic_add_fetch(&host_net_calls.recvempty, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+s32 net_recvfrom(s32 s, void *mem, s32 len, u32 flags, struct sockaddr *from, socklen_t *fromlen)
+{
+	__atomic_add_fetch(&host_net_calls.recv, 1, __ATOMIC_RELAXED);
+	s32 ret = host_ret(recvfrom(s, mem, len, flags, from, fromlen));
+	if (ret == -EAGAIN) __atomic_add_fetch(&host_net_calls.recvempty, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+#ifdef NET_HAS_IOVEC
+// Receives a message into the pieces in turn, from may be NULL
+s32 net_recvmsg(s32 s, const struct net_iovec *iov, s32 iovcnt, u32 flags, struct sockaddr *from, socklen_t *fromlen)
+{
+	struct iovec vec[NET_MAX_IOV];
+	struct msghdr msg;
+	s32 i;
+	if (iovcnt > NET_MAX_IOV) return -EINVAL;
+
+	__atomic_add_fetch(&host_net_calls.recv, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].iov_base = iov[i].base;
+		vec[i].iov_len = iov[i].len;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = from ? *fromlen : 0;
+	msg.msg_iov = vec;
+	msg.msg_iovlen = iovcnt;
+	s32 ret = host_ret(recvmsg(s, &msg, flags));
+	if (ret == -EAGAIN) __atomic_add_fetch(&host_net_calls.recvempty, 1, __ATOMIC_RELAXED);
+	if (from) *fromlen = msg.msg_namelen;
+	return ret;
+}
+#endif
+
+#ifdef NET_HAS_MMSG
+// Receives the messages which are there, up to count, in one call. Returns how many were received.
+s32 net_recvmmsg(s32 s, struct net_msg *msgs, s32 count, u32 flags)
+{
+	struct mmsghdr hdrs[NET_MAX_MSGS];
+	struct iovec vec[NET_MAX_MSGS][NET_MAX_IOV];
+	s32 i;
+	if (count > NET_MAX_MSGS) count = NET_MAX_MSGS;
+	for (i = 0; i < count; i++) if (msgs[i].iovcnt > NET_MAX_IOV) return -EINVAL;
+
+	__atomic_add_fetch(&host_net_calls.recv, 1, __ATOMIC_RELAXED);
+	host_mmsg(hdrs, vec, msgs, count);
+	s32 ret = host_ret(recvmmsg(s, hdrs, count, flags | MSG_DONTWAIT, NULL));
+	if (ret == -EAGAIN) __atomic_add_fetch(&host_net_calls.recvempty, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < ret; i++) {
+		msgs[i].len = hdrs[i].msg_len;
+		if (msgs[i].addr) msgs[i].addrlen = hdrs[i].msg_hdr.msg_namelen;
+	}
+	return ret;
+}
+#endif
+
+s32 net_close(s32 s)
+{
+	__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+	return host_ret(close(s));
+}
+
+// Only the non-blocking flag of IOS is known
+s32 net_fcntl(s32 s, u32 cmd, u32 flags)
+{
+	__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+	int current = fcntl(s, F_GETFL, 0);
+	if (current < 0) return -errno;
+	if (cmd == F_GETFL) return (current & O_NONBLOCK) ? IOS_O_NONBLOCK : 0;
+	if (cmd != F_SETFL) return -EINVAL;
+	current = (flags & IOS_O_NONBLOCK) ? current | O_NONBLOCK : current & ~O_NONBLOCK;
+	return host_ret(fcntl(s, F_SETFL, current));
+}
+
+s32 net_setsockopt(s32 s, u32 level, u32 optname, const void *optval, socklen_t optlen)
+{
+	__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+	return host_ret(setsockopt(s, level, optname, optval, optlen));
+}
+
+s32 net_poll(struct pollsd *sds, s32 nsds, s32 timeout)
+{
+	struct pollfd fds[32];
+	s32 i;
+	if (nsds > 32) return -EINVAL;
+
+	__atomic_add_fetch(&host_net_calls.poll, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nsds; i++) {
+		fds[i].fd = sds[i].socket;
+		fds[i].events = sds[i].events;
+		fds[i].revents = 0;
+	}
+	int ret = poll(fds, nsds, timeout);
+	if (ret < 0) return -errno;
+	for (i = 0; i < nsds; i++) sds[i].revents = fds[i].revents;
+	return ret;
+}
+
+#ifdef NET_HAS_RING
+#define HOST_MAX_RINGS 8
+#define HOST_RING_ENTRIES 32 // Submissions only start and stop the receives
+#define HOST_RING_COMPLETIONS 1024
+#define HOST_RING_GROUP 0 // The buffer group of the receive pool
+#define HOST_RING_SOCKETS 8
+#define HOST_RING_CANCEL (~0ULL) // The user data of the cancels, the receives carry their generation and socket
+
+// An io_uring with its queues mapped, and the pool of buffers the kernel receives the datagrams in
+typedef struct {
+	void *rings; // NULL when the slot isn't used
+	size_t ringssize;
+	s32 fd;
+	pthread_mutex_t lock; // Serializes the submissions
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	u32 *sqtail, *sqmask, *sqarray;
+	u32 *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *pool;
+	size_t poolsize;
+	u16 pooltail;
+	char *bufs;
+	u32 bufsize; // Including what recvmsg puts in front of the datagram
+	u32 numbufs;
+	struct msghdr msg; // The datagrams are received with their source address, without control data
+	s32 sockets[HOST_RING_SOCKETS];
+	s32 numsockets;
+	pthread_t owner; // The thread which started the receives
+	int owned; // All receives were started by owner, and none of them was stopped by the kernel
+	u32 generation; // Counts the moves, so the ends of the receives which were moved away are told apart
+	u32 unsubmitted; // Submissions which were queued but not made yet
+} host_ring;
+
+static host_ring host_rings[HOST_MAX_RINGS];
+static pthread_mutex_t host_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static host_ring *host_ring_find(s32 ring)
+{
+	s32 i;
+	for (i = 0; i < HOST_MAX_RINGS; i++) {
+		if (host_rings[i].rings && host_rings[i].fd == ring) return &host_rings[i];
+	}
+	return NULL;
+}
+
+// Hands a buffer to the kernel again, at offset from the tail of the pool. The tail is moved by the caller.
+static void host_ring_give(host_ring *r, u16 buffer, u16 offset)
+{
+	struct io_uring_buf *buf = &r->pool->bufs[(u16) (r->pooltail + offset) & (r->numbufs - 1)];
+	buf->addr = (u64) (uintptr_t) (r->bufs + (size_t) buffer * r->bufsize);
+	buf->len = r->bufsize;
+	buf->bid = buffer;
+}
+
+// Queues a submission, the lock has to be held. There's always room, the queue holds more than can be queued at once.
+static struct io_uring_sqe *host_ring_sqe(host_ring *r)
+{
+	u32 tail = *r->sqtail;
+	u32 index = tail & *r->sqmask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqarray[index] = index;
+	__atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+	r->unsubmitted++;
+	return sqe;
+}
+
+// Queues a receive on the socket which stays armed, every datagram which arrives takes a buffer of the pool.
+// The lock has to be held.
+static void host_ring_arm(host_ring *r, s32 s)
+{
+	struct io_uring_sqe *sqe = host_ring_sqe(r);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = s;
+	sqe->addr = (u64) (uintptr_t) &r->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = HOST_RING_GROUP;
+	sqe->user_data = ((u64) r->generation << 32) | (u32) s;
+}
+
+// The kernel finishes a receive on the thread which started it, and wakes that thread for it when it sleeps
+// elsewhere. It also stops the receives of a thread which exits. So the receives are stopped and started again
+// by the thread which waits for them now, the datagrams wait in the sockets meanwhile. The lock has to be held.
+static void host_ring_move(host_ring *r)
+{
+	s32 i;
+	struct io_uring_sqe *sqe = host_ring_sqe(r);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+	sqe->user_data = HOST_RING_CANCEL;
+	r->generation++;
+	for (i = 0; i < r->numsockets; i++) host_ring_arm(r, r->sockets[i]);
+	r->owner = pthread_self();
+	r->owned = 1;
+}
+
+// Makes the queued submissions, waiting up to timeout microseconds for a completion unless timeout is 0
+static s32 host_ring_enter(host_ring *r, u32 timeout)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	pthread_mutex_lock(&r->lock);
+	u32 submit = r->unsubmitted;
+	r->unsubmitted = 0;
+	pthread_mutex_unlock(&r->lock);
+	if (submit == 0 && timeout == 0) return 0;
+
+	if (timeout == 0) {
+		__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+		return host_ret(syscall(__NR_io_uring_enter, r->fd, submit, 0, 0, NULL, 0));
+	}
+	ts.tv_sec = timeout / 1000000;
+	ts.tv_nsec = (timeout % 1000000) * 1000;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (u64) (uintptr_t) &ts;
+	__atomic_add_fetch(&host_net_calls.poll, 1, __ATOMIC_RELAXED);
+	s32 ret = host_ret(syscall(__NR_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+	return ret == -ETIME || ret == -EINTR ? 0 : ret;
+}
+
+// Takes up to count datagrams out of the completion queue. A receive stops when the pool ran out of buffers,
+// it's queued again here, the datagrams which arrive meanwhile wait in the socket.
+static s32 host_ring_reap(host_ring *r, struct net_ring_msg *msgs, s32 count)
+{
+	u32 head = *r->cqhead;
+	u32 tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+	s32 n = 0;
+	while (head != tail && n < count) {
+		struct io_uring_cqe *cqe = &r->cqes[head++ & *r->cqmask];
+		s32 s = (s32) cqe->user_data;
+		if (cqe->user_data == HOST_RING_CANCEL) continue;
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			pthread_mutex_lock(&r->lock);
+			if (cqe->user_data >> 32 != r->generation) {
+				// Moved to another thread already
+			} else if (cqe->res >= 0 || cqe->res == -ENOBUFS) {
+				host_ring_arm(r, s);
+			} else {
+				r->owned = 0;
+			}
+			pthread_mutex_unlock(&r->lock);
+		}
+		if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+
+		u16 buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		char *buf = r->bufs + (size_t) buffer * r->bufsize;
+		struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+		u32 offset = sizeof(*out) + r->msg.msg_namelen;
+		u32 len = (u32) cqe->res - offset;
+
+		msgs[n].socket = s;
+		msgs[n].data = buf + offset;
+		msgs[n].len = out->payloadlen < len ? out->payloadlen : len;
+		memset(&msgs[n].from, 0, sizeof(msgs[n].from));
+		memcpy(&msgs[n].from, buf + sizeof(*out), out->namelen < sizeof(msgs[n].from) ? out->namelen : sizeof(msgs[n].from));
+		msgs[n].buffer = buffer;
+		n++;
+	}
+	__atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+// Unmaps and closes what was set up of a ring, host_rings_lock has to be held
+static void host_ring_free(host_ring *r)
+{
+	if (r->fd >= 0) close(r->fd);
+	if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqessize);
+	if (r->pool && r->pool != MAP_FAILED) munmap(r->pool, r->poolsize);
+	if (r->rings && r->rings != MAP_FAILED) munmap(r->rings, r->ringssize);
+	pthread_mutex_destroy(&r->lock);
+	free(r->bufs);
+	memset(r, 0, sizeof(*r));
+}
+
+// Makes a ring with a pool of numbufs buffers for datagrams of up to bufsize bytes, numbufs is a power of 2.
+// Returns its descriptor.
+s32 net_ring_create(u32 bufsize, u32 numbufs)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	host_ring *r = NULL;
+	s32 i, ret = -ENOMEM;
+	if (numbufs == 0 || numbufs > 32768 || (numbufs & (numbufs - 1))) return -EINVAL;
+
+	pthread_mutex_lock(&host_rings_lock);
+	for (i = 0; i < HOST_MAX_RINGS && r == NULL; i++) {
+		if (host_rings[i].rings == NULL) r = &host_rings[i];
+	}
+	if (r == NULL) {
+		pthread_mutex_unlock(&host_rings_lock);
+		return -ENFILE;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = HOST_RING_COMPLETIONS;
+	__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+	r->fd = syscall(__NR_io_uring_setup, HOST_RING_ENTRIES, &p);
+	if (r->fd < 0) {
+		ret = -errno;
+		r->fd = -1;
+		goto failed;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+
+	// One mapping holds both queues, the submissions are in another
+	size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(u32);
+	size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ringssize = sqsize > cqsize ? sqsize : cqsize;
+	r->rings = mmap(NULL, r->ringssize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->rings == MAP_FAILED || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		ret = -EOPNOTSUPP;
+		goto failed;
+	}
+	r->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto failed;
+
+	char *base = r->rings;
+	r->sqtail = (u32 *) (base + p.sq_off.tail);
+	r->sqmask = (u32 *) (base + p.sq_off.ring_mask);
+	r->sqarray = (u32 *) (base + p.sq_off.array);
+	r->cqhead = (u32 *) (base + p.cq_off.head);
+	r->cqtail = (u32 *) (base + p.cq_off.tail);
+	r->cqmask = (u32 *) (base + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+
+	// The pool is registered with the kernel, which picks a buffer for every datagram
+	r->msg.msg_namelen = sizeof(struct sockaddr_in);
+	r->bufsize = sizeof(struct io_uring_recvmsg_out) + r->msg.msg_namelen + bufsize;
+	r->numbufs = numbufs;
+	r->bufs = malloc((size_t) r->bufsize * numbufs);
+	r->poolsize = numbufs * sizeof(struct io_uring_buf);
+	r->pool = mmap(NULL, r->poolsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->bufs == NULL || r->pool == MAP_FAILED) goto failed;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u64) (uintptr_t) r->pool;
+	reg.ring_entries = numbufs;
+	reg.bgid = HOST_RING_GROUP;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		ret = -errno;
+		goto failed;
+	}
+	for (i = 0; i < (s32) numbufs; i++) host_ring_give(r, i, i);
+	r->pooltail = numbufs;
+	__atomic_store_n(&r->pool->tail, r->pooltail, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&host_rings_lock);
+	return r->fd;
+
+failed:
+	host_ring_free(r);
+	pthread_mutex_unlock(&host_rings_lock);
+	return ret;
+}
+
+// Receives every datagram which arrives on the socket into the ring from now on
+s32 net_ring_recv(s32 ring, s32 s)
+{
+	host_ring *r = host_ring_find(ring);
+	if (r == NULL) return -EBADF;
+
+	pthread_mutex_lock(&r->lock);
+	s32 ret = -ENOBUFS;
+	if (r->numsockets < HOST_RING_SOCKETS) {
+		r->sockets[r->numsockets++] = s;
+		host_ring_arm(r, s);
+		r->owned = r->owned && pthread_equal(r->owner, pthread_self());
+		ret = 0;
+	}
+	pthread_mutex_unlock(&r->lock);
+	if (ret < 0) return ret;
+	ret = host_ring_enter(r, 0);
+	return ret < 0 ? ret : 0;
+}
+
+// Collects up to count datagrams of the ring, waiting up to timeout microseconds for the first one.
+// Only the wait is a system call, the datagrams which are there already are taken straight from the ring.
+// They have to be given back with net_ring_release. Returns how many were collected.
+s32 net_ring_wait(s32 ring, struct net_ring_msg *msgs, s32 count, u32 timeout)
+{
+	host_ring *r = host_ring_find(ring);
+	if (r == NULL) return -EBADF;
+
+	pthread_mutex_lock(&r->lock);
+	if (!r->owned || !pthread_equal(r->owner, pthread_self())) host_ring_move(r);
+	pthread_mutex_unlock(&r->lock);
+
+	s32 n = host_ring_reap(r, msgs, count);
+	if (n == 0 && timeout > 0) {
+		s32 ret = host_ring_enter(r, timeout);
+		if (ret < 0) return ret;
+		n = host_ring_reap(r, msgs, count);
+	}
+
+	// What was moved or stopped meanwhile is started
+	s32 ret = host_ring_enter(r, 0);
+	return n > 0 || ret >= 0 ? n : ret;
+}
+
+// Gives the buffers of the datagrams back to the pool
+void net_ring_release(s32 ring, struct net_ring_msg *msgs, s32 count)
+{
+	host_ring *r = host_ring_find(ring);
+	s32 i;
+	if (r == NULL || count <= 0) return;
+	for (i = 0; i < count; i++) host_ring_give(r, msgs[i].buffer, i);
+	r->pooltail += count;
+	__atomic_store_n(&r->pool->tail, r->pooltail, __ATOMIC_RELEASE);
+}
+
+// Stops the receives and closes the ring, the sockets stay open
+s32 net_ring_close(s32 ring)
+{
+	pthread_mutex_lock(&host_rings_lock);
+	host_ring *r = host_ring_find(ring);
+	if (r) {
+		__atomic_add_fetch(&host_net_calls.other, 1, __ATOMIC_RELAXED);
+		host_ring_free(r);
+	}
+	pthread_mutex_unlock(&host_rings_lock);
+	return r ? 0 : -EBADF;
+}
+#endif
+
+s32 LWP_MutexInit(mutex_t *mutex, bool use_recursive)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	if (use_recursive) pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	*mutex = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(*mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return 0;
+}
+
+s32 LWP_MutexDestroy(mutex_t mutex)
+{
+	pthread_mutex_destroy(mutex);
+	free(mutex);
+	return 0;
+}
+
+s32 LWP_MutexLock(mutex_t mutex)
+{
+	return pthread_mutex_lock(mutex);
+}
+
+s32 LWP_MutexUnlock(mutex_t mutex)
+{
+	return pthread_mutex_unlock(mutex);
+}
+
+s32 LWP_CondInit(cond_t *cond)
+{
+	*cond = malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(*cond, NULL);
+	return 0;
+}
+
+s32 LWP_CondDestroy(cond_t cond)
+{
+	pthread_cond_destroy(cond);
+	free(cond);
+	return 0;
+}
+
+s32 LWP_CondTimedWait(cond_t cond, mutex_t mutex, const struct timespec *reltime)
+{
+	struct timespec abstime;
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec += reltime->tv_sec;
+	abstime.tv_nsec += reltime->tv_nsec;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+	return pthread_cond_timedwait(cond, mutex, &abstime);
+}
+
+s32 LWP_CondSignal(cond_t cond)
+{
+	return pthread_cond_signal(cond);
+}
+
+s32 LWP_CondBroadcast(cond_t cond)
+{
+	return pthread_cond_broadcast(cond);
+}
+
+s32 LWP_CreateThread(lwp_t *thethread, void *(*entry)(void *), void *arg, void *stackbase, u32 stack_size, u8 prio)
+{
+	return pthread_create(thethread, NULL, entry, arg) == 0 ? 0 : -1;
+}
+
+s32 LWP_JoinThread(lwp_t thethread, void **value_ptr)
+{
+	return pthread_join(thethread, value_ptr);
+}
+
+const devoptab_t *devoptab_list[STD_MAX];
+
+// Devices are found by the part of the name in front of the colon, or by the whole name without one
+int FindDevice(const char *name)
+{
+	const char *colon = strchr(name, ':');
+	size_t len = colon ? (size_t) (colon - name) : strlen(name);
+	int i;
+	for (i = 0; i < STD_MAX; i++) {
+		if (devoptab_list[i] && strlen(devoptab_list[i]->name) == len && strncmp(devoptab_list[i]->name, name, len) == 0) return i;
+	}
+	return -1;
+}
+
+int AddDevice(const devoptab_t *device)
+{
+	int i;
+	for (i = 0; i < STD_MAX; i++) {
+		if (devoptab_list[i] == NULL) {
+			devoptab_list[i] = device;
+			return i;
+		}
+	}
+	return -1;
+}
+
+int RemoveDevice(const char *name)
+{
+	int dev = FindDevice(name);
+	if (dev < 0) return -1;
+	devoptab_list[dev] = NULL;
+	return 0;
+}
+
+const devoptab_t *GetDeviceOpTab(const char *name)
+{
+	int dev = FindDevice(name);
+	return dev < 0 ? NULL : devoptab_list[dev];
+}
+
+__handle *__get_handle(int fd)
+{
+	return NULL;
+}
@@ -0,0 +1,137 @@
+/*
+ network.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// The net_* calls of libogc on top of BSD sockets. Like on the console they return -errno on failure,
+// and every call which reaches the kernel is counted, so the benchmarks can report the calls per transfer.
+
+#ifndef _NETWORK_H_
+#define _NETWORK_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include "gctypes.h"
+
+// Vectored sends and receives, which libogc doesn't have: the library copies the pieces itself without NET_HAS_IOVEC
+#define NET_HAS_IOVEC
+
+#ifdef NET_HAS_IOVEC
+#define NET_MAX_IOV 8
+
+struct net_iovec {
+	void *base;
+	u32 len;
+};
+#endif
+
+// Several datagrams per call, which libogc doesn't have either: the library loops over them without NET_HAS_MMSG
+#define NET_HAS_MMSG
+
+#ifdef NET_HAS_MMSG
+#define NET_MAX_MSGS 16
+
+struct net_msg {
+	struct net_iovec *iov;
+	s32 iovcnt;
+	struct sockaddr *addr;	// Where to send to or where it came from, NULL on connected sockets
+	socklen_t addrlen;
+	u32 len;		// The amount of bytes sent or received
+};
+#endif
+
+// A completion ring, which libogc doesn't have either: the kernel receives the datagrams of several sockets into
+// a pool of buffers while nobody waits, and one call collects all of them. Its descriptor can be polled, it's
+// readable while datagrams are waiting in the ring. Without NET_HAS_RING the library polls the sockets.
+#define NET_HAS_RING
+
+#ifdef NET_HAS_RING
+struct net_ring_msg {
+	s32 socket;		// The socket it arrived on
+	void *data;		// The datagram, in a buffer of the ring until it's released
+	u32 len;
+	struct sockaddr_in from;
+	u16 buffer;
+};
+#endif
+
+struct pollsd {
+	s32 socket;
+	u32 events;
+	u32 revents;
+};
+
+// Counters of the socket calls made through the net_* functions
+typedef struct {
+	u32 send;	// net_send, net_sendto, net_sendmsg and net_sendmmsg
+	u32 recv;	// net_recv, net_recvfrom, net_recvmsg and net_recvmmsg, also the ones which found nothing
+	u32 recvempty;	// The receives which found nothing
+	u32 poll;	// net_poll, and net_ring_wait when it had to wait
+	u32 other;	// Setting up and closing sockets
+} host_net_counters;
+
+extern host_net_counters host_net_calls;
+void host_net_reset(void);
+u32 host_net_total(void);
+
+s32 net_init(void);
+u32 net_gethostip(void);
+s32 net_socket(u32 domain, u32 type, u32 protocol);
+s32 net_bind(s32 s, struct sockaddr *name, socklen_t namelen);
+s32 net_connect(s32 s, struct sockaddr *name, socklen_t namelen);
+s32 net_send(s32 s, const void *data, s32 size, u32 flags);
+s32 net_sendto(s32 s, const void *data, s32 len, u32 flags, struct sockaddr *to, socklen_t tolen);
+#ifdef NET_HAS_IOVEC
+s32 net_sendmsg(s32 s, const struct net_iovec *iov, s32 iovcnt, u32 flags, struct sockaddr *to, socklen_t tolen);
+#endif
+#ifdef NET_HAS_MMSG
+s32 net_sendmmsg(s32 s, struct net_msg *msgs, s32 count, u32 flags);
+#endif
+s32 net_recv(s32 s, void *mem, s32 len, u32 flags);
+s32 net_recvfrom(s32 s, void *mem, s32 len, u32 flags, struct sockaddr *from, socklen_t *fromlen);
+#ifdef NET_HAS_IOVEC
+s32 net_recvmsg(s32 s, const struct net_iovec *iov, s32 iovcnt, u32 flags, struct sockaddr *from, socklen_t *fromlen);
+#endif
+#ifdef NET_HAS_MMSG
+s32 net_recvmmsg(s32 s, struct net_msg *msgs, s32 count, u32 flags);
+#endif
+s32 net_close(s32 s);
+s32 net_fcntl(s32 s, u32 cmd, u32 flags);
+s32 net_setsockopt(s32 s, u32 level, u32 optname, const void *optval, socklen_t optlen);
+s32 net_poll(struct pollsd *sds, s32 nsds, s32 timeout);
+#ifdef NET_HAS_RING
+s32 net_ring_create(u32 bufsize, u32 numbufs);
+s32 net_ring_recv(s32 ring, s32 s);
+s32 net_ring_wait(s32 ring, struct net_ring_msg *msgs, s32 count, u32 timeout);
+void net_ring_release(s32 ring, struct net_ring_msg *msgs, s32 count);
+s32 net_ring_close(s32 ring);
+#endif
+
+#endif // _NETWORK_H_
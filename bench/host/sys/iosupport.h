@@ -0,0 +1,93 @@
+/*
+ iosupport.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// The devoptab interface of newlib, devices are registered in a table of the host harness
+
+#ifndef _SYS_IOSUPPORT_H_
+#define _SYS_IOSUPPORT_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+struct _reent {
+	int _errno;
+};
+
+typedef struct {
+	int device;
+	void *dirStruct;
+} DIR_ITER;
+
+typedef struct {
+	int device;
+	int refcount;
+	void *fileStruct;
+} __handle;
+
+typedef struct {
+	const char *name;
+	int structSize;
+	int (*open_r)(struct _reent *r, void *fileStruct, const char *path, int flags, int mode);
+	int (*close_r)(struct _reent *r, int fd);
+	ssize_t (*write_r)(struct _reent *r, int fd, const char *ptr, size_t len);
+	ssize_t (*read_r)(struct _reent *r, int fd, char *ptr, size_t len);
+	off_t (*seek_r)(struct _reent *r, int fd, off_t pos, int dir);
+	int (*fstat_r)(struct _reent *r, int fd, struct stat *st);
+	int (*stat_r)(struct _reent *r, const char *file, struct stat *st);
+	int (*link_r)(struct _reent *r, const char *existing, const char *newLink);
+	int (*unlink_r)(struct _reent *r, const char *name);
+	int (*chdir_r)(struct _reent *r, const char *name);
+	int (*rename_r)(struct _reent *r, const char *oldName, const char *newName);
+	int (*mkdir_r)(struct _reent *r, const char *path, int mode);
+	int dirStateSize;
+	DIR_ITER *(*diropen_r)(struct _reent *r, DIR_ITER *dirState, const char *path);
+	int (*dirreset_r)(struct _reent *r, DIR_ITER *dirState);
+	int (*dirnext_r)(struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat);
+	int (*dirclose_r)(struct _reent *r, DIR_ITER *dirState);
+	int (*statvfs_r)(struct _reent *r, const char *path, struct statvfs *buf);
+	int (*ftruncate_r)(struct _reent *r, int fd, off_t len);
+	int (*fsync_r)(struct _reent *r, int fd);
+	void *deviceData;
+	int (*chmod_r)(struct _reent *r, const char *path, mode_t mode);
+	int (*fchmod_r)(struct _reent *r, int fd, mode_t mode);
+} devoptab_t;
+
+#define STD_MAX 16
+
+extern const devoptab_t *devoptab_list[STD_MAX];
+
+int AddDevice(const devoptab_t *device);
+int FindDevice(const char *name);
+int RemoveDevice(const char *name);
+const devoptab_t *GetDeviceOpTab(const char *name);
+
+// POSIX file descriptors aren't routed to the devices, so this never finds one
+__handle *__get_handle(int fd);
+
+#endif // _SYS_IOSUPPORT_H_
@@ -0,0 +1,699 @@
+/*
+ mock_server.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// The library encodes the words of calls and replies in the byte order of the console. On a little endian host
+// the stand-in speaks that order too, only the TCP record marks are in network order like on the console.
+// Ports are passed around the same way: the portmapper answers with the port as the library stores it.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "mock_server.h"
+
+#define PROGRAM_PORTMAP		100000
+#define PROGRAM_NFS		100003
+#define PROGRAM_MOUNT		100005
+
+#define NFS3_OK			0
+#define NFS3ERR_NOENT		2
+#define NFS3ERR_STALE		70
+#define NFS3ERR_NOTSUPP		10004
+
+#define MOCK_FILES		16
+#define MOCK_CONNS		8
+#define MOCK_PROCEDURES		22
+#define MOCK_MAX_REPLY		(128 * 1024 + 512)
+#define MOCK_CONN_BUFFER	(256 * 1024)
+
+typedef struct {
+	char name[64];		// Empty when unused, the root directory has no name
+	int32_t type;		// 1 for a file, 2 for a directory
+	uint8_t *data;
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t change;	// Goes into the nanoseconds of mtime and ctime, so every change is seen
+} mock_file;
+
+typedef struct mock_reply {
+	uint64_t due;
+	int32_t socket;
+	int32_t tcp;
+	struct sockaddr_in to;
+	uint32_t len;
+	struct mock_reply *next;
+	uint8_t data[];
+} mock_reply;
+
+typedef struct {
+	int32_t socket;		// -1 when unused
+	uint8_t *buffer;
+	uint32_t len;
+} mock_conn;
+
+typedef struct {
+	uint8_t *buf;
+	uint32_t len;
+} mock_out;
+
+static int32_t portmap_socket = -1, mount_socket = -1, nfs_socket = -1, listen_socket = -1;
+static uint16_t portmap_port, mount_port, nfs_port;
+static mock_conn conns[MOCK_CONNS];
+static mock_file files[MOCK_FILES];
+static uint32_t change;
+
+static mock_reply *queue = NULL, *queuetail = NULL;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int running = 0;
+static volatile uint32_t latency = 0;
+static volatile int down = 0;
+static volatile uint32_t calls[MOCK_PROCEDURES];
+
+static uint64_t mock_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint8_t mock_pattern(uint64_t offset)
+{
+	return (uint8_t) (offset * 31 + (offset >> 12));
+}
+
+static uint32_t get_word(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint64_t get_long(const uint8_t *p)
+{
+	return ((uint64_t) get_word(p) << 32) | get_word(p + 4);
+}
+
+static void put_word(mock_out *out, uint32_t v)
+{
+	memcpy(out->buf + out->len, &v, 4);
+	out->len += 4;
+}
+
+static void put_bytes(mock_out *out, const void *data, uint32_t len)
+{
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+	while (out->len & 3) out->buf[out->len++] = 0;
+}
+
+static void put_handle(mock_out *out, int32_t index)
+{
+	uint8_t handle[8] = { 'M', 'O', 'C', 'K' };
+	memcpy(handle + 4, &index, 4);
+	put_word(out, sizeof(handle));
+	put_bytes(out, handle, sizeof(handle));
+}
+
+// The object attributes, in the layout the library copies them from
+static void put_attr(mock_out *out, int32_t index)
+{
+	mock_file *f = &files[index];
+	put_word(out, f->type);
+	put_word(out, f->type == 2 ? S_IFDIR | 0755 : S_IFREG | 0644);
+	put_word(out, 1);			// nlink
+	put_word(out, 0);			// uid
+	put_word(out, 0);			// gid
+	put_word(out, 0);			// size, the upper word
+	put_word(out, f->size);
+	put_word(out, 0);			// used
+	put_word(out, f->size);
+	put_word(out, 0);			// rdev
+	put_word(out, 0);
+	put_word(out, 0);			// fsid
+	put_word(out, 1);
+	put_word(out, 0);			// fileid
+	put_word(out, index + 1);
+	put_word(out, 1000000000);		// atime
+	put_word(out, 0);
+	put_word(out, 1000000000);		// mtime
+	put_word(out, f->change);
+	put_word(out, 1000000000);		// ctime
+	put_word(out, f->change);
+}
+
+static void put_post_op(mock_out *out, int32_t index)
+{
+	put_word(out, 1);
+	put_attr(out, index);
+}
+
+// wcc_data without the attributes from before, like many servers send it
+static void put_wcc(mock_out *out, int32_t index)
+{
+	put_word(out, 0);
+	put_post_op(out, index);
+}
+
+// Reads a handle, returns the index of its file or -1 when it's stale. Moves p past it.
+static int32_t get_handle(const uint8_t **p)
+{
+	uint32_t len = get_word(*p);
+	const uint8_t *val = *p + 4;
+	*p += 4 + ((len + 3) & ~3);
+	if (len != 8 || memcmp(val, "MOCK", 4) != 0) return -1;
+
+	int32_t index;
+	memcpy(&index, val + 4, 4);
+	if (index < 0 || index >= MOCK_FILES || (index > 0 && files[index].name[0] == 0)) return -1;
+	return index;
+}
+
+// Reads a string into name, moves p past it
+static void get_string(const uint8_t **p, char *name, uint32_t size)
+{
+	uint32_t len = get_word(*p);
+	uint32_t copy = len < size - 1 ? len : size - 1;
+	memcpy(name, *p + 4, copy);
+	name[copy] = 0;
+	*p += 4 + ((len + 3) & ~3);
+}
+
+// Skips a sattr3, returns the size to set or -1
+static int64_t get_sattr(const uint8_t **p)
+{
+	int64_t size = -1;
+	if (get_word(*p)) *p += 4;	// mode
+	*p += 4;
+	if (get_word(*p)) *p += 4;	// uid
+	*p += 4;
+	if (get_word(*p)) *p += 4;	// gid
+	*p += 4;
+	if (get_word(*p)) {
+		size = get_long(*p + 4);
+		*p += 8;
+	}
+	*p += 4;
+	if (get_word(*p) == 2) *p += 8;	// atime set by the client
+	*p += 4;
+	if (get_word(*p) == 2) *p += 8;	// mtime
+	*p += 4;
+	return size;
+}
+
+static int32_t mock_find(const char *name)
+{
+	int32_t i;
+	for (i = 1; i < MOCK_FILES; i++) {
+		if (files[i].name[0] != 0 && strcmp(files[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+static void mock_resize(mock_file *f, uint32_t size)
+{
+	if (size > f->capacity) {
+		f->capacity = size + size / 2;
+		f->data = realloc(f->data, f->capacity);
+	}
+	if (size > f->size) memset(f->data + f->size, 0, size - f->size);
+	f->size = size;
+	f->change = ++change;
+}
+
+static int32_t mock_create(const char *name)
+{
+	int32_t i;
+	for (i = 1; i < MOCK_FILES && files[i].name[0] != 0; i++);
+	if (i == MOCK_FILES) return -1;
+
+	strncpy(files[i].name, name, sizeof(files[i].name) - 1);
+	files[i].type = 1;
+	files[i].size = 0;
+	files[i].change = ++change;
+	files[0].change = change;
+	return i;
+}
+
+static void mock_nfs(uint32_t procedure, const uint8_t *args, mock_out *out)
+{
+	int32_t index = -1, dir;
+	char name[64];
+	uint64_t offset;
+	uint32_t count;
+
+	if (procedure < MOCK_PROCEDURES) __atomic_add_fetch(&calls[procedure], 1, __ATOMIC_RELAXED);
+	if (procedure != 0 && procedure != 3 && procedure != 8) {
+		index = get_handle(&args);
+		if (index < 0) {
+			put_word(out, NFS3ERR_STALE);
+			put_word(out, 0);
+			return;
+		}
+	}
+
+	mock_file *f = index >= 0 ? &files[index] : NULL;
+	switch (procedure)
+	{
+		case 0: // NULL
+			break;
+		case 1: // GETATTR
+			put_word(out, NFS3_OK);
+			put_attr(out, index);
+			break;
+		case 2: // SETATTR
+		{
+			int64_t size = get_sattr(&args);
+			if (size >= 0) mock_resize(f, size);
+			put_word(out, NFS3_OK);
+			put_wcc(out, index);
+			break;
+		}
+		case 3: // LOOKUP
+		case 8: // CREATE
+			dir = get_handle(&args);
+			if (dir < 0) {
+				put_word(out, NFS3ERR_STALE);
+				put_word(out, 0);
+				break;
+			}
+			get_string(&args, name, sizeof(name));
+			index = mock_find(name);
+			if (procedure == 8) {
+				uint32_t how = get_word(args);
+				args += 4;
+				int64_t size = how != 2 ? get_sattr(&args) : -1;
+				if (index < 0) index = mock_create(name);
+				if (index >= 0 && size >= 0) mock_resize(&files[index], size);
+			}
+			if (index < 0) {
+				put_word(out, NFS3ERR_NOENT);
+				if (procedure == 8) put_word(out, 0);
+				put_post_op(out, dir);
+				break;
+			}
+			put_word(out, NFS3_OK);
+			if (procedure == 8) put_word(out, 1);
+			put_handle(out, index);
+			put_post_op(out, index);
+			if (procedure == 8) put_wcc(out, dir);
+			else put_post_op(out, dir);
+			break;
+		case 4: // ACCESS
+			put_word(out, NFS3_OK);
+			put_post_op(out, index);
+			put_word(out, get_word(args));
+			break;
+		case 6: // READ
+			offset = get_long(args);
+			count = get_word(args + 8);
+			if (offset > f->size) offset = f->size;
+			if (count > f->size - offset) count = f->size - offset;
+			if (count > MOCK_MAX_REPLY - 512) count = MOCK_MAX_REPLY - 512;
+			put_word(out, NFS3_OK);
+			put_post_op(out, index);
+			put_word(out, count);
+			put_word(out, offset + count >= f->size);
+			put_word(out, count);
+			put_bytes(out, f->data + offset, count);
+			break;
+		case 7: // WRITE
+		{
+			offset = get_long(args);
+			uint32_t stable = get_word(args + 12);
+			count = get_word(args + 16);
+			if (offset + count > f->size) mock_resize(f, offset + count);
+			memcpy(f->data + offset, args + 20, count);
+			f->change = ++change;
+			put_word(out, NFS3_OK);
+			put_wcc(out, index);
+			put_word(out, count);
+			put_word(out, stable);
+			put_word(out, 0x4d4f434b);	// Verifier
+			put_word(out, 1);
+			break;
+		}
+		case 18: // FSSTAT
+			put_word(out, NFS3_OK);
+			put_post_op(out, index);
+			for (count = 0; count < 12; count++) put_word(out, 0x10000000);
+			put_word(out, 0);	// invarsec
+			break;
+		case 19: // FSINFO
+			put_word(out, NFS3_OK);
+			put_post_op(out, index);
+			put_word(out, 65536);	// rtmax
+			put_word(out, 32768);	// rtpref
+			put_word(out, 4096);	// rtmult
+			put_word(out, 65536);	// wtmax
+			put_word(out, 32768);	// wtpref
+			put_word(out, 4096);	// wtmult
+			put_word(out, 8192);	// dtpref
+			put_word(out, 0x7fffffff);	// maxfilesize
+			put_word(out, 0xffffffff);
+			put_word(out, 0);	// time_delta
+			put_word(out, 1);
+			put_word(out, 0x1b);	// properties
+			break;
+		case 21: // COMMIT
+			put_word(out, NFS3_OK);
+			put_wcc(out, index);
+			put_word(out, 0x4d4f434b);
+			put_word(out, 1);
+			break;
+		default:
+			put_word(out, NFS3ERR_NOTSUPP);
+			put_word(out, 0);
+			break;
+	}
+}
+
+// Answers a call, returns 0 when there is a reply in out
+static int32_t mock_call(const uint8_t *call, uint32_t len, mock_out *out)
+{
+	if (len < 40 || get_word(call + 4) != 0) return -1;
+
+	uint32_t program = get_word(call + 12);
+	uint32_t procedure = get_word(call + 20);
+
+	// Skip the credentials and the verifier
+	const uint8_t *args = call + 24;
+	args += 8 + ((get_word(args + 4) + 3) & ~3);
+	args += 8 + ((get_word(args + 4) + 3) & ~3);
+
+	out->len = 0;
+	put_word(out, get_word(call));	// xid
+	put_word(out, 1);		// REPLY
+	put_word(out, 0);		// Accepted
+	put_word(out, 0);		// AUTH_NULL verifier
+	put_word(out, 0);
+	put_word(out, 0);		// Success
+
+	if (program == PROGRAM_PORTMAP) {
+		if (procedure == 3) {
+			uint32_t asked = get_word(args);
+			uint16_t port = asked == PROGRAM_MOUNT ? mount_port : asked == PROGRAM_NFS ? nfs_port : 0;
+			put_word(out, htons(port));
+		}
+	} else if (program == PROGRAM_MOUNT) {
+		if (procedure == 1) {
+			char dir[256];
+			get_string(&args, dir, sizeof(dir));
+			if (strcmp(dir, MOCK_EXPORT) != 0) {
+				put_word(out, NFS3ERR_NOENT);
+			} else {
+				put_word(out, NFS3_OK);
+				put_handle(out, 0);
+				put_word(out, 1);	// Flavors
+				put_word(out, 1);	// AUTH_UNIX
+			}
+		}
+	} else if (program == PROGRAM_NFS) {
+		mock_nfs(procedure, args, out);
+	} else {
+		out->buf[20] = 1;		// Program unavailable
+	}
+	return 0;
+}
+
+// Holds a reply back until the latency passed
+static void mock_queue(int32_t socket, int32_t tcp, struct sockaddr_in *to, mock_out *out)
+{
+	mock_reply *reply = malloc(sizeof(mock_reply) + out->len + 4);
+	reply->due = mock_now() + latency;
+	reply->socket = socket;
+	reply->tcp = tcp;
+	if (to) reply->to = *to;
+	reply->next = NULL;
+	if (tcp) {
+		uint32_t mark = htonl(0x80000000 | out->len);
+		memcpy(reply->data, &mark, 4);
+		memcpy(reply->data + 4, out->buf, out->len);
+		reply->len = out->len + 4;
+	} else {
+		memcpy(reply->data, out->buf, out->len);
+		reply->len = out->len;
+	}
+
+	if (queuetail) queuetail->next = reply;
+	else queue = reply;
+	queuetail = reply;
+}
+
+static void mock_send_due(void)
+{
+	uint64_t now = mock_now();
+	while (queue && queue->due <= now) {
+		mock_reply *reply = queue;
+		queue = reply->next;
+		if (queue == NULL) queuetail = NULL;
+
+		if (!reply->tcp) {
+			sendto(reply->socket, reply->data, reply->len, 0, (struct sockaddr *) &reply->to, sizeof(reply->to));
+		} else {
+			uint32_t sent = 0;
+			while (sent < reply->len) {
+				ssize_t ret = send(reply->socket, reply->data + sent, reply->len - sent, MSG_NOSIGNAL);
+				if (ret > 0) sent += ret;
+				else if (ret < 0 && errno == EAGAIN) {
+					struct pollfd pfd = { reply->socket, POLLOUT, 0 };
+					poll(&pfd, 1, 100);
+				} else break;
+			}
+		}
+		free(reply);
+	}
+}
+
+static void mock_udp(int32_t socket, mock_out *out)
+{
+	static uint8_t buffer[MOCK_MAX_REPLY];
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	ssize_t len = recvfrom(socket, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen);
+	if (len <= 0 || down) return;
+
+	pthread_mutex_lock(&lock);
+	if (mock_call(buffer, len, out) == 0) mock_queue(socket, 0, &from, out);
+	pthread_mutex_unlock(&lock);
+}
+
+static void mock_tcp(mock_conn *conn, mock_out *out)
+{
+	ssize_t len = recv(conn->socket, conn->buffer + conn->len, MOCK_CONN_BUFFER - conn->len, MSG_DONTWAIT);
+	if (len == 0 || (len < 0 && errno != EAGAIN)) {
+		close(conn->socket);
+		conn->socket = -1;
+		conn->len = 0;
+		return;
+	}
+	if (len < 0) return;
+	conn->len += len;
+
+	// Calls are sent as a single fragment
+	while (conn->len >= 4) {
+		uint32_t mark;
+		memcpy(&mark, conn->buffer, 4);
+		uint32_t fragment = ntohl(mark) & 0x7fffffff;
+		if (conn->len < 4 + fragment) break;
+
+		if (!down) {
+			pthread_mutex_lock(&lock);
+			if (mock_call(conn->buffer + 4, fragment, out) == 0) mock_queue(conn->socket, 1, NULL, out);
+			pthread_mutex_unlock(&lock);
+		}
+		conn->len -= 4 + fragment;
+		memmove(conn->buffer, conn->buffer + 4 + fragment, conn->len);
+	}
+}
+
+static void *mock_thread(void *arg)
+{
+	static uint8_t replybuf[MOCK_MAX_REPLY];
+	mock_out out = { replybuf, 0 };
+	struct pollfd fds[4 + MOCK_CONNS];
+	int32_t i;
+
+	while (running) {
+		int32_t numfds = 0;
+		fds[numfds++].fd = portmap_socket;
+		fds[numfds++].fd = mount_socket;
+		fds[numfds++].fd = nfs_socket;
+		fds[numfds++].fd = listen_socket;
+		for (i = 0; i < MOCK_CONNS; i++) fds[numfds++].fd = conns[i].socket;
+		for (i = 0; i < numfds; i++) {
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+
+		// Sleep until the next reply is due, or for a while to see whether the server is stopped
+		struct timespec timeout = { 0, 50000000 };
+		if (queue) {
+			uint64_t now = mock_now();
+			uint64_t wait = queue->due > now ? queue->due - now : 0;
+			timeout.tv_sec = wait / 1000000;
+			timeout.tv_nsec = (wait % 1000000) * 1000;
+		}
+		ppoll(fds, numfds, &timeout, NULL);
+		mock_send_due();
+
+		if (fds[0].revents) mock_udp(portmap_socket, &out);
+		if (fds[1].revents) mock_udp(mount_socket, &out);
+		if (fds[2].revents) mock_udp(nfs_socket, &out);
+		if (fds[3].revents) {
+			int32_t socket = accept(listen_socket, NULL, NULL);
+			for (i = 0; i < MOCK_CONNS && conns[i].socket >= 0; i++);
+			if (i == MOCK_CONNS) close(socket);
+			else if (socket >= 0) conns[i].socket = socket;
+		}
+		for (i = 0; i < MOCK_CONNS; i++) {
+			if (fds[4 + i].fd >= 0 && fds[4 + i].revents) mock_tcp(&conns[i], &out);
+		}
+		mock_send_due();
+	}
+	return NULL;
+}
+
+// Opens a socket on the loopback interface, on the port of the NFS socket for its TCP listener
+static int32_t mock_socket(int32_t type, uint16_t *port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int32_t s = socket(AF_INET, type, 0);
+	if (s < 0) return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(*port);
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0 || getsockname(s, (struct sockaddr *) &addr, &len) < 0) {
+		close(s);
+		return -1;
+	}
+	if (type == SOCK_STREAM) listen(s, MOCK_CONNS);
+
+	// Room for a window of large READ replies and WRITE calls
+	int32_t size = 4 * 1024 * 1024;
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	*port = ntohs(addr.sin_port);
+	return s;
+}
+
+int mock_start(uint32_t filesize)
+{
+	int32_t i;
+	portmap_port = mount_port = nfs_port = 0;
+	portmap_socket = mock_socket(SOCK_DGRAM, &portmap_port);
+	mount_socket = mock_socket(SOCK_DGRAM, &mount_port);
+	nfs_socket = mock_socket(SOCK_DGRAM, &nfs_port);
+	listen_socket = mock_socket(SOCK_STREAM, &nfs_port);
+	if (portmap_socket < 0 || mount_socket < 0 || nfs_socket < 0 || listen_socket < 0) return -1;
+
+	for (i = 0; i < MOCK_CONNS; i++) {
+		conns[i].socket = -1;
+		conns[i].buffer = malloc(MOCK_CONN_BUFFER);
+		conns[i].len = 0;
+	}
+
+	memset(files, 0, sizeof(files));
+	files[0].type = 2;
+	i = mock_create("file.bin");
+	mock_resize(&files[i], filesize);
+	uint32_t offset;
+	for (offset = 0; offset < filesize; offset++) files[i].data[offset] = mock_pattern(offset);
+
+	running = 1;
+	return pthread_create(&thread, NULL, mock_thread, NULL) == 0 ? 0 : -1;
+}
+
+void mock_stop(void)
+{
+	int32_t i;
+	running = 0;
+	pthread_join(thread, NULL);
+
+	close(portmap_socket);
+	close(mount_socket);
+	close(nfs_socket);
+	close(listen_socket);
+	for (i = 0; i < MOCK_CONNS; i++) {
+		if (conns[i].socket >= 0) close(conns[i].socket);
+		free(conns[i].buffer);
+	}
+	for (i = 0; i < MOCK_FILES; i++) free(files[i].data);
+	while (queue) {
+		mock_reply *reply = queue;
+		queue = reply->next;
+		free(reply);
+	}
+	queuetail = NULL;
+}
+
+uint16_t mock_portmapper_port(void)
+{
+	return portmap_port;
+}
+
+void mock_set_latency(uint32_t us)
+{
+	latency = us;
+}
+
+void mock_set_down(int value)
+{
+	down = value;
+}
+
+uint32_t mock_calls(uint32_t procedure)
+{
+	return procedure < MOCK_PROCEDURES ? calls[procedure] : 0;
+}
+
+void mock_reset_calls(void)
+{
+	memset((void *) calls, 0, sizeof(calls));
+}
+
+void mock_truncate(const char *name, uint32_t size)
+{
+	pthread_mutex_lock(&lock);
+	int32_t index = mock_find(name);
+	if (index >= 0) mock_resize(&files[index], size);
+	pthread_mutex_unlock(&lock);
+}
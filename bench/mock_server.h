@@ -0,0 +1,62 @@
+/*
+ mock_server.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// A stand-in for a NFSv3 server with its portmapper and mount service, on the loopback interface.
+// It serves a flat directory from memory, and holds every reply back for the injected latency.
+
+#ifndef _MOCK_SERVER_H_
+#define _MOCK_SERVER_H_
+
+#include <stdint.h>
+
+#define MOCK_EXPORT "/export"
+
+// Starts the server in a thread, with file.bin of filesize bytes in the root directory
+int mock_start(uint32_t filesize);
+void mock_stop(void);
+
+// The port of the portmapper, in host order
+uint16_t mock_portmapper_port(void);
+
+// How long every reply is held back, in microseconds
+void mock_set_latency(uint32_t latency);
+
+// While the server is down, every call is dropped without a reply
+void mock_set_down(int down);
+
+// The amount of calls per NFS procedure since the last reset
+uint32_t mock_calls(uint32_t procedure);
+void mock_reset_calls(void);
+
+// The byte at offset of file.bin
+uint8_t mock_pattern(uint64_t offset);
+
+// Sets the size of a file on the server, without the client knowing
+void mock_truncate(const char *name, uint32_t size);
+
+#endif // _MOCK_SERVER_H_
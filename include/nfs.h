@@ -30,12 +30,17 @@
 #ifndef _LIBNFS_H
 #define _LIBNFS_H
 
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define NFS_READWRITE 0
 #define NFS_READONLY 1
+#define NFS_TCP 2 // Use a TCP connection for the NFS calls instead of UDP, can be combined with NFS_READONLY
+#define NFS_LAZY 4 // Return right away and mount in the background, the first call on the mountpoint waits for it
+#define NFS_RING 8 // Receive the UDP replies of all flows through a completion ring where the network has one, not on the console or over TCP
 
 /*
 Mount the network storage specified by the ipAddress of the server, and the mountdirectory 
@@ -46,13 +51,167 @@ initiliaze async, make sure you've done so before calling nfsMount.
 */
 extern bool nfsMount(const char *name, const char *ipAddress, const char *mountdir);
 
-extern bool nfsMountEx(const char *name, const char *ipAddress, const char *mountdir, uint32_t uid, uint32_t gid, uint32_t readonly);
+extern bool nfsMountEx(const char *name, const char *ipAddress, const char *mountdir, uint32_t uid, uint32_t gid, uint32_t flags);
+
+// Settings of a single mountpoint, start from nfsMountDefaultOpts and change what's needed
+typedef struct {
+	uint32_t flags; // NFS_READWRITE, NFS_READONLY, NFS_TCP, NFS_LAZY and NFS_RING
+	uint32_t uid;
+	uint32_t gid;
+	// Smaller blocks than rsize and wsize are used while larger ones lose too much or aren't faster
+	uint32_t rsize; // The max amount of data per READ call, 0 to let the server and the transport decide
+	uint32_t wsize; // The max amount of data per WRITE call, 0 to let the server and the transport decide
+	uint32_t buffersize; // The size of the buffers calls and replies are kept in, limits READ calls over UDP, and WRITE calls without vectored sends
+	uint32_t maxdatagram; // The largest UDP datagram the network stack can send, 0 for no limit
+	uint32_t timeout; // The retransmit timeout in microseconds until round trip times are measured
+	uint32_t mintimeout; // The bounds of the retransmit timeout in microseconds
+	uint32_t maxtimeout;
+	uint32_t retries; // The amount of times a call is sent before giving up
+	uint32_t hedge; // READ, GETATTR, LOOKUP and READDIRPLUS calls over UDP are sent a second time when their reply takes
+	                // longer than this percentile (1-99) of the recent round trips, 0 to wait for the retransmit timeout
+	uint32_t readwindow; // The max amount of READ calls in flight per file and flow
+	uint32_t writewindow; // The max amount of WRITE calls in flight per file and flow
+	uint32_t commitbuffer; // The amount of written data kept per file until it's committed
+	uint32_t flows; // The amount of sockets READ and WRITE calls are striped over
+	uint32_t attrcache; // The amount of files and directories of which the attributes are kept, 0 to always ask the server
+	uint32_t acregmin; // How long the attributes of a file are used before asking again, in microseconds. The longer they
+	uint32_t acregmax; // stay the same, the closer to the max they are kept
+	uint32_t acdirmin; // The same for directories
+	uint32_t acdirmax;
+	uint32_t namecache; // The amount of names in directories of which the handle is kept, as long as the directory doesn't change
+	uint32_t readcache; // The amount of memory used to keep blocks read from files, while the file keeps the same mtime and size
+	                    // Reads of up to 4 blocks go through it, larger ones go straight to the server. 0 to not cache reads
+	uint32_t readcacheblock; // The size of those blocks, reads from the server are aligned to it
+	uint32_t probeinterval; // How long the server may stay silent before it's checked with a NULL call, in microseconds
+	                        // While it doesn't answer, calls fail right away instead of waiting out their retries, 0 to not check
+	uint16_t clientport; // The first local port, 0 to take the next free one
+	uint16_t portmapperport;
+	const char *statefile; // A local file the server ports, root handle and FSINFO are saved in, so the next mount
+	                       // only has to check them with a single GETATTR. NULL to always do the whole handshake.
+} nfsMountOpts;
+
+/*
+Fill in the settings nfsMount and nfsMountEx use.
+*/
+extern void nfsMountDefaultOpts(nfsMountOpts *opts);
+
+/*
+Mount like nfsMount, with the settings of opts.
+Mounts of the same server over the same protocol, with the same buffersize, flows, ports and NFS_RING, share their sockets and calls in flight,
+and only the first one asks the portmapper for the ports.
+*/
+extern bool nfsMountWithOpts(const char *name, const char *ipAddress, const char *mountdir, const nfsMountOpts *opts);
+
+/*
+Wait for the background handshake of a NFS_LAZY mount, returns whether the mount succeeded.
+Several exports can be mounted at the same time by mounting them with NFS_LAZY first, and waiting after that.
+A failed lazy mount stays registered until nfsUnmount is called.
+*/
+extern bool nfsMountWait(const char *name);
 
 /*
 Unmount the remote mountpoint specified by name.
 */
 extern void nfsUnmount (const char* name);
 
+// Classes of calls which keep their own round trip time estimate
+#define NFS_RTT_FAST 0 // GETATTR, LOOKUP, ACCESS, FSSTAT, FSINFO and PATHCONF
+#define NFS_RTT_READ 1 // READ, READDIR and READDIRPLUS
+#define NFS_RTT_WRITE 2 // WRITE, COMMIT and the other calls which change something on the server
+#define NFS_RTT_OTHER 3 // Portmapper and mount calls
+#define NFS_RTT_CLASSES 4
+
+typedef struct {
+	uint32_t rto[NFS_RTT_CLASSES]; // The current retransmit timeout per class, in microseconds
+	uint32_t srtt[NFS_RTT_CLASSES]; // The smoothed round trip time per class in microseconds, 0 if not measured yet
+	uint32_t calls; // The amount of calls sent, including retransmits, to the server of the mountpoint
+	uint32_t retransmits; // The amount of calls which timed out, mounts of the same server count them together
+	uint32_t hedges; // The amount of calls which were sent a second time before their retransmit timeout
+	uint32_t duplicates; // The amount of replies which arrived after their call had its reply, or was given up on
+	uint32_t placed; // The amount of READ replies of which the data was received straight into the buffer of the reader,
+	                 // or copied there straight from the completion ring
+	uint32_t serverdown; // 1 while the server doesn't answer the health probe
+	uint32_t remounts; // The amount of times the export was mounted again, because the server didn't know its handles anymore
+	uint32_t attrhits; // The amount of times attributes were known already, and didn't have to be asked from the server
+	uint32_t attrmisses;
+	uint32_t namehits; // The amount of LOOKUP calls which weren't needed, because the name was known already
+	uint32_t namemisses;
+	uint32_t blockhits; // The amount of blocks of files which were read from the cache instead of the server
+	uint32_t blockmisses;
+	uint32_t rsize; // The READ and WRITE block sizes picked from the measured loss and throughput, 0 before the first transfer
+	uint32_t wsize;
+} nfsMountStats;
+
+/*
+Retrieve the transport statistics of the mountpoint specified by name.
+*/
+extern bool nfsGetStats(const char *name, nfsMountStats *stats);
+
+/*
+Start a background thread which receives the replies for all mountpoints, and sends calls again when their
+reply is late. The threads making calls then only sleep until their reply is handed to them, instead of
+taking turns receiving for the others. Start it before mounting, or while nothing is being mounted or unmounted.
+Without thread support it doesn't start, and returns false.
+*/
+extern bool nfsReactorStart(void);
+
+/*
+Stop the background thread, the threads making calls receive the replies themselves again.
+*/
+extern void nfsReactorStop(void);
+
+// Operations of an asynchronous request
+#define NFS_ASYNC_READ 0 // Read up to len bytes at offset of the file fd into buffer
+#define NFS_ASYNC_WRITE 1 // Write len bytes of buffer at offset of the file fd
+#define NFS_ASYNC_STAT 2 // Look up path and get its attributes into st
+#define NFS_ASYNC_FSYNC 3 // Commit the data written to the file fd
+
+typedef struct nfsRequest {
+	int op; // One of the NFS_ASYNC operations
+	int fd; // A file opened with open() on a NFS mountpoint
+	const char *path;
+	void *buffer;
+	size_t len;
+	off_t offset; // READ and WRITE don't use or move the position of the file
+	struct stat *st;
+
+	// Called from a background thread when the request is done. Without a callback the request is queued,
+	// and has to be retrieved with nfsAsyncPoll before it can be submitted again.
+	void (*callback)(struct nfsRequest *request);
+	void *userdata;
+
+	// Filled in when the request is done
+	ssize_t result; // The amount of bytes read or written, 0 for the other operations and -1 on errors
+	int error; // The errno of a failed request
+	volatile bool done;
+
+	struct nfsRequest *next; // Used internally
+} nfsRequest;
+
+/*
+Start the background threads which run asynchronous requests. More threads keep more requests in flight,
+the requests of all threads share the transport of their mountpoint.
+Without thread support the requests run in nfsAsyncSubmit.
+*/
+extern bool nfsAsyncInit(uint32_t threads);
+
+/*
+Finish the requests which were submitted, and stop the background threads.
+*/
+extern void nfsAsyncDeinit(void);
+
+/*
+Queue a request, the request and its buffers must stay valid until it is done.
+Requests on the same file may run at the same time, so wait for a WRITE or FSYNC to be done
+before submitting other requests on that file. Files must not be closed with requests pending.
+*/
+extern bool nfsAsyncSubmit(nfsRequest *request);
+
+/*
+Retrieve a request without callback which is done, or NULL if there is none.
+*/
+extern nfsRequest *nfsAsyncPoll(void);
+
 #ifdef __cplusplus
 }
 #endif
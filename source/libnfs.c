@@ -34,13 +34,23 @@
 #include "common.h"
 #include "nfs.h"
 #include "nfs_net.h"
+#include "nfs_attr.h"
+#include "nfs_name.h"
+#include "nfs_rcache.h"
 #include "nfs_dir.h"
 #include "nfs_file.h"
 #include "portmap.h"
+#include "rpc.h"
+#include "rpc_mount.h"
+#include "lock.h"
 
+#define NFS_MOUNT_STACK_SIZE 32768
+#define NFS_MOUNT_PRIORITY 64
+#define NFS_PROBE_STACK_SIZE 16384
+#define NFS_PROBE_PRIORITY 64
+
+// The next free local port, for mounts which don't pick one themselves
 uint16_t _nfs_clientport = 600;
-int32_t _nfs_buffer_size = 8192;
-int16_t _nfs_portmapper_port = 111;
 
 static const devoptab_t dotab_nfs = {
 	"nfs",
@@ -64,18 +74,169 @@ static const devoptab_t dotab_nfs = {
 	_NFS_dirclose_r,
 	NULL, //_NFS_statvfs_r,
 	NULL, //_NFS_ftruncate_r,
-	NULL, //_NFS_fsync_r,
+	_NFS_fsync_r,
 	NULL,	/* Device data */
 	NULL,
 	NULL
 };
 
-bool nfsMountEx(const char *name, const char *ipAddress, const char *mountdir, uint32_t uid, uint32_t gid, uint32_t readonly)
+void nfsMountDefaultOpts(nfsMountOpts *opts)
+{
+	memset(opts, 0, sizeof(nfsMountOpts));
+	opts->flags = NFS_READWRITE;
+	opts->buffersize = 8192; // 8192 bytes seems to be the max message size the wii receives
+	#if defined (__wii__)
+	opts->maxdatagram = 4096;
+	#endif
+	opts->timeout = RTO_INITIAL;
+	opts->mintimeout = RTO_MIN;
+	opts->maxtimeout = RTO_MAX;
+	opts->retries = 2;
+	opts->readwindow = 4;
+	opts->writewindow = 4;
+	opts->commitbuffer = 65536;
+	opts->attrcache = 64;
+	opts->namecache = 64;
+	opts->readcacheblock = 8192;
+	opts->acregmin = 3000000;
+	opts->acregmax = 60000000;
+	opts->acdirmin = 30000000;
+	opts->acdirmax = 60000000;
+	opts->flows = 1;
+	opts->portmapperport = 111;
+}
+
+// Checks with a NULL call whether the server is still there, when nothing arrived from it for a probe interval.
+// A server which doesn't answer is marked down, so calls fail right away instead of waiting out their retries.
+static void *_NFS_probe_thread(void *arg)
+{
+	NFS_TRANSPORT *transport = (NFS_TRANSPORT *) arg;
+
+	_NFS_lock(&transport->lock);
+	uint32_t replies = transport->replies;
+	while (!transport->probestop)
+	{
+		// The shortest interval any of the mounts asked for
+		uint32_t interval = 0;
+		NFSMOUNT *prober;
+		for (prober = transport->probers; prober; prober = prober->nextprober) {
+			if (interval == 0 || prober->probeinterval < interval) interval = prober->probeinterval;
+		}
+		_NFS_cond_wait(&transport->probewake, &transport->lock, interval);
+		if (transport->probestop || transport->probers == NULL) continue;
+
+		// The replies to the calls of all mounts of the server count, a busy server isn't probed
+		if (transport->down || transport->replies == replies) {
+			prober = transport->probers;
+			transport->probing = prober;
+			_NFS_unlock(&transport->lock);
+			if (rpc_null(prober) != 0) nfs_transport_down(transport);
+			_NFS_lock(&transport->lock);
+			transport->probing = NULL;
+			_NFS_cond_broadcast(&transport->probewake);
+		}
+		replies = transport->replies;
+	}
+	_NFS_unlock(&transport->lock);
+	return NULL;
+}
+
+// Has the server probed for a mount which asked for it, once its handshake is done. The first one starts the thread.
+static void _NFS_probe_add(NFSMOUNT *nfsmount)
+{
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	if (nfsmount->probeinterval == 0) return;
+
+	// Starting and stopping the thread is serialized with the handshakes
+	_NFS_lock(&transport->setuplock);
+	_NFS_lock(&transport->lock);
+	nfsmount->nextprober = transport->probers;
+	transport->probers = nfsmount;
+	_NFS_unlock(&transport->lock);
+
+	if (!transport->hasprobethread &&
+		_NFS_thread_create(&transport->probethread, _NFS_probe_thread, transport, NFS_PROBE_STACK_SIZE, NFS_PROBE_PRIORITY) == 0) {
+		transport->hasprobethread = 1;
+	}
+	_NFS_unlock(&transport->setuplock);
+}
+
+// Stops probing the server for a mount. The last one stops the thread, and then nothing would notice the server
+// coming back anymore, so it isn't considered down then.
+static void _NFS_probe_remove(NFSMOUNT *nfsmount)
+{
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	if (nfsmount->probeinterval == 0) return;
+
+	_NFS_lock(&transport->setuplock);
+	_NFS_lock(&transport->lock);
+	NFSMOUNT **m = &transport->probers;
+	while (*m && *m != nfsmount) m = &(*m)->nextprober;
+	if (*m) *m = nfsmount->nextprober;
+	nfsmount->nextprober = NULL;
+
+	// The probe may be sent with the credentials of this mount right now
+	while (transport->probing == nfsmount) _NFS_cond_wait(&transport->probewake, &transport->lock, nfsmount->probeinterval);
+
+	int8_t last = transport->probers == NULL && transport->hasprobethread;
+	if (last) {
+		transport->probestop = 1;
+		_NFS_cond_broadcast(&transport->probewake);
+	}
+	_NFS_unlock(&transport->lock);
+
+	if (last) {
+		_NFS_thread_join(transport->probethread);
+		_NFS_lock(&transport->lock);
+		transport->hasprobethread = 0;
+		transport->probestop = 0;
+		transport->down = 0;
+		_NFS_unlock(&transport->lock);
+	}
+	_NFS_unlock(&transport->setuplock);
+}
+
+// Closes the connections and frees everything of a mount, the server is only told when the mount succeeded
+static void _NFS_free_mount(NFSMOUNT *nfsmount)
+{
+	_NFS_probe_remove(nfsmount);
+	rpc_unmount(nfsmount);
+
+	// The transport is closed with the last mount of the server
+	nfs_transport_put(nfsmount->transport);
+	nfsmount->transport = NULL;
+
+	_NFS_cond_deinit(&nfsmount->mounted);
+	_NFS_cond_deinit(&nfsmount->blockread);
+	_NFS_lock_deinit(&nfsmount->lock);
+	nfs_attr_free(nfsmount);
+	nfs_name_free(nfsmount);
+	nfs_rcache_free(nfsmount);
+
+	_NFS_mem_free(nfsmount);
+}
+
+// Does the handshake of a NFS_LAZY mount, while the mountpoint can already be used
+static void *_NFS_mount_thread(void *arg)
+{
+	NFSMOUNT *nfsmount = (NFSMOUNT *) arg;
+	int32_t ret = rpc_mount(nfsmount);
+	if (ret == 0) _NFS_probe_add(nfsmount);
+
+	_NFS_lock(&nfsmount->lock);
+	nfsmount->mountstate = ret == 0 ? NFS_MOUNT_DONE : NFS_MOUNT_FAILED;
+	_NFS_cond_broadcast(&nfsmount->mounted);
+	_NFS_unlock(&nfsmount->lock);
+	return NULL;
+}
+
+bool nfsMountWithOpts(const char *name, const char *ipAddress, const char *mountdir, const nfsMountOpts *opts)
 {
 	NFSMOUNT *nfsmount = NULL;
 	devoptab_t* devops;
 
-	if (!name || strlen(name) > 8 || !mountdir) return false;
+	if (!name || strlen(name) > 8 || !mountdir || !opts) return false;
+	if (opts->buffersize < RPC_MAX_HEADER + READ_REPLY_HEADER) return false;
 
 	char devname[10];
 	sprintf(devname, "%s:", name);
@@ -91,39 +252,115 @@ bool nfsMountEx(const char *name, const char *ipAddress, const char *mountdir, u
 	memset(devops, 0, struclen);
 
 	nfsmount = _NFS_mem_allocate(sizeof(NFSMOUNT));
-	if (!nfsmount) return NULL;
+	if (!nfsmount) {
+		_NFS_mem_free(devops);
+		return false;
+	}
 	memset(nfsmount, 0, sizeof(NFSMOUNT));
-	nfsmount->socket = -1;
 
-	nfsmount->uid = uid;
-	nfsmount->gid = gid;
-	nfsmount->readonly = readonly;
+	int32_t flows = opts->flows < 1 ? 1 : (opts->flows > NFS_MAX_FLOWS ? NFS_MAX_FLOWS : opts->flows);
+	uint32_t protocol = (opts->flags & NFS_TCP) ? PROTO_TCP : PROTO_UDP;
+	int32_t ring = (opts->flags & NFS_RING) != 0;
+
+	// Share the transport of another mount of the server, or make a new one where every flow gets its own client port
+	uint16_t clientport = 0;
+	nfsmount->transport = nfs_transport_find(ipAddress, protocol, opts->clientport, flows, opts->buffersize, opts->portmapperport, ring);
+	if (!nfsmount->transport) {
+		clientport = opts->clientport;
+		if (clientport == 0) {
+			clientport = _nfs_clientport;
+			_nfs_clientport += flows;
+		}
+		nfsmount->transport = nfs_transport_create(ipAddress, protocol, clientport, flows, opts->buffersize, opts->portmapperport, ring);
+		if (!nfsmount->transport) {
+			if (opts->clientport == 0) _nfs_clientport -= flows;
+			_NFS_mem_free(nfsmount);
+			_NFS_mem_free(devops);
+			return false;
+		}
+	}
 
-	udp_init(nfsmount, ipAddress, _nfs_clientport++);
+	// Initialize the NFS locks, the caches are set up under them
+	_NFS_lock_init(&nfsmount->lock);
+	_NFS_cond_init(&nfsmount->mounted);
+	_NFS_cond_init(&nfsmount->blockread);
+	nfsmount->mountstate = NFS_MOUNT_PENDING;
+
+	nfsmount->uid = opts->uid;
+	nfsmount->gid = opts->gid;
+	nfsmount->readonly = opts->flags & NFS_READONLY;
+	nfsmount->rsize = opts->rsize;
+	nfsmount->wsize = opts->wsize;
+	nfsmount->maxdatagram = opts->maxdatagram;
+	nfsmount->read_window = opts->readwindow;
+	nfsmount->write_window = opts->writewindow;
+	nfsmount->commit_buffer_size = opts->commitbuffer;
+	nfsmount->retries = opts->retries < 1 ? 1 : opts->retries;
+	nfsmount->hedge = opts->hedge > 99 ? 99 : opts->hedge;
+	nfsmount->probeinterval = opts->probeinterval;
+	nfsmount->acregmin = opts->acregmin;
+	nfsmount->acregmax = opts->acregmax < opts->acregmin ? opts->acregmin : opts->acregmax;
+	nfsmount->acdirmin = opts->acdirmin;
+	nfsmount->acdirmax = opts->acdirmax < opts->acdirmin ? opts->acdirmin : opts->acdirmax;
+	nfs_attr_init(nfsmount, opts->attrcache);
+	nfs_name_init(nfsmount, opts->namecache);
+	nfs_rcache_init(nfsmount, opts->readcache, opts->readcacheblock);
+	nfsmount->rto_min = opts->mintimeout;
+	nfsmount->rto_max = opts->maxtimeout < opts->mintimeout ? opts->mintimeout : opts->maxtimeout;
+	nfsmount->rto_initial = opts->timeout < opts->mintimeout ? opts->mintimeout : opts->timeout;
+	if (opts->statefile) {
+		nfsmount->statefile = _NFS_mem_allocate(strlen(opts->statefile) + 1);
+		if (nfsmount->statefile) strcpy(nfsmount->statefile, opts->statefile);
+	}
+
+	// Copy mountdir into nfsmount
+	nfsmount->mountdir = _NFS_mem_allocate(strlen(mountdir) + 1);
+	memset(nfsmount->mountdir, 0, strlen(mountdir) + 1);
+	memcpy(nfsmount->mountdir, mountdir, strlen(mountdir));
 
 	// Use the space allocated at the end of the devoptab struct for storing the name
 	char *nameCopy = (char*)(devops+1);
 
-	if (rpc_mount(nfsmount, mountdir) != 0) goto error;
+	// A lazy mount does the handshake in the background, the first call on the mountpoint waits for it
+	if ((opts->flags & NFS_LAZY) &&
+		_NFS_thread_create(&nfsmount->mountthread, _NFS_mount_thread, nfsmount, NFS_MOUNT_STACK_SIZE, NFS_MOUNT_PRIORITY) == 0) {
+		nfsmount->hasmountthread = 1;
+	} else {
+		if (rpc_mount(nfsmount) != 0) goto error;
+		nfsmount->mountstate = NFS_MOUNT_DONE;
+		_NFS_probe_add(nfsmount);
+	}
 
 	// Add an entry for this device to the devoptab table
 	memcpy (devops, &dotab_nfs, sizeof(dotab_nfs));
-	strncpy(nameCopy, name, strlen(name));
+	memcpy(nameCopy, name, strlen(name));
 	devops->name = nameCopy;
+	nfsmount->name = nameCopy;
 	devops->deviceData = nfsmount;
 
 	AddDevice(devops);
 
 	goto finish;
 error:
+	nfsmount->mountstate = NFS_MOUNT_FAILED;
+	_NFS_free_mount(nfsmount);
 	_NFS_mem_free(devops);
-	if (!nfsmount) _NFS_mem_free(nfsmount);
-	_nfs_clientport--;
+	if (opts->clientport == 0 && clientport != 0) _nfs_clientport -= flows;
 	return false;
 finish:
 	return true;
 }
 
+bool nfsMountEx(const char *name, const char *ipAddress, const char *mountdir, uint32_t uid, uint32_t gid, uint32_t flags)
+{
+	nfsMountOpts opts;
+	nfsMountDefaultOpts(&opts);
+	opts.uid = uid;
+	opts.gid = gid;
+	opts.flags = flags;
+	return nfsMountWithOpts(name, ipAddress, mountdir, &opts);
+}
+
 bool nfsMount(const char *name, const char *ipAddress, const char *mountdir) {
 	return nfsMountEx(name, ipAddress, mountdir, 0, 0, NFS_READWRITE);
 }
@@ -144,15 +381,77 @@ void nfsUnmount(const char *name)
 	}
 
 	nfsmount = (NFSMOUNT*)devops->deviceData;
-	rpc_unmount(nfsmount);
 
-	// Clear the buffer
-	if (nfsmount->buffer) _NFS_mem_free(nfsmount->buffer);
-	nfsmount->buffer = NULL;
-	nfsmount->bufferlen = 0;
+	// Let a handshake in the background finish first
+	if (nfsmount->hasmountthread) _NFS_thread_join(nfsmount->mountthread);
 
-	_NFS_mem_free(nfsmount);
+	// The device table still looks at the name, which is kept in devops
+	RemoveDevice(name);
+
+	_NFS_free_mount(nfsmount);
 	_NFS_mem_free(devops);
+}
 
-	RemoveDevice(name);
+bool nfsMountWait(const char *name)
+{
+	devoptab_t* devops;
+
+	if (!name) return false;
+
+	devops = (devoptab_t *) GetDeviceOpTab(name);
+	if (!devops) return false;
+
+	// Perform a quick check to make sure we're dealing with a libnfs controlled network location
+	if (devops->open_r != dotab_nfs.open_r) {
+		return false;
+	}
+
+	return _NFS_wait_mounted((NFSMOUNT*)devops->deviceData) == 0;
+}
+
+bool nfsGetStats(const char *name, nfsMountStats *stats)
+{
+	NFSMOUNT *nfsmount;
+	devoptab_t* devops;
+
+	if (!name || !stats) return false;
+
+	devops = (devoptab_t *) GetDeviceOpTab(name);
+	if (!devops) return false;
+
+	// Perform a quick check to make sure we're dealing with a libnfs controlled network location
+	if (devops->open_r != dotab_nfs.open_r) {
+		return false;
+	}
+
+	nfsmount = (NFSMOUNT*)devops->deviceData;
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	_NFS_lock(&transport->lock);
+
+	int32_t i;
+	for (i = 0; i < NFS_RTT_CLASSES; i++) {
+		stats->rto[i] = nfs_rtt_timeout(nfsmount, i);
+		stats->srtt[i] = transport->rtt[i].srtt >> 3;
+	}
+	stats->calls = transport->calls;
+	stats->retransmits = transport->retransmits;
+	stats->hedges = transport->hedges;
+	stats->duplicates = transport->duplicates;
+	stats->placed = transport->placed;
+	stats->serverdown = transport->down;
+
+	_NFS_unlock(&transport->lock);
+
+	_NFS_lock(&nfsmount->lock);
+	stats->rsize = nfsmount->readctl.size;
+	stats->wsize = nfsmount->writectl.size;
+	stats->remounts = nfsmount->generation;
+	stats->attrhits = nfsmount->attrhits;
+	stats->attrmisses = nfsmount->attrmisses;
+	stats->namehits = nfsmount->namehits;
+	stats->namemisses = nfsmount->namemisses;
+	stats->blockhits = nfsmount->blockhits;
+	stats->blockmisses = nfsmount->blockmisses;
+	_NFS_unlock(&nfsmount->lock);
+	return true;
 }
@@ -22,4 +22,40 @@ void __attribute__ ((weak)) _NFS_unlock(mutex_t *mutex)
 	return;
 }
 
+void __attribute__ ((weak)) _NFS_cond_init(cond_t *cond)
+{
+	return;
+}
+
+void __attribute__ ((weak)) _NFS_cond_deinit(cond_t *cond)
+{
+	return;
+}
+
+void __attribute__ ((weak)) _NFS_cond_wait(cond_t *cond, mutex_t *mutex, uint32_t timeout)
+{
+	return;
+}
+
+void __attribute__ ((weak)) _NFS_cond_broadcast(cond_t *cond)
+{
+	return;
+}
+
+void __attribute__ ((weak)) _NFS_cond_signal(cond_t *cond)
+{
+	return;
+}
+
+// Without threads there is no background engine, callers run the work themselves
+int32_t __attribute__ ((weak)) _NFS_thread_create(lwp_t *thread, void *(*entry)(void *), void *arg, uint32_t stacksize, uint8_t priority)
+{
+	return -1;
+}
+
+void __attribute__ ((weak)) _NFS_thread_join(lwp_t thread)
+{
+	return;
+}
+
 #endif // USE_LWP_LOCK
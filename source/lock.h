@@ -53,17 +53,69 @@ static inline void _NFS_unlock(mutex_t *mutex)
 	LWP_MutexUnlock(*mutex);
 }
 
+static inline void _NFS_cond_init(cond_t *cond)
+{
+	LWP_CondInit(cond);
+}
+
+static inline void _NFS_cond_deinit(cond_t *cond)
+{
+	LWP_CondDestroy(*cond);
+}
+
+// Waits up to timeout microseconds, LWP takes the timeout relative to now
+static inline void _NFS_cond_wait(cond_t *cond, mutex_t *mutex, uint32_t timeout)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000000;
+	ts.tv_nsec = (timeout % 1000000) * 1000;
+	LWP_CondTimedWait(*cond, *mutex, &ts);
+}
+
+static inline void _NFS_cond_broadcast(cond_t *cond)
+{
+	LWP_CondBroadcast(*cond);
+}
+
+static inline void _NFS_cond_signal(cond_t *cond)
+{
+	LWP_CondSignal(*cond);
+}
+
+static inline int32_t _NFS_thread_create(lwp_t *thread, void *(*entry)(void *), void *arg, uint32_t stacksize, uint8_t priority)
+{
+	return LWP_CreateThread(thread, entry, arg, NULL, stacksize, priority) < 0 ? -1 : 0;
+}
+
+static inline void _NFS_thread_join(lwp_t thread)
+{
+	LWP_JoinThread(thread, NULL);
+}
+
 #else
 
 // We still need a blank lock type
 #ifndef mutex_t
 typedef int mutex_t;
 #endif
+#ifndef cond_t
+typedef int cond_t;
+#endif
+#ifndef lwp_t
+typedef int lwp_t;
+#endif
 
 void _NFS_lock_init(mutex_t *mutex);
 void _NFS_lock_deinit(mutex_t *mutex);
 void _NFS_lock(mutex_t *mutex);
 void _NFS_unlock(mutex_t *mutex);
+void _NFS_cond_init(cond_t *cond);
+void _NFS_cond_deinit(cond_t *cond);
+void _NFS_cond_wait(cond_t *cond, mutex_t *mutex, uint32_t timeout);
+void _NFS_cond_broadcast(cond_t *cond);
+void _NFS_cond_signal(cond_t *cond);
+int32_t _NFS_thread_create(lwp_t *thread, void *(*entry)(void *), void *arg, uint32_t stacksize, uint8_t priority);
+void _NFS_thread_join(lwp_t thread);
 
 #endif // USE_LWP_LOCK
 
@@ -0,0 +1,221 @@
+/*
+ nfs_async.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <sys/iosupport.h>
+#include <string.h>
+
+#include "common.h"
+#include "nfs.h"
+#include "nfs_file.h"
+#include "lock.h"
+
+#define NFS_ASYNC_MAX_THREADS 8
+#define NFS_ASYNC_STACK_SIZE 32768
+#define NFS_ASYNC_PRIORITY 64
+#define NFS_ASYNC_IDLE_WAIT 1000000 // Microseconds an idle thread sleeps before checking again
+
+static mutex_t async_lock;
+static cond_t async_submitted;
+static nfsRequest *async_queue = NULL, *async_queue_tail = NULL;	// Submitted requests, oldest first
+static nfsRequest *async_done = NULL, *async_done_tail = NULL;		// Requests for nfsAsyncPoll
+static lwp_t async_threads[NFS_ASYNC_MAX_THREADS];
+static int32_t async_numthreads = 0;
+static bool async_initialized = false;
+static bool async_stopping = false;
+
+// Finds the file struct of a file opened on a NFS mountpoint
+static NFS_FILE_STRUCT *_NFS_async_file(int fd)
+{
+	__handle *handle = __get_handle(fd);
+	if (handle == NULL || devoptab_list[handle->device]->open_r != _NFS_open_r) return NULL;
+	return (NFS_FILE_STRUCT *) handle->fileStruct;
+}
+
+static void _NFS_async_run(nfsRequest *request)
+{
+	struct _reent r;
+	memset(&r, 0, sizeof(r));
+
+	NFS_FILE_STRUCT *file = NULL;
+	if (request->op != NFS_ASYNC_STAT) {
+		file = _NFS_async_file(request->fd);
+		if (file == NULL) r._errno = EBADF;
+	}
+
+	ssize_t ret = -1;
+	if (file != NULL || request->op == NFS_ASYNC_STAT) {
+		switch (request->op)
+		{
+			case NFS_ASYNC_READ:
+				ret = _NFS_read_at(&r, file, request->buffer, request->offset, request->len);
+				break;
+			case NFS_ASYNC_WRITE:
+				if (!file->write) {
+					r._errno = EBADF;
+					break;
+				}
+				ret = _NFS_write_at(&r, file, request->buffer, request->offset, request->len);
+				break;
+			case NFS_ASYNC_STAT:
+				ret = _NFS_stat_r(&r, request->path, request->st);
+				break;
+			case NFS_ASYNC_FSYNC:
+				ret = _NFS_fsync(&r, file);
+				break;
+			default:
+				r._errno = EINVAL;
+				break;
+		}
+	}
+
+	request->result = ret < 0 ? -1 : ret;
+	request->error = ret < 0 ? (r._errno != 0 ? r._errno : EIO) : 0;
+
+	// The callback owns the request from here on, it may reuse or free it
+	if (request->callback != NULL) {
+		request->done = true;
+		request->callback(request);
+		return;
+	}
+
+	_NFS_lock(&async_lock);
+	request->next = NULL;
+	if (async_done_tail != NULL) async_done_tail->next = request;
+	else async_done = request;
+	async_done_tail = request;
+	request->done = true;
+	_NFS_unlock(&async_lock);
+}
+
+static void *_NFS_async_thread(void *arg)
+{
+	_NFS_lock(&async_lock);
+	while (1)
+	{
+		nfsRequest *request = async_queue;
+		if (request == NULL) {
+			if (async_stopping) break;
+			_NFS_cond_wait(&async_submitted, &async_lock, NFS_ASYNC_IDLE_WAIT);
+			continue;
+		}
+
+		async_queue = request->next;
+		if (async_queue == NULL) async_queue_tail = NULL;
+
+		// The other threads pick up requests while this one waits for the server
+		_NFS_unlock(&async_lock);
+		_NFS_async_run(request);
+		_NFS_lock(&async_lock);
+	}
+	_NFS_unlock(&async_lock);
+	return NULL;
+}
+
+bool nfsAsyncInit(uint32_t threads)
+{
+	if (async_initialized) return true;
+	if (threads < 1) threads = 1;
+	if (threads > NFS_ASYNC_MAX_THREADS) threads = NFS_ASYNC_MAX_THREADS;
+
+	_NFS_lock_init(&async_lock);
+	_NFS_cond_init(&async_submitted);
+	async_stopping = false;
+	async_numthreads = 0;
+	async_initialized = true;
+
+	// When no thread can be started the requests run in nfsAsyncSubmit
+	while (async_numthreads < (int32_t) threads &&
+		_NFS_thread_create(&async_threads[async_numthreads], _NFS_async_thread, NULL, NFS_ASYNC_STACK_SIZE, NFS_ASYNC_PRIORITY) == 0) {
+		async_numthreads++;
+	}
+	return true;
+}
+
+void nfsAsyncDeinit(void)
+{
+	if (!async_initialized) return;
+
+	_NFS_lock(&async_lock);
+	async_stopping = true;
+	_NFS_cond_broadcast(&async_submitted);
+	_NFS_unlock(&async_lock);
+
+	int32_t i;
+	for (i = 0; i < async_numthreads; i++) {
+		_NFS_thread_join(async_threads[i]);
+	}
+	async_numthreads = 0;
+
+	_NFS_cond_deinit(&async_submitted);
+	_NFS_lock_deinit(&async_lock);
+	async_queue = async_queue_tail = NULL;
+	async_done = async_done_tail = NULL;
+	async_initialized = false;
+}
+
+bool nfsAsyncSubmit(nfsRequest *request)
+{
+	if (!async_initialized || request == NULL) return false;
+
+	request->result = 0;
+	request->error = 0;
+	request->done = false;
+	request->next = NULL;
+
+	if (async_numthreads == 0) {
+		_NFS_async_run(request);
+		return true;
+	}
+
+	_NFS_lock(&async_lock);
+	if (async_stopping) {
+		_NFS_unlock(&async_lock);
+		return false;
+	}
+	if (async_queue_tail != NULL) async_queue_tail->next = request;
+	else async_queue = request;
+	async_queue_tail = request;
+	_NFS_cond_broadcast(&async_submitted);
+	_NFS_unlock(&async_lock);
+	return true;
+}
+
+nfsRequest *nfsAsyncPoll(void)
+{
+	if (!async_initialized) return NULL;
+
+	_NFS_lock(&async_lock);
+	nfsRequest *request = async_done;
+	if (request != NULL) {
+		async_done = request->next;
+		if (async_done == NULL) async_done_tail = NULL;
+		request->next = NULL;
+	}
+	_NFS_unlock(&async_lock);
+	return request;
+}
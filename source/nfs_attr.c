@@ -0,0 +1,185 @@
+/*
+ nfs_attr.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <gctypes.h>
+#include <string.h>
+#include "common.h"
+#include "rpc.h"
+#include "nfs_net.h"
+#include "nfs_attr.h"
+#include "lock.h"
+
+// Without memory for the entries the attributes just aren't cached
+void nfs_attr_init(NFSMOUNT *nfsmount, uint32_t entries)
+{
+	nfsmount->numattrs = 0;
+	if (entries == 0) return;
+
+	nfsmount->attrs = _NFS_mem_allocate(entries * sizeof(NFS_ATTR_ENTRY));
+	if (nfsmount->attrs == NULL) return;
+	memset(nfsmount->attrs, 0, entries * sizeof(NFS_ATTR_ENTRY));
+	nfsmount->numattrs = entries;
+}
+
+void nfs_attr_free(NFSMOUNT *nfsmount)
+{
+	if (nfsmount->attrs) _NFS_mem_free(nfsmount->attrs);
+	nfsmount->attrs = NULL;
+	nfsmount->numattrs = 0;
+}
+
+// Forgets everything, after the handles went stale
+void nfs_attr_purge(NFSMOUNT *nfsmount)
+{
+	_NFS_lock(&nfsmount->lock);
+	if (nfsmount->numattrs > 0) memset(nfsmount->attrs, 0, nfsmount->numattrs * sizeof(NFS_ATTR_ENTRY));
+	_NFS_unlock(&nfsmount->lock);
+}
+
+// A handle always goes in the same entry, and replaces another handle with the same hash
+static NFS_ATTR_ENTRY *nfs_attr_entry(NFSMOUNT *nfsmount, fhandle3 *handle)
+{
+	uint32_t hash = 2166136261u;
+	int32_t i;
+	for (i = 0; i < handle->len; i++) hash = (hash ^ ((uint8_t *) handle->val)[i]) * 16777619;
+	return &nfsmount->attrs[hash % nfsmount->numattrs];
+}
+
+static int32_t nfs_attr_match(NFS_ATTR_ENTRY *entry, fhandle3 *handle)
+{
+	return entry->handlelen == handle->len && memcmp(entry->handle, handle->val, handle->len) == 0;
+}
+
+int32_t nfs_attr_get(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr)
+{
+	if (nfsmount->numattrs == 0) return -1;
+
+	int32_t ret = -1;
+	_NFS_lock(&nfsmount->lock);
+	NFS_ATTR_ENTRY *entry = nfs_attr_entry(nfsmount, handle);
+	if (nfs_attr_match(entry, handle) && nfs_now() < entry->expires) {
+		memcpy(attr, &entry->attr, sizeof(object_attributes));
+		nfsmount->attrhits++;
+		ret = 0;
+	} else {
+		nfsmount->attrmisses++;
+	}
+	_NFS_unlock(&nfsmount->lock);
+	return ret;
+}
+
+void nfs_attr_update(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr, uint32_t xid)
+{
+	if (nfsmount->numattrs == 0 || handle->len <= 0 || handle->len > NFS3_FHSIZE) return;
+
+	uint32_t min = attr->type == NF3DIR ? nfsmount->acdirmin : nfsmount->acregmin;
+	uint32_t max = attr->type == NF3DIR ? nfsmount->acdirmax : nfsmount->acregmax;
+	uint64_t now = nfs_now();
+
+	_NFS_lock(&nfsmount->lock);
+	NFS_ATTR_ENTRY *entry = nfs_attr_entry(nfsmount, handle);
+	if (nfs_attr_match(entry, handle) && (int32_t) (xid - entry->xid) < 0 &&
+		(attr->ctime < entry->attr.ctime || (attr->ctime == entry->attr.ctime && attr->ctime_nsec <= entry->attr.ctime_nsec))) {
+		// The reply to an older call, like the first of two WRITE calls, arrived later and doesn't know about the newer one
+		_NFS_unlock(&nfsmount->lock);
+		return;
+	}
+
+	uint32_t timeout = min;
+	if (nfs_attr_match(entry, handle) && entry->attr.size_u == attr->size_u && entry->attr.size_l == attr->size_l &&
+		entry->attr.mtime == attr->mtime && entry->attr.mtime_nsec == attr->mtime_nsec &&
+		entry->attr.ctime == attr->ctime && entry->attr.ctime_nsec == attr->ctime_nsec) {
+		// Unchanged, only a check after the attributes expired makes them last longer
+		timeout = entry->timeout;
+		if (now >= entry->expires) timeout *= 2;
+		if (timeout > max) timeout = max;
+		if (timeout < min) timeout = min;
+	}
+	entry->handlelen = handle->len;
+	memcpy(entry->handle, handle->val, handle->len);
+	memcpy(&entry->attr, attr, sizeof(object_attributes));
+	entry->timeout = timeout;
+	entry->expires = now + timeout;
+	entry->xid = xid;
+	_NFS_unlock(&nfsmount->lock);
+}
+
+int32_t nfs_attr_getattr(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr, int32_t maxsends)
+{
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) return -1;
+
+	uint32_t offset = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_GETATTR, AUTH_UNIX);
+	offset += rpc_write_fhandle(call, offset, handle);
+	call->maxsends = maxsends;
+
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return ret;
+	}
+
+	int32_t rpc_header_length = 0;
+	if (rpc_parse_header(call, &rpc_header_length) != 0) {
+		nfs_call_put(call);
+		return -1;
+	}
+
+	rpc_read_int(call, rpc_header_length, &ret);
+	if (ret == 0) {
+		rpc_read_objectattr(call, rpc_header_length + 4, attr);
+		nfs_attr_update(nfsmount, handle, attr, call->xid);
+	}
+	nfs_call_put(call);
+	return ret;
+}
+
+int32_t nfs_attr_fetch(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr)
+{
+	if (nfs_attr_get(nfsmount, handle, attr) == 0) return 0;
+	return nfs_attr_getattr(nfsmount, handle, attr, 0);
+}
+
+int32_t nfs_attr_read(NFSMOUNT *nfsmount, fhandle3 *handle, NFS_CALL *call, int32_t offset)
+{
+	int32_t follows;
+	int32_t len = rpc_read_int(call, offset, &follows);
+	if (follows) {
+		nfs_attr_update(nfsmount, handle, (object_attributes *) (call->buffer + offset + len), call->xid);
+		len += sizeof(object_attributes);
+	}
+	return len;
+}
+
+int32_t nfs_attr_wcc(NFSMOUNT *nfsmount, fhandle3 *handle, NFS_CALL *call, int32_t offset)
+{
+	int32_t follows;
+	int32_t len = rpc_read_int(call, offset, &follows);
+	if (follows) len += 24; // Skip "before" attributes (size, mtime and ctime)
+	return len + nfs_attr_read(nfsmount, handle, call, offset + len);
+}
@@ -0,0 +1,58 @@
+/*
+ nfs_attr.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef _NFS_ATTR_H_
+#define _NFS_ATTR_H_
+
+#include "common.h"
+
+/*
+The attributes of files and directories are kept per mount by their handle, and every reply which carries them
+updates them. Attributes which didn't change when they were seen again are kept twice as long as before,
+from acregmin up to acregmax (acdirmin and acdirmax for directories), a change starts over at the minimum.
+*/
+void nfs_attr_init(NFSMOUNT *nfsmount, uint32_t entries);
+void nfs_attr_free(NFSMOUNT *nfsmount);
+void nfs_attr_purge(NFSMOUNT *nfsmount);
+
+// Returns 0 and copies the attributes when they are known and not expired yet, -1 if the server has to be asked
+int32_t nfs_attr_get(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr);
+// Keeps the attributes which came with the reply to the call with xid
+void nfs_attr_update(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr, uint32_t xid);
+
+// Asks the server for the attributes with a GETATTR, which is sent at most maxsends times (0 for the retries of the mount),
+// and keeps them. Returns 0, a NFS3ERR or -1
+int32_t nfs_attr_getattr(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr, int32_t maxsends);
+// Like nfs_attr_get, but asks the server with nfs_attr_getattr when the attributes aren't known
+int32_t nfs_attr_fetch(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr);
+
+// Read the post_op_attr and wcc_data of a reply like rpc_read_int and rpc_skip_wcc_data, and update the attributes of handle
+int32_t nfs_attr_read(NFSMOUNT *nfsmount, fhandle3 *handle, NFS_CALL *call, int32_t offset);
+int32_t nfs_attr_wcc(NFSMOUNT *nfsmount, fhandle3 *handle, NFS_CALL *call, int32_t offset);
+
+#endif //_NFS_ATTR_H_
@@ -27,57 +27,145 @@
 
 #include <gctypes.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include "common.h"
 #include "nfs_net.h"
+#include "nfs_attr.h"
+#include "nfs_name.h"
 #include "rpc.h"
 #include "nfs_dir.h"
 #include "nfs_file.h"
 #include "lock.h"
 
-int32_t _NFS_do_lookup(NFSMOUNT *nfsmount, fhandle3 *parentHandle, const char *dir, struct stat *attr, fhandle3 *handle)
+// Returns the attributes of a post_op_attr in a reply, or NULL when they aren't there
+static object_attributes *_NFS_post_op_attr(NFS_CALL *call, int32_t offset)
 {
-	int32_t headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, PROCEDURE_LOOKUP, AUTH_UNIX);
+	int32_t follows;
+	rpc_read_int(call, offset, &follows);
+	return follows ? (object_attributes *) (call->buffer + offset + 4) : NULL;
+}
+
+// With fresh set, the attributes of a name which is found in the name cache are asked from the server,
+// instead of being taken from the attribute cache
+int32_t _NFS_do_lookup(NFSMOUNT *nfsmount, fhandle3 *parentHandle, const char *dir, struct stat *attr, fhandle3 *handle, int32_t fresh)
+{
+	// A name looked up before is known as long as its directory didn't change
+	object_attributes dirattr, objattr;
+	if (nfsmount->numnames > 0 && nfs_attr_fetch(nfsmount, parentHandle, &dirattr) == 0) {
+		int32_t ret = nfs_name_get(nfsmount, parentHandle, &dirattr, dir, handle);
+		if (ret == NFS3ERR_NOENT) return ret;
+		if (ret == 0) {
+			if (attr == NULL) return 0;
+			if ((fresh ? nfs_attr_getattr(nfsmount, handle, &objattr, 0) : nfs_attr_fetch(nfsmount, handle, &objattr)) == 0) {
+				_NFS_copy_stat_from_attributes(attr, &objattr);
+				return 0;
+			}
+			fhandle3_free(handle);
+		}
+	}
+
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) return -1;
+
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_LOOKUP, AUTH_UNIX);
 
 	// Write a dir entry, first write the handle
 	uint32_t offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, parentHandle);
-	offset += rpc_write_string(nfsmount, offset, dir);
+	offset += rpc_write_fhandle(call, offset, parentHandle);
+	offset += rpc_write_string(call, offset, dir);
 
 	// Do a call
-	int32_t ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
-	if (ret < 0) return ret;
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return ret;
+	}
 
 	int32_t rpc_header_length = 0;
-	if (rpc_parse_header(nfsmount, &rpc_header_length) != 0)
+	if (rpc_parse_header(call, &rpc_header_length) != 0)
 	{
+		nfs_call_put(call);
 		return -10;
 	}
 
 	// First, check the status
 	int32_t intVal;
 	offset = rpc_header_length;
-	offset += rpc_read_int(nfsmount, offset, &intVal); // Status
-	if (intVal != 0) return intVal;
+	offset += rpc_read_int(call, offset, &intVal); // Status
+	if (intVal != 0) {
+		object_attributes *parentattr = _NFS_post_op_attr(call, offset);
+		if (intVal == NFS3ERR_NOENT && parentattr != NULL) nfs_name_add(nfsmount, parentHandle, parentattr, dir, NULL);
+		nfs_attr_read(nfsmount, parentHandle, call, offset);
+		nfs_call_put(call);
+		return intVal;
+	}
 
 	// Extract the handle from the return message
-	offset += rpc_read_fhandle(nfsmount, offset, handle);
+	offset += rpc_read_fhandle(call, offset, handle);
 
-	offset += rpc_read_int(nfsmount, offset, &intVal); // Has object attributes
-	if (intVal == 1 && attr != NULL) // And if we want them, ofc
-	{
-		rpc_read_stat(nfsmount, offset, attr); // Read object attributes
+	offset += rpc_read_int(call, offset, &intVal); // Has object attributes
+	if (intVal == 1) {
+		if (attr != NULL) rpc_read_stat(call, offset, attr); // Read object attributes, if we want them
+		nfs_attr_update(nfsmount, handle, (object_attributes *) (call->buffer + offset), call->xid);
+		offset += sizeof(object_attributes);
 	}
+	object_attributes *parentattr = _NFS_post_op_attr(call, offset); // And the ones of the directory
+	if (parentattr != NULL) nfs_name_add(nfsmount, parentHandle, parentattr, dir, handle);
+	nfs_attr_read(nfsmount, parentHandle, call, offset);
+	nfs_call_put(call);
 	return 0;
 }
 
+// Appends the names in path to out, one slash in front of each
+static char *_NFS_append_names(char *out, const char *path)
+{
+	while (*path) {
+		const char *end = strchr(path, '/');
+		size_t len = end != NULL ? end - path : strlen(path);
+		if (len > 0 && !(len == 1 && path[0] == '.')) {
+			*out++ = '/';
+			memcpy(out, path, len);
+			out += len;
+		}
+		path += len;
+		if (*path == '/') path++;
+	}
+	return out;
+}
+
+// Turns a path which may be relative to the current directory into "name:/dir/file", so it still finds the same
+// object after the current directory changed. Returns NULL when out of memory, the caller frees the result.
+char *_NFS_absolute_path(NFSMOUNT *nfsmount, const char *path)
+{
+	const char *colon = strchr(path, ':');
+	_NFS_lock(&nfsmount->lock);
+	const char *base = colon == NULL && nfsmount->curdirname != NULL ? strchr(nfsmount->curdirname, ':') + 1 : "";
+	if (colon != NULL) path = colon + 1;
+
+	char *absolute = _NFS_mem_allocate(strlen(nfsmount->name) + strlen(base) + strlen(path) + 4);
+	if (absolute != NULL) {
+		char *end = absolute + sprintf(absolute, "%s:", nfsmount->name);
+		end = _NFS_append_names(end, base);
+		end = _NFS_append_names(end, path);
+		if (end[-1] == ':') *end++ = '/';
+		*end = 0;
+	}
+	_NFS_unlock(&nfsmount->lock);
+	return absolute;
+}
+
 int32_t _NFS_get_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path, char *pathEnd, fhandle3 *handle, int32_t only_directories)
 {
 	// First, check if the requested directory is by any chance the current directory
-	if (nfsmount->curdirname != NULL && strncmp(nfsmount->curdirname, path, strlen(path)) == 0) {
+	size_t len = pathEnd != NULL ? pathEnd - path : strlen(path);
+	_NFS_lock(&nfsmount->lock);
+	if (nfsmount->curdirname != NULL && strlen(nfsmount->curdirname) == len && strncmp(nfsmount->curdirname, path, len) == 0) {
 		fhandle3_copy(handle, &nfsmount->curdir);
+		_NFS_unlock(&nfsmount->lock);
 		return 0;
 	}
+	_NFS_unlock(&nfsmount->lock);
 
 	int32_t relative_dir = 1;
 
@@ -95,16 +183,18 @@ int32_t _NFS_get_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path,
 		path = path + 1;
 
 	// Are we requesting the root directory? We already have that handle
-	if (strlen(path) == 0 || (pathEnd != NULL && pathEnd - path == (pathEnd[0] == '/' ? 1 : 0))) { 
+	if (strlen(path) == 0 || (pathEnd != NULL && pathEnd <= path)) {
 		fhandle3_copy(handle, &nfsmount->handle);
 		return 0;
 	}
 
 	// Copy the source handle to the handle
+	_NFS_lock(&nfsmount->lock);
 	fhandle3 *src = relative_dir == 1 && nfsmount->curdir.val != NULL ? &nfsmount->curdir : &nfsmount->handle;
 	fhandle3_copy(handle, src);
+	_NFS_unlock(&nfsmount->lock);
 
-	// Allocate a new string, since we'll use strtok (and strtok changes strings)
+	// Allocate a new string, since we'll use strtok_r (and strtok_r changes strings)
 	int32_t str = pathEnd != NULL ? pathEnd - path + 1 : strlen(path) + 1;
 	char *input = (char *) _NFS_mem_allocate(str);
 	if (input == NULL) {
@@ -113,7 +203,8 @@ int32_t _NFS_get_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path,
 	}
 	strncpy(input, path, str - 1);
 	input[str-1] = 0;
-	char *dir = strtok(input, "/");
+	char *save = NULL;
+	char *dir = strtok_r(input, "/", &save);
 
 	struct stat obj_attr = {0};
 
@@ -122,7 +213,7 @@ int32_t _NFS_get_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path,
 		fhandle3 newHandle = {0};
 
 		// This method will allocate newHandle, we can free handle after using it
-		int32_t ret = _NFS_do_lookup(nfsmount, handle, dir, &obj_attr, &newHandle);
+		int32_t ret = _NFS_do_lookup(nfsmount, handle, dir, &obj_attr, &newHandle, 0);
 
 		// Free the old handle
 		fhandle3_free(handle);
@@ -130,14 +221,14 @@ int32_t _NFS_get_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path,
 		{
 			fhandle3_free(&newHandle);
 			_NFS_mem_free(input);
-			r->_errno = ENOENT;
+			r->_errno = ret == NFS3ERR_STALE ? NFS3ERR_STALE : ENOENT;
 			return -1;
 		}
 
 		memcpy((void *) handle, (void *) &newHandle, sizeof(fhandle3));
 
 		// Move the pointer to the start of the next dir
-		dir = strtok(NULL, "/");
+		dir = strtok_r(NULL, "/", &save);
 	}
 	_NFS_mem_free(input);
 	return 0;
@@ -158,16 +249,18 @@ DIR_ITER * _NFS_diropen_r(struct _reent *r, DIR_ITER *dirState, const char *path
 		return NULL;
 	}
 
-	_NFS_lock(&state->nfsmount->lock);
-
 	// Allocate a new handle, since we need to retrieve the subdirectories one by one
 	fhandle3 handle = {0};
+	uint32_t generation = state->nfsmount->generation;
+	r->_errno = 0;
 	int32_t ret = _NFS_get_handle(r, state->nfsmount, path, NULL, &handle, 1);
+	if (_NFS_remounted(r, state->nfsmount, generation, ret)) {
+		r->_errno = 0;
+		ret = _NFS_get_handle(r, state->nfsmount, path, NULL, &handle, 1);
+	}
 
 	if (ret == 0) memcpy((void *) &state->handle, (void *) &handle, sizeof(fhandle3));
 
-	_NFS_unlock(&state->nfsmount->lock);
-
 	return r->_errno == 0 ? dirState : NULL;
 }
 
@@ -207,22 +300,33 @@ int32_t _NFS_chdir_r (struct _reent *r, const char *path)
 		return -1;
 	}
 
-	_NFS_lock(&nfsmount->lock);
-
 	// Allocate a new handle, since we need to retrieve the subdirectories one by one
 	fhandle3 handle = {0};
+	uint32_t generation = nfsmount->generation;
+	r->_errno = 0;
 	int32_t ret = _NFS_get_handle(r, nfsmount, path, NULL, &handle, 1);
+	if (_NFS_remounted(r, nfsmount, generation, ret)) ret = _NFS_get_handle(r, nfsmount, path, NULL, &handle, 1);
+
+	// The name is kept from the root of the mount, so it can be looked up again after a remount
+	char *name = ret == 0 ? _NFS_absolute_path(nfsmount, path) : NULL;
+	if (ret == 0 && name == NULL) {
+		fhandle3_free(&handle);
+		r->_errno = ENOMEM;
+		ret = -1;
+	}
 
 	if (ret == 0)
 	{
+		_NFS_lock(&nfsmount->lock);
+
 		// Clear the curdir handle
 		fhandle3_free(&nfsmount->curdir);
 		memcpy((void *) &nfsmount->curdir, (void *) &handle, sizeof(fhandle3));
-		nfsmount->curdirname = _NFS_mem_reallocate(nfsmount->curdirname, strlen(path) + 1);
-		memset(nfsmount->curdirname, 0, strlen(path) + 1);
-		strncpy(nfsmount->curdirname, path, strlen(path));
+		if (nfsmount->curdirname) _NFS_mem_free(nfsmount->curdirname);
+		nfsmount->curdirname = name;
+
+		_NFS_unlock(&nfsmount->lock);
 	}
-	_NFS_unlock(&nfsmount->lock);
 
 	return ret;
 }
@@ -237,31 +341,36 @@ int32_t _NFS_dirreset_r (struct _reent *r, DIR_ITER *dirState)
 	return 0;
 }
 
-extern int32_t _nfs_buffer_size;
-
 // Does a single call to readdirplus, meaning that you get some entries, but not always all
 // The starting point32_t will be defined by the cookie property of the state
 int32_t _NFS_readdirplus_single(NFSMOUNT *nfsmount, NFS_DIR_STATE_STRUCT *state)
 {
-	int32_t headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, PROCEDURE_READDIRPLUS, AUTH_UNIX);
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) return -1;
+
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_READDIRPLUS, AUTH_UNIX);
 
 	// Write a dir entry, first write the handle
 	uint32_t offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, &state->handle);
-	offset += rpc_write_long(nfsmount, offset, state->cookie);
-	offset += rpc_write_long(nfsmount, offset, 0); // Verifier data
-	offset += rpc_write_int(nfsmount, offset, 0); // Dir count
+	offset += rpc_write_fhandle(call, offset, &state->handle);
+	offset += rpc_write_long(call, offset, state->cookie);
+	offset += rpc_write_long(call, offset, 0); // Verifier data
+	offset += rpc_write_int(call, offset, 0); // Dir count
 
 	int32_t max_len = nfsmount->dtpref;
-	if (max_len == 0 || max_len > nfsmount->bufferlen) max_len = nfsmount->bufferlen - offset;
-	offset += rpc_write_int(nfsmount, offset, max_len); // Max size of message
+	if (max_len == 0 || max_len > nfsmount->transport->bufferlen) max_len = nfsmount->transport->bufferlen - offset;
+	offset += rpc_write_int(call, offset, max_len); // Max size of message
 
-	int32_t ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
-	if (ret < 0) return ret;
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return ret;
+	}
 
 	int32_t rpc_header_length = 0;
-	ret = rpc_parse_header(nfsmount, &rpc_header_length);
+	ret = rpc_parse_header(call, &rpc_header_length);
 	if (ret < 0) {
+		nfs_call_put(call);
 		return ret;
 	}
 
@@ -269,21 +378,20 @@ int32_t _NFS_readdirplus_single(NFSMOUNT *nfsmount, NFS_DIR_STATE_STRUCT *state)
 
 	// Read the entries
 	offset = rpc_header_length;
-	offset += rpc_read_int(nfsmount, offset, &boolval);
+	offset += rpc_read_int(call, offset, &boolval);
 	if (boolval != 0) // NFS Status
 	{
+		nfs_call_put(call);
 		return -1; // Invalid status
 	}
-	offset += rpc_read_int(nfsmount, offset, &boolval);
-	if (boolval == 1) { // Does the data contain dir_attributes
-		offset += rpc_read_objectattr(nfsmount, offset, NULL); // I don't need this information
-	}
+	object_attributes *dirattr = _NFS_post_op_attr(call, offset);
+	offset += nfs_attr_read(nfsmount, &state->handle, call, offset); // The dir_attributes
 	offset += 8; // 8 bytes for the verifier data (which is null and has a length 0)
 
 	NFS_DIR_CHILD child;
 
 	while (true) {
-		offset += rpc_read_int(nfsmount, offset, &boolval); // Has entry value
+		offset += rpc_read_int(call, offset, &boolval); // Has entry value
 		if (boolval == 0) {
 			break; // No more values found, we need to check for EOF after this while
 		}
@@ -292,15 +400,23 @@ int32_t _NFS_readdirplus_single(NFSMOUNT *nfsmount, NFS_DIR_STATE_STRUCT *state)
 
 		// Read entry
 		offset += 8; // Skip fileid
-		offset += rpc_read_string(nfsmount, offset, &child.name); // Extract the name
-		offset += rpc_read_long(nfsmount, offset, (long long *) &state->cookie); // Extract the cookie (required for the consequent call, it tells the server where to continue)
-		offset += rpc_read_int(nfsmount, offset, &boolval); // Has attributes
+		offset += rpc_read_string(call, offset, &child.name); // Extract the name
+		offset += rpc_read_long(call, offset, &state->cookie); // Extract the cookie (required for the consequent call, it tells the server where to continue)
+		object_attributes *attr = NULL;
+		offset += rpc_read_int(call, offset, &boolval); // Has attributes
 		if (boolval == 1) {
-			offset += rpc_read_stat(nfsmount, offset, &child.stat); // Read the attributes as stat
+			attr = (object_attributes *) (call->buffer + offset);
+			offset += rpc_read_stat(call, offset, &child.stat); // Read the attributes as stat
 		}
-		offset += rpc_read_int(nfsmount, offset, &boolval); // Has file handle
+		offset += rpc_read_int(call, offset, &boolval); // Has file handle
 		if (boolval == 1) {
-			offset += rpc_read_fhandle(nfsmount, offset, &child.handle); // Read the file handle
+			offset += rpc_read_fhandle(call, offset, &child.handle); // Read the file handle
+			if (attr != NULL) nfs_attr_update(nfsmount, &child.handle, attr, call->xid);
+
+			// Opening or stating the entries after listing them is likely, that needs no LOOKUP calls then
+			if (dirattr != NULL && strcmp(child.name, ".") != 0 && strcmp(child.name, "..") != 0) {
+				nfs_name_add(nfsmount, &state->handle, dirattr, child.name, &child.handle);
+			}
 
 			// I need a handle in order to be able to do something with this child, so I'll add the child here to the list
 			if (state->handle.len == child.handle.len) {
@@ -321,7 +437,8 @@ int32_t _NFS_readdirplus_single(NFSMOUNT *nfsmount, NFS_DIR_STATE_STRUCT *state)
 			memcpy(newChild, &child, sizeof(NFS_DIR_CHILD));
 		}
 	}
-	offset += rpc_read_int(nfsmount, offset, &state->is_completed); // Read the EOF marker (if 0, then you need subsequent replies)
+	offset += rpc_read_int(call, offset, &state->is_completed); // Read the EOF marker (if 0, then you need subsequent replies)
+	nfs_call_put(call);
 	return 0;
 }
 
@@ -340,12 +457,10 @@ int32_t _NFS_readdirplus_all(NFSMOUNT *nfsmount, NFS_DIR_STATE_STRUCT *state)
 int32_t _NFS_dirnext_r (struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat)
 {
 	NFS_DIR_STATE_STRUCT *state = (NFS_DIR_STATE_STRUCT *) dirState->dirStruct;
-	_NFS_lock(&state->nfsmount->lock);
 
 	// You've requested a child that's not there, if we've not completed downloading, download the next "batch" of childs
 	if (state->current_child >= state->numchilds && !state->is_completed) {
 		if (_NFS_readdirplus_single(state->nfsmount, state)) {
-			_NFS_unlock(&state->nfsmount->lock);
 			r->_errno = ENOENT;
 			return -1;
 		}
@@ -353,7 +468,6 @@ int32_t _NFS_dirnext_r (struct _reent *r, DIR_ITER *dirState, char *filename, st
 
 	// We already downloaded the whole directory, and we don't have any more childs.
 	if (state->current_child >= state->numchilds && state->is_completed) { 
-		_NFS_unlock(&state->nfsmount->lock);
 		r->_errno = ENOENT;
 		return -1;
 	}
@@ -364,7 +478,6 @@ int32_t _NFS_dirnext_r (struct _reent *r, DIR_ITER *dirState, char *filename, st
 	}
 
 	state->current_child++;
-	_NFS_unlock(&state->nfsmount->lock);
 	
 	return 0;
 }
@@ -373,17 +486,20 @@ char *_NFS_get_dir_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path
 {
 	char *lastPart = strrchr(path, '/');
 	if (lastPart == NULL) {
-		// No path was specified
+		// No path was specified, the name is in the current directory
+		_NFS_lock(&nfsmount->lock);
 		if (nfsmount->curdir.val == NULL) {
+			_NFS_unlock(&nfsmount->lock);
 			r->_errno = ENOTDIR;
 			return NULL;
 		}
-		handle = &nfsmount->curdir;
+		fhandle3_copy(handle, &nfsmount->curdir);
+		_NFS_unlock(&nfsmount->lock);
 		lastPart = (char *) path;
 	} else {
 		// Get stuff from here
 		if (_NFS_get_handle(r, nfsmount, path, lastPart, handle, 1) < 0) {
-			r->_errno = ENOTDIR;
+			if (r->_errno != NFS3ERR_STALE) r->_errno = ENOTDIR;
 			return NULL;
 		}
 		// Move the lastPart past the last seperator
@@ -392,36 +508,29 @@ char *_NFS_get_dir_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path
 	return lastPart;
 }
 
-int32_t _NFS_mkdir_r (struct _reent *r, const char *path, int32_t mode)
+static int32_t _NFS_mkdir(struct _reent *r, NFSMOUNT *nfsmount, const char *path, int32_t mode)
 {
-	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(path);
-	if (nfsmount == NULL) {
-		r->_errno = ENODEV;
-		return -1;
-	}
-	if (nfsmount->readonly) {
-		r->_errno = EROFS;
-		return -1;
-	}
-
-	_NFS_lock(&nfsmount->lock);
-
 	fhandle3 parentHandle = {0};
 
 	// Get the directory it has to go in
 	char *lastPart = _NFS_get_dir_handle(r, nfsmount, path, &parentHandle);
 	if (lastPart == NULL) {
-		_NFS_unlock(&nfsmount->lock);
+		return -1;
+	}
+
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) {
+		r->_errno = ENOMEM;
 		return -1;
 	}
 
 	// Create the MKDIR message
-	int32_t headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, PROCEDURE_MKDIR, AUTH_UNIX);
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_MKDIR, AUTH_UNIX);
 
 	// Write a dir entry, first write the handle
 	uint32_t offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, &parentHandle);
-	offset += rpc_write_string(nfsmount, offset, lastPart);
+	offset += rpc_write_fhandle(call, offset, &parentHandle);
+	offset += rpc_write_string(call, offset, lastPart);
 
 	sattr3 attr = {0};
 	attr.setmode = 1;
@@ -434,25 +543,55 @@ int32_t _NFS_mkdir_r (struct _reent *r, const char *path, int32_t mode)
 	attr.setatime = TIME_SERVER;
 	attr.setmtime = TIME_SERVER;
 
-	offset += rpc_write_sattr(nfsmount, offset, &attr);
+	offset += rpc_write_sattr(call, offset, &attr);
 
-	int32_t ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
 	if (ret < 0) {
-		_NFS_unlock(&nfsmount->lock);
+		nfs_call_put(call);
 		return ret;
 	}
 
 	int32_t rpc_header_length = 0;
-	ret = rpc_parse_header(nfsmount, &rpc_header_length);
+	ret = rpc_parse_header(call, &rpc_header_length);
 	if (ret < 0) {
-		_NFS_unlock(&nfsmount->lock);
+		nfs_call_put(call);
 		return ret;
 	}
 
-	// I have to do something here? Not sure ;)
-	rpc_read_int(nfsmount, rpc_header_length, &r->_errno);
+	nfs_name_remove(nfsmount, &parentHandle, lastPart);
 
-	_NFS_unlock(&nfsmount->lock);
+	offset = rpc_header_length;
+	offset += rpc_read_int(call, offset, &r->_errno);
+	if (r->_errno == 0) {
+		int32_t intVal;
+		fhandle3 handle = {0};
+		offset += rpc_read_int(call, offset, &intVal);
+		if (intVal) offset += rpc_read_fhandle(call, offset, &handle);
+		offset += nfs_attr_read(nfsmount, &handle, call, offset);
+		fhandle3_free(&handle);
+	}
+	nfs_attr_wcc(nfsmount, &parentHandle, call, offset);
+
+	nfs_call_put(call);
 
 	return r->_errno == 0 ? 0 : -1;
 }
+
+int32_t _NFS_mkdir_r (struct _reent *r, const char *path, int32_t mode)
+{
+	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(path);
+	if (nfsmount == NULL) {
+		r->_errno = ENODEV;
+		return -1;
+	}
+	if (nfsmount->readonly) {
+		r->_errno = EROFS;
+		return -1;
+	}
+
+	uint32_t generation = nfsmount->generation;
+	r->_errno = 0;
+	int32_t ret = _NFS_mkdir(r, nfsmount, path, mode);
+	if (_NFS_remounted(r, nfsmount, generation, ret)) ret = _NFS_mkdir(r, nfsmount, path, mode);
+	return ret;
+}
@@ -33,8 +33,9 @@
 #include "nfs_file.h"
 
 int32_t _NFS_get_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path, char *pathEnd, fhandle3 *handle, int32_t only_directories);
+char *_NFS_absolute_path(NFSMOUNT *nfsmount, const char *path);
 char *_NFS_get_dir_handle(struct _reent *r, NFSMOUNT *nfsmount, const char *path, fhandle3 *handle);
-int32_t _NFS_do_lookup(NFSMOUNT *nfsmount, fhandle3 *parentHandle, const char *dir, struct stat *attr, fhandle3 *handle);
+int32_t _NFS_do_lookup(NFSMOUNT *nfsmount, fhandle3 *parentHandle, const char *dir, struct stat *attr, fhandle3 *handle, int32_t fresh);
 
 DIR_ITER * _NFS_diropen_r(struct _reent *r, DIR_ITER *dirState, const char *path);
 int32_t _NFS_dirreset_r (struct _reent *r, DIR_ITER *dirState);
@@ -34,6 +34,9 @@
 #include "rpc.h"
 #include "rpc_mount.h"
 #include "nfs_net.h"
+#include "nfs_attr.h"
+#include "nfs_name.h"
+#include "nfs_rcache.h"
 #include "nfs_dir.h"
 #include "nfs_file.h"
 
@@ -42,39 +45,63 @@ void _NFS_copy_stat(struct stat *dest, struct stat *src)
 	memcpy(dest, src, sizeof(struct stat));
 }
 
+// The attributes are often known already, from the LOOKUP of the handle or from an earlier call
 int32_t _NFS_stat_from_handle(struct _reent *r, NFSMOUNT *nfsmount, fhandle3 *handle, struct stat *st)
 {
-	int32_t headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, PROCEDURE_GETATTR, AUTH_UNIX);
+	object_attributes attr;
+	int32_t ret = nfs_attr_fetch(nfsmount, handle, &attr);
+	if (ret < 0) return ret;
 
-	// Write a dir entry, first write the handle
-	uint32_t offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, handle);
+	r->_errno = ret;
+	if (ret == 0) _NFS_copy_stat_from_attributes(st, &attr);
+	return ret == 0 ? 0 : -1;
+}
 
-	int32_t ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
-	if (ret < 0) {
-		_NFS_unlock(&nfsmount->lock);
-		return ret;
-	}
+int32_t _NFS_remounted(struct _reent *r, NFSMOUNT *nfsmount, uint32_t generation, int32_t ret)
+{
+	return ret < 0 && r->_errno == NFS3ERR_STALE && rpc_remount(nfsmount, generation) == 0;
+}
 
-	int32_t rpc_header_length = 0;
-	ret = rpc_parse_header(nfsmount, &rpc_header_length);
-	if (ret < 0) {
-		_NFS_unlock(&nfsmount->lock);
-		return ret;
+static int32_t _NFS_lookup_path(struct _reent *r, NFSMOUNT *nfsmount, const char *path, fhandle3 *handle)
+{
+	fhandle3 dir = {0};
+	char *filename = _NFS_get_dir_handle(r, nfsmount, path, &dir);
+	if (filename == NULL) return -1;
+
+	int32_t ret = _NFS_do_lookup(nfsmount, &dir, filename, NULL, handle, 0);
+	fhandle3_free(&dir);
+	if (ret != 0) {
+		r->_errno = ret == NFS3ERR_NOENT ? ENOENT : ret > 0 ? ret : EIO;
+		return -1;
 	}
+	return 0;
+}
 
-	rpc_read_int(nfsmount, rpc_header_length, &r->_errno);
-
-	if (r->_errno == 0) {
-		rpc_read_stat(nfsmount, rpc_header_length + 4, st);
+int32_t _NFS_reopen(struct _reent *r, NFS_FILE_STRUCT *file)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+	if (file->path == NULL) return -1;
+
+	// The mount may have been renewed since the file was opened, then it's only mounted again when its root handle is stale too
+	uint32_t generation = nfsmount->generation;
+	if (generation == file->generation && rpc_remount(nfsmount, generation) != 0) return -1;
+
+	fhandle3 handle = {0};
+	r->_errno = 0;
+	int32_t ret = _NFS_lookup_path(r, nfsmount, file->path, &handle);
+	if (generation != file->generation && _NFS_remounted(r, nfsmount, generation, ret)) {
+		r->_errno = 0;
+		ret = _NFS_lookup_path(r, nfsmount, file->path, &handle);
 	}
+	if (ret < 0) return -1;
 
-	_NFS_unlock(&nfsmount->lock);
-
-	return r->_errno == 0 ? 0 : -1;
+	fhandle3_free(&file->handle);
+	file->handle = handle;
+	file->generation = nfsmount->generation;
+	return 0;
 }
 
-int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32_t flags, int32_t mode)
+static int32_t _NFS_open(struct _reent *r, void *fileStruct, const char *path, int32_t flags, int32_t mode)
 {
 	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(path);
 	if (nfsmount == NULL) {
@@ -88,8 +115,6 @@ int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32
 		return -1;
 	}
 
-	_NFS_lock(&nfsmount->lock);
-
 	NFS_FILE_STRUCT* file = (NFS_FILE_STRUCT*) fileStruct;
 	memset(file, 0, sizeof(NFS_FILE_STRUCT));
 	file->nfsmount = nfsmount;
@@ -105,8 +130,7 @@ int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32
 	fhandle3 baseDir = {0};
 	char *filename = _NFS_get_dir_handle(r, nfsmount, path, &baseDir);
 	if (filename == NULL) {
-		_NFS_unlock(&nfsmount->lock);
-		r->_errno = EACCES;
+		if (r->_errno != NFS3ERR_STALE) r->_errno = EACCES;
 		return -1;
 	}
 
@@ -114,8 +138,8 @@ int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32
 	int32_t exists = 1;
 	struct stat attr = {0};
 
-	// Do a lookup on the file, and a GETATTR call after that
-	r->_errno = _NFS_do_lookup(file->nfsmount, &baseDir, filename, &attr, &file->handle);
+	// Do a lookup on the file, the handle may come from the name cache but the size and mtime are always the current ones
+	r->_errno = _NFS_do_lookup(file->nfsmount, &baseDir, filename, &attr, &file->handle, 1);
 	if (r->_errno != 0) {
 		if (r->_errno != NFS3ERR_NOENT) {
 			return -1;
@@ -126,14 +150,12 @@ int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32
 	//If the file exists at this point, we're done
 	if (file->handle.len > 0) {
 		if ((flags & O_EXCL) == O_EXCL && (flags & O_CREAT) == O_CREAT) {
-			_NFS_unlock(&file->nfsmount->lock);
 			r->_errno = EEXIST;
 			return -1;
 		}
 		file->size = (int32_t) attr.st_size;
 		file->currentPosition = ((flags & O_APPEND) == O_APPEND) ? file->size : 0;
 		if ((flags & O_TRUNC) == 0) { // If we need truncation, we need a create call
-			_NFS_unlock(&file->nfsmount->lock);
 			return 0;
 		}
 	}
@@ -153,17 +175,23 @@ int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32
 	if ((flags & O_TRUNC) == O_TRUNC)
 		create_mode = CREATE_UNCHECKED;
 
-	int32_t headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, create_mode == -1 ? PROCEDURE_LOOKUP : PROCEDURE_CREATE, AUTH_UNIX);
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) {
+		r->_errno = ENOMEM;
+		return -1;
+	}
+
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, create_mode == -1 ? PROCEDURE_LOOKUP : PROCEDURE_CREATE, AUTH_UNIX);
 
 	// Write a dir entry, first write the handle
 	uint32_t offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, &baseDir);
-	offset += rpc_write_string(nfsmount, offset, filename);
+	offset += rpc_write_fhandle(call, offset, &baseDir);
+	offset += rpc_write_string(call, offset, filename);
 
 	if (create_mode != -1) {
 		// Do a create call
 		file->isnew = 1;
-		offset += rpc_write_int(nfsmount, offset, create_mode);
+		offset += rpc_write_int(call, offset, create_mode);
 
 		sattr3 attr = {0};
 		attr.setmode = 1;
@@ -176,259 +204,890 @@ int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32
 		attr.setatime = TIME_SERVER;
 		attr.setmtime = TIME_SERVER;
 
-		offset += rpc_write_sattr(nfsmount, offset, &attr);
+		offset += rpc_write_sattr(call, offset, &attr);
 	}
 
-	int32_t ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
 	if (ret < 0) {
-		_NFS_unlock(&nfsmount->lock);
+		nfs_call_put(call);
 		return ret;
 	}
 
 	int32_t rpc_header_length = 0;
-	ret = rpc_parse_header(nfsmount, &rpc_header_length);
+	ret = rpc_parse_header(call, &rpc_header_length);
 	if (ret < 0) {
-		_NFS_unlock(&nfsmount->lock);
+		nfs_call_put(call);
 		return -1;
 	}
 
+	if (create_mode != -1) nfs_name_remove(nfsmount, &baseDir, filename);
+
 	offset = rpc_header_length;
-	offset += rpc_read_int(nfsmount, offset, &r->_errno);
+	offset += rpc_read_int(call, offset, &r->_errno);
 
 	if (r->_errno == 0) {
 		int intVal;
-		offset += rpc_read_int(nfsmount, offset, &intVal);
-		if (intVal) offset += rpc_read_fhandle(nfsmount, offset, &file->handle);
+		offset += rpc_read_int(call, offset, &intVal);
+		if (intVal) offset += rpc_read_fhandle(call, offset, &file->handle);
 
-		offset += rpc_read_int(nfsmount, offset, &intVal);
+		offset += rpc_read_int(call, offset, &intVal);
 		if (intVal) {
 			struct stat attr;
-			offset += rpc_read_stat(nfsmount, offset, &attr);
+			nfs_attr_update(nfsmount, &file->handle, (object_attributes *) (call->buffer + offset), call->xid);
+			offset += rpc_read_stat(call, offset, &attr);
 		
 			file->size = attr.st_size;
 		}
+		offset += nfs_attr_wcc(nfsmount, &baseDir, call, offset);
 	}
 
 	if (create_mode == -1 && (flags & O_APPEND) == O_APPEND) {
 		file->currentPosition = file->size;
 	}
 
-	_NFS_unlock(&nfsmount->lock);
+	nfs_call_put(call);
 
 	return r->_errno == 0 ? 0 : -1;
 }
 
-int32_t _NFS_close_r (struct _reent *r, int32_t fd)
+int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32_t flags, int32_t mode)
 {
-	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) fd;
+	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(path);
+	if (nfsmount == NULL) {
+		r->_errno = ENODEV;
+		return -1;
+	}
 
-	_NFS_lock(&file->nfsmount->lock);
+	// A server which restarted doesn't know the handles anymore, so mount again and look the path up once more
+	uint32_t generation = nfsmount->generation;
+	r->_errno = 0;
+	int32_t ret = _NFS_open(r, fileStruct, path, flags, mode);
+	if (_NFS_remounted(r, nfsmount, generation, ret)) {
+		generation = nfsmount->generation;
+		ret = _NFS_open(r, fileStruct, path, flags, mode);
+	}
+	if (ret != 0) return ret;
 
-	if (file->shouldcommit == 1) {
-		// Do a COMMIT message
-		int32_t headerSize = rpc_create_header(file->nfsmount, PROGRAM_NFS, 3, PROCEDURE_COMMIT, AUTH_UNIX);
+	// Keep the path, to look the file up again when its handle goes stale later on, also after a chdir
+	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) fileStruct;
+	file->path = _NFS_absolute_path(nfsmount, path);
+	file->generation = generation;
+	return 0;
+}
 
-		// Write a dir entry, first write the handle
-		uint32_t offset = headerSize;
-		offset += rpc_write_fhandle(file->nfsmount, offset, &file->handle);
-		offset += rpc_write_long(file->nfsmount, offset, 0);
-		offset += rpc_write_int(file->nfsmount, offset, 0);
+// The max amount of requests in flight for a READ or WRITE of a file, over all flows
+int32_t _NFS_total_window(NFSMOUNT *nfsmount, int32_t window)
+{
+	window *= nfsmount->transport->numflows;
+	return window > NFS_MAX_WINDOW ? NFS_MAX_WINDOW : window;
+}
 
-		int32_t ret = udp_sendrecv(file->nfsmount, offset, file->nfsmount->nfs_port);
-		if (ret < 0) {
-			_NFS_unlock(&file->nfsmount->lock);
-			return ret;
-		}
+// The block size for a transfer, at most max bytes
+int32_t _NFS_block_size(NFSMOUNT *nfsmount, NFS_BLOCK_CTL *ctl, int32_t max)
+{
+	_NFS_lock(&nfsmount->lock);
+	int32_t size = max >> ctl->level;
+	if (size < NFS_BLOCK_MIN) size = max < NFS_BLOCK_MIN ? max : NFS_BLOCK_MIN;
+	size &= ~3;
+	ctl->size = size;
+	_NFS_unlock(&nfsmount->lock);
+	return size;
+}
 
-		int32_t rpc_header_length = 0;
-		ret = rpc_parse_header(file->nfsmount, &rpc_header_length);
-		if (ret < 0) {
-			_NFS_unlock(&file->nfsmount->lock);
-			return -1;
+// Counts the reply to a block, called with the lock held
+void _NFS_block_reply(NFS_BLOCK_CTL *ctl, uint32_t count, int32_t sends)
+{
+	ctl->replies++;
+	ctl->bytes += count;
+	if (sends > 1) ctl->retransmitted++;
+}
+
+// Adds the time a transfer took, and moves the block size after every epoch of replies.
+// Over UDP a lost fragment costs the whole block, so blocks get smaller while too many need a retransmit.
+// Without loss they grow again, as long as the larger size wasn't measured to be slower.
+void _NFS_block_update(NFSMOUNT *nfsmount, NFS_BLOCK_CTL *ctl, uint64_t elapsed)
+{
+	_NFS_lock(&nfsmount->lock);
+	ctl->busy += elapsed;
+	if (ctl->replies >= NFS_BLOCK_EPOCH && ctl->bytes >= NFS_BLOCK_EPOCH_BYTES) {
+		int32_t level = ctl->level;
+		uint32_t rate = ctl->bytes / (ctl->busy / 1000 + 1);
+		ctl->rate[level] = ctl->rate[level] == 0 ? rate : (ctl->rate[level] * 3 + rate) / 4;
+
+		uint32_t *rates = ctl->rate;
+		int32_t lossy = ctl->retransmitted * 16 > ctl->replies;
+		if (lossy) {
+			// Unless smaller blocks were slower, the loss doesn't depend on the size then
+			if (level < NFS_BLOCK_LEVELS - 1 && (rates[level + 1] == 0 || rates[level + 1] >= rates[level])) level++;
+		} else if (level > 0 && (rates[level - 1] == 0 ? ctl->retransmitted == 0 : rates[level - 1] > rates[level])) {
+			level--;
 		}
+		ctl->level = level;
 
-		int intVal;
-		rpc_read_int(file->nfsmount, offset, &intVal);
-		if (intVal != 0) {
-			_NFS_unlock(&file->nfsmount->lock);
-			return intVal;
+		// The network changes, so measure the other sizes again now and then
+		if (++ctl->epochs % 16 == 0) memset(ctl->rate, 0, sizeof(ctl->rate));
+
+		ctl->replies = 0;
+		ctl->retransmitted = 0;
+		ctl->bytes = 0;
+		ctl->busy = 0;
+	}
+	_NFS_unlock(&nfsmount->lock);
+}
+
+// Picks the flow with the most room in its congestion window, or -1 when all are full.
+// The congestion windows are shared by all files on all mounts of the server, so when the caller
+// has nothing in flight the least busy flow is used anyway.
+int32_t _NFS_pick_flow(NFSMOUNT *nfsmount, int32_t inflight)
+{
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	int32_t flow, best = -1, room = inflight > 0 ? 0 : -NFS_MAX_WINDOW * NFS_MAX_FLOWS;
+	_NFS_lock(&transport->lock);
+	for (flow = 0; flow < transport->numflows; flow++) {
+		NFS_FLOW *f = &transport->flows[flow];
+		int32_t avail = f->cwnd - f->inflight;
+		if (avail > room) {
+			room = avail;
+			best = flow;
 		}
 	}
-	mutex_t lock = file->nfsmount->lock;
+	_NFS_unlock(&transport->lock);
+	return best;
+}
 
-	memset(file, 0, sizeof(NFS_FILE_STRUCT));
-	_NFS_unlock(&lock);
+// Queues a request of a window, it takes room in the window of its flow until its reply arrives
+int32_t _NFS_queue_request(NFS_FILE_STRUCT *file, NFS_IO_REQUEST *request, const char *data, NFS_QUEUE_FUNC queue)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+	_NFS_lock(&nfsmount->transport->lock);
+	nfsmount->transport->flows[request->flow].inflight++;
+	_NFS_unlock(&nfsmount->transport->lock);
 
-	return 0;
+	return queue(file, request, data);
 }
 
-ssize_t _NFS_write_r (struct _reent *r, int32_t fd, const char *ptr, size_t len)
+// Whether one of the requests has its reply already, the window is only filled again once those are handled
+int32_t _NFS_any_replied(NFSMOUNT *nfsmount, NFS_IO_REQUEST *requests, int32_t inflight)
 {
-	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) fd;
+	int32_t i, replied = 0;
+	_NFS_lock(&nfsmount->transport->lock);
+	for (i = 0; i < inflight && !replied; i++) replied = requests[i].call->length >= 0;
+	_NFS_unlock(&nfsmount->transport->lock);
+	return replied;
+}
 
-	if (file == NULL || !file->write) {
-		r->_errno = EBADF;
-		return -1;
+// Sends the queued requests of a window together
+int32_t _NFS_send_requests(NFS_IO_REQUEST *requests, int32_t count)
+{
+	NFS_CALL *calls[NFS_MAX_WINDOW];
+	int32_t i;
+	for (i = 0; i < count; i++) calls[i] = requests[i].call;
+	return nfs_send_queued(calls, count);
+}
+
+// Gives up on the requests of a window, a late reply to them is ignored
+void _NFS_cancel_requests(NFSMOUNT *nfsmount, NFS_IO_REQUEST *requests, int32_t inflight)
+{
+	int32_t i;
+	for (i = 0; i < inflight; i++) {
+		_NFS_lock(&nfsmount->transport->lock);
+		nfsmount->transport->flows[requests[i].flow].inflight--;
+		_NFS_unlock(&nfsmount->transport->lock);
+		nfs_call_put(requests[i].call);
 	}
+}
 
-	_NFS_lock(&file->nfsmount->lock);
-	file->shouldcommit = 1;
+// Waits for a reply to one of the requests in flight, requests are sent again with a doubled timeout when
+// their reply is late. Returns the index of the request the reply belongs to, the reply is in the buffer of its call.
+int32_t _NFS_wait_reply(NFS_FILE_STRUCT *file, NFS_IO_REQUEST *requests, int32_t inflight, int32_t rttclass)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	NFS_CALL *calls[NFS_MAX_WINDOW];
+	int32_t i;
 
-	int32_t block_len = file->nfsmount->wtpref;
-	// Calculate the best block_len, as specified by the server
-	if (block_len > file->nfsmount->bufferlen) block_len = ((file->nfsmount->bufferlen - 1)/file->nfsmount->wtmult) * file->nfsmount->wtmult;
+	for (i = 0; i < inflight; i++) calls[i] = requests[i].call;
 
-	int32_t amount_of_data_written = 0;
-	int64_t verifier = 0;
-	do
+	while (1)
 	{
-		// Amount of data to read
-		int32_t current_block = block_len;
-		if (len - amount_of_data_written < current_block) current_block = len - amount_of_data_written;
+		// Resend the requests which timed out, and find out how long we can wait for the others
+		uint64_t deadline = 0;
+		for (i = 0; i < inflight; i++) {
+			int32_t ret = nfs_retransmit(calls[i]);
+			if (ret < 0) return ret;
+			uint64_t due = nfs_call_due(calls[i]);
+			if (deadline == 0 || due < deadline) deadline = due;
+		}
 
-		int32_t headerSize = rpc_create_header(file->nfsmount, PROGRAM_NFS, 3, PROCEDURE_WRITE, AUTH_UNIX);
+		// A reply may have been handed over since the last wait, so they're looked for even when one is due
+		uint64_t now = nfs_now();
+		i = nfs_wait(transport, calls, inflight, deadline > now ? deadline - now : 0);
+		if (i < 0 || calls[i]->length < 0) continue;
+
+		// Only replies which aren't ambiguous are measured, and open the window of their flow further
+		NFS_CALL *call = calls[i];
+		_NFS_lock(&transport->lock);
+		NFS_FLOW *flow = &transport->flows[requests[i].flow];
+		if (nfs_rtt_measure(call) && flow->cwnd < NFS_MAX_WINDOW) flow->cwnd++;
+		flow->inflight--;
+		_NFS_unlock(&transport->lock);
+
+		_NFS_lock(&nfsmount->lock);
+		_NFS_block_reply(rttclass == NFS_RTT_READ ? &nfsmount->readctl : &nfsmount->writectl, requests[i].count, call->sends);
+		_NFS_unlock(&nfsmount->lock);
+		return i;
+	}
+}
 
-		uint32_t offset = headerSize;
-		offset += rpc_write_fhandle(file->nfsmount, offset, &file->handle);
-		offset += rpc_write_long(file->nfsmount, offset, file->currentPosition);
+int32_t _NFS_queue_write(NFS_FILE_STRUCT *file, NFS_IO_REQUEST *request, const char *data)
+{
+	NFS_CALL *call = request->call;
 
-		#if defined (__wii__)
-		current_block = 4096 - (offset + 12); // I'll have to write less bytes (12 for the other header bytes, which we still have to write), max 4096
-		if (len - amount_of_data_written < current_block) current_block = len - amount_of_data_written;
-		#endif
+	// Retransmissions send this call again as it is, so a late reply to the first transmission is still accepted
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_WRITE, AUTH_UNIX);
 
-		offset += rpc_write_int(file->nfsmount, offset, current_block);
-		offset += rpc_write_int(file->nfsmount, offset, WRITE_UNSTABLE);		
-		offset += rpc_write_block(file->nfsmount, offset, (void *) ptr + amount_of_data_written, current_block);
+	uint32_t offset = headerSize;
+	offset += rpc_write_fhandle(call, offset, &file->handle);
+	offset += rpc_write_long(call, offset, request->position);
+	offset += rpc_write_int(call, offset, request->count);
+	offset += rpc_write_int(call, offset, WRITE_UNSTABLE);
+	offset += rpc_write_int(call, offset, request->count);
+
+	// The data is sent from the buffer of the caller, without copying it into the call buffer first
+	return nfs_queue_flow(call, request->flow, offset, data + request->bufoffset, request->count);
+}
 
-		int32_t ret = udp_sendrecv(file->nfsmount, offset, file->nfsmount->nfs_port);
-		if (ret < 0) {
-			_NFS_unlock(&file->nfsmount->lock);
-			return ret;
+// Writes len bytes of data at position in blocks of block_len, keeping up to write_window WRITE requests in flight.
+// Returns NFS_VERIFIER_CHANGED if the write verifier changed, which means that the server
+// may have lost unstable data that was written before.
+int32_t _NFS_write_blocks(struct _reent *r, NFS_FILE_STRUCT *file, const char *data, uint32_t position, uint32_t len, int32_t block_len)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+
+	int32_t window = nfsmount->write_window;
+	if (window < 1) window = 1;
+	if (window > NFS_MAX_WINDOW) window = NFS_MAX_WINDOW;
+	int32_t total = _NFS_total_window(nfsmount, window);
+
+	NFS_IO_REQUEST requests[NFS_MAX_WINDOW];
+	int32_t inflight = 0;
+	uint32_t requested = 0;
+	int32_t changed = 0;
+	int32_t i;
+
+	while (inflight > 0 || requested < len)
+	{
+		// Fill the window, the new requests are sent together
+		int32_t queued = inflight;
+		while (inflight < total && requested < len && !_NFS_any_replied(nfsmount, requests, inflight))
+		{
+			// Stripe the blocks over the flows which have room
+			int32_t flow = _NFS_pick_flow(nfsmount, inflight);
+			if (flow < 0) break;
+
+			NFS_IO_REQUEST *request = &requests[inflight];
+			request->call = nfs_call_get(nfsmount);
+			if (request->call == NULL) {
+				_NFS_cancel_requests(nfsmount, requests, inflight);
+				r->_errno = ENOMEM;
+				return -1;
+			}
+			request->flow = flow;
+			request->bufoffset = requested;
+			request->position = position + requested;
+			request->count = len - requested < block_len ? len - requested : block_len;
+
+			inflight++;
+			if (_NFS_queue_request(file, request, data, _NFS_queue_write) < 0) {
+				_NFS_cancel_requests(nfsmount, requests, inflight);
+				return -1;
+			}
+			requested += request->count;
+		}
+		if (_NFS_send_requests(requests + queued, inflight - queued) < 0) {
+			_NFS_cancel_requests(nfsmount, requests, inflight);
+			return -1;
+		}
+
+		i = _NFS_wait_reply(file, requests, inflight, NFS_RTT_WRITE);
+		if (i < 0) {
+			_NFS_cancel_requests(nfsmount, requests, inflight);
+			return i;
 		}
 
+		// Take the request out of the window, it goes back in when it has to be sent again
+		NFS_IO_REQUEST request = requests[i];
+		requests[i] = requests[--inflight];
+		NFS_CALL *call = request.call;
+
 		int32_t rpc_header_length = 0;
-		ret = rpc_parse_header(file->nfsmount, &rpc_header_length);
+		int32_t ret = rpc_parse_header(call, &rpc_header_length);
 		if (ret < 0) {
-			_NFS_unlock(&file->nfsmount->lock);
+			nfs_call_put(call);
+			_NFS_cancel_requests(nfsmount, requests, inflight);
 			return ret;
 		}
 
 		int32_t intVal, count;
-		offset = rpc_header_length;
-		offset += rpc_read_int(file->nfsmount, offset, &intVal);
+		uint32_t offset = rpc_header_length;
+		offset += rpc_read_int(call, offset, &intVal);
 		if (intVal != 0) {
+			nfs_call_put(call);
+			_NFS_cancel_requests(nfsmount, requests, inflight);
 			r->_errno = intVal;
 			return -1;
 		}
 
-		// We will receive the weak cache consistency first, ignore it
-		offset += rpc_read_int(file->nfsmount, offset, &intVal);
-		if (intVal) offset += sizeof(object_attributes); // skip "before" object attributes
-		offset += rpc_read_int(file->nfsmount, offset, &intVal);
-		if (intVal) offset += sizeof(object_attributes); // skip "after" object attributes
+		// The weak cache consistency data comes first, the attributes after the write are kept
+		offset += nfs_attr_wcc(nfsmount, &file->handle, call, offset);
+
+		offset += rpc_read_int(call, offset, &count);
+		offset += rpc_read_int(call, offset, &intVal); // Committed, we don't care since everything is committed at close or fsync
+
+		int64_t verifier;
+		offset += rpc_read_long(call, offset, &verifier);
+		if (!file->hasverifier) {
+			file->verifier = verifier;
+			file->hasverifier = 1;
+		} else if (file->verifier != verifier) {
+			// Server state changed, unstable data written before may be lost
+			file->verifier = verifier;
+			changed = 1;
+		}
 
-		offset += rpc_read_int(file->nfsmount, offset, &count);
-		offset += rpc_read_int(file->nfsmount, offset, &intVal); // Committed, which may be everything, since we use UNSAFE write (it must be intVal >= WRITE_MODE)
+		if (count > 0 && count < request.count) {
+			// Short write, send the remainder with a new request
+			request.bufoffset += count;
+			request.position += count;
+			request.count -= count;
+			requests[inflight++] = request;
+			if (_NFS_queue_request(file, &requests[inflight - 1], data, _NFS_queue_write) < 0 || _NFS_send_requests(&requests[inflight - 1], 1) < 0) {
+				_NFS_cancel_requests(nfsmount, requests, inflight);
+				return -1;
+			}
+			continue;
+		}
 
-		int64_t newVerifier;
-		offset += rpc_read_long(file->nfsmount, offset, &newVerifier);
-		if (verifier == 0) verifier = newVerifier;
-		else if (verifier != newVerifier) { // Server state changed between calls, that cannot be allowed!
-			r->_errno=EIO;
+		nfs_call_put(call);
+		if (count <= 0) {
+			_NFS_cancel_requests(nfsmount, requests, inflight);
+			r->_errno = EIO;
 			return -1;
 		}
+	}
+
+	return changed ? NFS_VERIFIER_CHANGED : len;
+}
 
-		amount_of_data_written += count;
-		file->currentPosition += count;
+// Writes len bytes of data at position, see _NFS_write_blocks
+int32_t _NFS_write_data(struct _reent *r, NFS_FILE_STRUCT *file, const char *data, uint32_t position, uint32_t len)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
 
-		if (intVal) {
+	int32_t block_len = nfsmount->wtpref;
+	if (nfsmount->transport->protocol == PROTO_TCP) {
+		// No fragmentation over TCP and the data isn't copied into the buffer, use the largest block the server allows
+		block_len = nfsmount->wtmax;
+	}
+#ifdef NET_HAS_IOVEC
+	else if (block_len > UDP_MAX_DATAGRAM - RPC_MAX_HEADER) {
+		// Over UDP the header and the data are gathered into one datagram, only its size limits the block
+		block_len = UDP_MAX_DATAGRAM - RPC_MAX_HEADER;
+	}
+#else
+	else if (block_len > nfsmount->transport->bufferlen - RPC_MAX_HEADER) {
+		// Over UDP the data is sent from the buffer of the call, behind the header
+		block_len = nfsmount->transport->bufferlen - RPC_MAX_HEADER;
+	}
+#endif
+	if (nfsmount->wsize > 0 && nfsmount->wsize < block_len) block_len = nfsmount->wsize;
+
+	if (nfsmount->transport->protocol == PROTO_UDP && nfsmount->maxdatagram > 0) {
+		// The header and the data have to fit in a datagram (24 bytes for the fhandle length, position, count, stable and data length)
+		NFS_CALL *call = nfs_call_get(nfsmount);
+		if (call == NULL) {
+			r->_errno = ENOMEM;
+			return -1;
+		}
+		int32_t max_len = nfsmount->maxdatagram - (rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_WRITE, AUTH_UNIX) + file->handle.len + 24);
+		max_len &= ~3; // Leave no room for padding
+		if (block_len > max_len) block_len = max_len;
+		nfs_call_put(call);
+	}
+
+	block_len = _NFS_block_size(nfsmount, &nfsmount->writectl, block_len);
+
+	uint64_t start = nfs_now();
+	r->_errno = 0;
+	int32_t ret = _NFS_write_blocks(r, file, data, position, len, block_len);
+	if (ret < 0 && r->_errno == NFS3ERR_STALE && _NFS_reopen(r, file) == 0) {
+		ret = _NFS_write_blocks(r, file, data, position, len, block_len);
+	}
+	_NFS_block_update(nfsmount, &nfsmount->writectl, nfs_now() - start);
+	return ret;
+}
+
+// Writes all data which isn't committed yet again, after the server has lost it
+int32_t _NFS_write_uncommitted(struct _reent *r, NFS_FILE_STRUCT *file)
+{
+	int32_t attempts = 0, ret = 0;
+	int32_t i;
+
+	for (i = 0; i < (int32_t) file->numranges; i++) {
+		NFS_WRITE_RANGE *range = &file->ranges[i];
+		ret = _NFS_write_data(r, file, file->uncommitted + range->bufoffset, range->position, range->count);
+		if (ret == NFS_VERIFIER_CHANGED && ++attempts < NFS_MAX_RESENDS) {
+			i = -1; // Lost again while resending, start over
+			continue;
+		}
+		if (ret < 0) return ret == NFS_VERIFIER_CHANGED ? -1 : ret;
+	}
+	return 0;
+}
+
+static int32_t _NFS_commit_once(struct _reent *r, NFS_FILE_STRUCT *file)
+{
+	NFS_CALL *call = nfs_call_get(file->nfsmount);
+	if (call == NULL) {
+		r->_errno = ENOMEM;
+		return -1;
+	}
+
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_COMMIT, AUTH_UNIX);
+
+	// Write a dir entry, first write the handle
+	uint32_t offset = headerSize;
+	offset += rpc_write_fhandle(call, offset, &file->handle);
+	offset += rpc_write_long(call, offset, 0);
+	offset += rpc_write_int(call, offset, 0);
+
+	int32_t ret = nfs_sendrecv(call, offset, file->nfsmount->transport->nfs_port);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return ret;
+	}
+
+	int32_t rpc_header_length = 0;
+	ret = rpc_parse_header(call, &rpc_header_length);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return -1;
+	}
+
+	int32_t intVal;
+	offset = rpc_header_length;
+	offset += rpc_read_int(call, offset, &intVal);
+	if (intVal != 0) {
+		nfs_call_put(call);
+		r->_errno = intVal;
+		return -1;
+	}
+	offset += nfs_attr_wcc(file->nfsmount, &file->handle, call, offset);
+
+	int64_t verifier;
+	rpc_read_long(call, offset, &verifier);
+	nfs_call_put(call);
+
+	if (file->hasverifier && file->verifier != verifier) {
+		file->verifier = verifier;
+		return NFS_VERIFIER_CHANGED;
+	}
+	return 0;
+}
+
+// Sends a single COMMIT for the whole file
+// Returns NFS_VERIFIER_CHANGED if the verifier differs from the one returned by the WRITE calls
+int32_t _NFS_commit(struct _reent *r, NFS_FILE_STRUCT *file)
+{
+	r->_errno = 0;
+	int32_t ret = _NFS_commit_once(r, file);
+	if (ret < 0 && r->_errno == NFS3ERR_STALE && _NFS_reopen(r, file) == 0) ret = _NFS_commit_once(r, file);
+	return ret;
+}
+
+// Commits all unstable writes, and writes the data again as long as the server loses it
+int32_t _NFS_flush(struct _reent *r, NFS_FILE_STRUCT *file)
+{
+	int32_t attempts = 0, ret;
+
+	while ((ret = _NFS_commit(r, file)) == NFS_VERIFIER_CHANGED) {
+		if (++attempts >= NFS_MAX_RESENDS) {
+			r->_errno = EIO;
+			return -1;
+		}
+		if ((ret = _NFS_write_uncommitted(r, file)) < 0) return ret;
+	}
+	if (ret < 0) return ret;
+
+	file->uncommittedlen = 0;
+	file->numranges = 0;
+	file->shouldcommit = 0;
+	return 0;
+}
+
+// Keeps a copy of written data until it is committed, returns -1 if it doesn't fit
+int32_t _NFS_keep_uncommitted(NFS_FILE_STRUCT *file, const char *data, uint32_t position, uint32_t len)
+{
+	if (file->uncommittedlen + len > file->nfsmount->commit_buffer_size) return -1;
+
+	if (file->uncommitted == NULL) {
+		file->uncommitted = _NFS_mem_allocate(file->nfsmount->commit_buffer_size);
+		if (file->uncommitted == NULL) return -1;
+	}
+
+	NFS_WRITE_RANGE *ranges = _NFS_mem_reallocate(file->ranges, (file->numranges + 1) * sizeof(NFS_WRITE_RANGE));
+	if (ranges == NULL) return -1;
+	file->ranges = ranges;
+
+	NFS_WRITE_RANGE *range = &file->ranges[file->numranges++];
+	range->position = position;
+	range->bufoffset = file->uncommittedlen;
+	range->count = len;
+	memcpy(file->uncommitted + file->uncommittedlen, data, len);
+	file->uncommittedlen += len;
+	return 0;
+}
+
+void _NFS_free_uncommitted(NFS_FILE_STRUCT *file)
+{
+	if (file->uncommitted) _NFS_mem_free(file->uncommitted);
+	if (file->ranges) _NFS_mem_free(file->ranges);
+	file->uncommitted = NULL;
+	file->ranges = NULL;
+	file->uncommittedlen = 0;
+	file->numranges = 0;
+}
+
+int32_t _NFS_close_r (struct _reent *r, int32_t fd)
+{
+	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) (intptr_t) fd;
+
+	int32_t ret = 0;
+	if (file->shouldcommit == 1) {
+		ret = _NFS_flush(r, file);
+	}
+	_NFS_free_uncommitted(file);
+	fhandle3_free(&file->handle);
+	if (file->path) _NFS_mem_free(file->path);
+
+	memset(file, 0, sizeof(NFS_FILE_STRUCT));
+
+	return ret < 0 ? -1 : 0;
+}
+
+int32_t _NFS_fsync_r (struct _reent *r, int32_t fd)
+{
+	return _NFS_fsync(r, (NFS_FILE_STRUCT *) (intptr_t) fd);
+}
+
+// Commits what was written to the file, for callers which have the file struct already
+int32_t _NFS_fsync(struct _reent *r, NFS_FILE_STRUCT *file)
+{
+	int32_t ret = 0;
+	if (file->shouldcommit == 1) {
+		ret = _NFS_flush(r, file);
+	}
+
+	return ret < 0 ? -1 : 0;
+}
+
+// Writes len bytes at position, without moving the position of the file
+ssize_t _NFS_write_at(struct _reent *r, NFS_FILE_STRUCT *file, const char *ptr, uint32_t position, size_t len)
+{
+	// Keep a copy of the data, which is needed when the server loses it before the COMMIT
+	int32_t keep = 0;
+	if (len <= file->nfsmount->commit_buffer_size) {
+		if (file->uncommittedlen + len > file->nfsmount->commit_buffer_size && _NFS_flush(r, file) < 0) {
+			return -1;
+		}
+		keep = _NFS_keep_uncommitted(file, ptr, position, len) == 0;
+	}
+	if (!keep && file->numranges > 0 && _NFS_flush(r, file) < 0) {
+		return -1;
+	}
+	file->shouldcommit = 1;
+
+	int32_t attempts = 0;
+	int32_t ret = _NFS_write_data(r, file, ptr, position, len);
+	while (ret == NFS_VERIFIER_CHANGED || (ret >= 0 && !keep)) {
+		if (ret >= 0) {
+			// Too large to keep a copy, so commit it while the data is still available
+			ret = _NFS_commit(r, file);
+			if (ret == 0) {
+				file->shouldcommit = 0;
+				break;
+			}
+			if (ret != NFS_VERIFIER_CHANGED) break;
+		}
+		if (++attempts >= NFS_MAX_RESENDS) {
+			r->_errno = EIO;
+			ret = -1;
 			break;
 		}
-	} while (amount_of_data_written < len);
+		// The server lost everything since the last COMMIT, write it again
+		ret = keep ? _NFS_write_uncommitted(r, file) : _NFS_write_data(r, file, ptr, position, len);
+	}
 
-	_NFS_unlock(&file->nfsmount->lock);
+	// What was read of the file is old now, whether the write made it or not
+	nfs_rcache_invalidate(file->nfsmount, &file->handle);
 
-	return amount_of_data_written;
+	if (ret < 0) {
+		if (keep) {
+			file->numranges--;
+			file->uncommittedlen -= len;
+		}
+		return -1;
+	}
+
+	return len;
 }
 
-ssize_t _NFS_read_r (struct _reent *r, int32_t fd, char *ptr, size_t len)
+ssize_t _NFS_write_r (struct _reent *r, int32_t fd, const char *ptr, size_t len)
 {
-	// We don't cache reads, since it'll cost more memory, just don't do random reads :)
-	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) fd;
-	_NFS_lock(&file->nfsmount->lock);
+	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) (intptr_t) fd;
 
-	int32_t block_len = file->nfsmount->rtpref;
-	// Calculate the best block_len, as specified by the server
-	if (block_len > file->nfsmount->bufferlen) block_len = ((file->nfsmount->bufferlen - 1)/file->nfsmount->rtmult) * file->nfsmount->rtmult;
+	if (file == NULL || !file->write) {
+		r->_errno = EBADF;
+		return -1;
+	}
 
-	#if defined (__wii__)
-	// Fake a block_len for now
-	block_len =	8192 - 128; // This works for the wii, but 8192 bytes seems to be the max message size which is retrieved (128 is the max header for a READ reply)
-	#endif
+	ssize_t ret = _NFS_write_at(r, file, ptr, file->currentPosition, len);
+	if (ret < 0) return -1;
 
-	int64_t amount_of_data_read = 0;
-	do
-	{
-		// Amount of data to read
-		int32_t current_block = block_len;
-		if (len - amount_of_data_read < current_block) current_block = len - amount_of_data_read;
+	file->currentPosition += ret;
 
-		int32_t headerSize = rpc_create_header(file->nfsmount, PROGRAM_NFS, 3, PROCEDURE_READ, AUTH_UNIX);
+	return ret;
+}
 
-		uint32_t offset = headerSize;
-		offset += rpc_write_fhandle(file->nfsmount, offset, &file->handle);
-		offset += rpc_write_long(file->nfsmount, offset, file->currentPosition);
-		offset += rpc_write_int(file->nfsmount, offset, current_block);
+int32_t _NFS_queue_read(NFS_FILE_STRUCT *file, NFS_IO_REQUEST *request, const char *data)
+{
+	NFS_CALL *call = request->call;
 
-		int32_t ret = udp_sendrecv(file->nfsmount, offset, file->nfsmount->nfs_port);
-		if (ret < 0) {
-			_NFS_unlock(&file->nfsmount->lock);
-			return ret;
+	// Retransmissions send this call again as it is, so a late reply to the first transmission is still accepted
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_READ, AUTH_UNIX);
+
+	uint32_t offset = headerSize;
+	offset += rpc_write_fhandle(call, offset, &file->handle);
+	offset += rpc_write_long(call, offset, request->position);
+	offset += rpc_write_int(call, offset, request->count);
+
+	// The data of the reply may be received straight into its place in the buffer of the caller
+	call->payload = (char *) data + request->bufoffset;
+	call->payloadlen = request->count;
+
+	return nfs_queue_flow(call, request->flow, offset, NULL, 0);
+}
+
+// Reads up to len bytes at position in blocks of block_len, keeping up to read_window READ requests in flight
+ssize_t _NFS_read_blocks(struct _reent *r, NFS_FILE_STRUCT *file, char *ptr, uint32_t position, size_t len, int32_t block_len)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+
+	int32_t window = nfsmount->read_window;
+	if (window < 1) window = 1;
+	if (window > NFS_MAX_WINDOW) window = NFS_MAX_WINDOW;
+	int32_t total = _NFS_total_window(nfsmount, window);
+
+	// Keep up to window READ requests in flight, replies may arrive in any order
+	NFS_IO_REQUEST requests[NFS_MAX_WINDOW];
+	int32_t inflight = 0;
+	uint32_t requested = 0;
+	uint32_t end = len; // Shrinks when the server reports EOF
+	int32_t i;
+
+	while (inflight > 0 || requested < end)
+	{
+		// Fill the window, the new requests are sent together
+		int32_t queued = inflight;
+		while (inflight < total && requested < end && !_NFS_any_replied(nfsmount, requests, inflight))
+		{
+			// Stripe the blocks over the flows which have room
+			int32_t flow = _NFS_pick_flow(nfsmount, inflight);
+			if (flow < 0) break;
+
+			NFS_IO_REQUEST *request = &requests[inflight];
+			request->call = nfs_call_get(nfsmount);
+			if (request->call == NULL) {
+				_NFS_cancel_requests(nfsmount, requests, inflight);
+				r->_errno = ENOMEM;
+				return -1;
+			}
+			request->flow = flow;
+			request->bufoffset = requested;
+			request->position = position + requested;
+			request->count = end - requested < block_len ? end - requested : block_len;
+
+			inflight++;
+			if (_NFS_queue_request(file, request, ptr, _NFS_queue_read) < 0) {
+				_NFS_cancel_requests(nfsmount, requests, inflight);
+				return -1;
+			}
+			requested += request->count;
+		}
+		if (_NFS_send_requests(requests + queued, inflight - queued) < 0) {
+			_NFS_cancel_requests(nfsmount, requests, inflight);
+			return -1;
 		}
 
+		i = _NFS_wait_reply(file, requests, inflight, NFS_RTT_READ);
+		if (i < 0) {
+			_NFS_cancel_requests(nfsmount, requests, inflight);
+			return i;
+		}
+
+		// Take the request out of the window, it goes back in when it has to be sent again
+		NFS_IO_REQUEST request = requests[i];
+		requests[i] = requests[--inflight];
+		NFS_CALL *call = request.call;
+
 		int32_t rpc_header_length = 0;
-		ret = rpc_parse_header(file->nfsmount, &rpc_header_length);
+		int32_t ret = rpc_parse_header(call, &rpc_header_length);
 		if (ret < 0) {
-			_NFS_unlock(&file->nfsmount->lock);
+			nfs_call_put(call);
+			_NFS_cancel_requests(nfsmount, requests, inflight);
 			return ret;
 		}
 
 		int32_t intVal, count;
-		offset = rpc_header_length;
-		offset += rpc_read_int(file->nfsmount, offset, &intVal);
+		uint32_t offset = rpc_header_length;
+		offset += rpc_read_int(call, offset, &intVal);
 		if (intVal != 0) {
+			nfs_call_put(call);
+			_NFS_cancel_requests(nfsmount, requests, inflight);
 			r->_errno = intVal;
 			return -1;
 		}
 
-		offset += rpc_read_int(file->nfsmount, offset, &intVal);
-		if (intVal) {
-			offset += sizeof(object_attributes); // Let's skip the attributes for now
-		}
-		offset += rpc_read_int(file->nfsmount, offset, &count);
-		offset += rpc_read_int(file->nfsmount, offset, &intVal); // EOF?
+		offset += nfs_attr_read(nfsmount, &file->handle, call, offset);
+		offset += rpc_read_int(call, offset, &count);
+		offset += rpc_read_int(call, offset, &intVal); // EOF?
+		if (count > request.count) count = request.count;
 
-		// First, copy all data
+		// Copy the data straight to its place in the buffer of the caller, unless it was received there already
 		offset += 4; // Again a count? Weird...
-		memcpy(ptr + amount_of_data_read, file->nfsmount->buffer + offset, count);
+		if (!call->placed) memcpy(ptr + request.bufoffset, call->buffer + offset, count);
+
+		if (intVal || count == 0) {
+			if (request.bufoffset + count < end) end = request.bufoffset + count;
+		} else if (count < request.count) {
+			// Short read, ask for the remainder with a new request
+			request.bufoffset += count;
+			request.position += count;
+			request.count -= count;
+			requests[inflight++] = request;
+			if (_NFS_queue_request(file, &requests[inflight - 1], ptr, _NFS_queue_read) < 0 || _NFS_send_requests(&requests[inflight - 1], 1) < 0) {
+				_NFS_cancel_requests(nfsmount, requests, inflight);
+				return -1;
+			}
+			continue;
+		}
 
-		amount_of_data_read += count;
-		file->currentPosition += count;
+		// This request is done, also forget about requests past the end of the file
+		nfs_call_put(call);
+		for (i = 0; i < inflight; i++) {
+			if (requests[i].bufoffset >= end) {
+				_NFS_cancel_requests(nfsmount, &requests[i], 1);
+				requests[i--] = requests[--inflight];
+			}
+		}
+	}
 
-		if (intVal) {
-			break;
+	return end;
+}
+
+static ssize_t _NFS_read_uncached(struct _reent *r, NFS_FILE_STRUCT *file, char *ptr, uint32_t position, size_t len)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+
+	int32_t block_len = nfsmount->rtpref;
+	if (nfsmount->transport->protocol == PROTO_TCP) {
+		// No fragmentation over TCP, use the largest block the server allows
+		block_len = nfsmount->rtmax;
+	}
+	if (nfsmount->rsize > 0 && nfsmount->rsize < block_len) block_len = nfsmount->rsize;
+
+	// The reply has to fit in the buffer
+	if (block_len > nfsmount->transport->bufferlen - READ_REPLY_HEADER) block_len = nfsmount->transport->bufferlen - READ_REPLY_HEADER;
+
+	block_len = _NFS_block_size(nfsmount, &nfsmount->readctl, block_len);
+
+	uint64_t start = nfs_now();
+	r->_errno = 0;
+	ssize_t ret = _NFS_read_blocks(r, file, ptr, position, len, block_len);
+	if (ret < 0 && r->_errno == NFS3ERR_STALE && _NFS_reopen(r, file) == 0) {
+		ret = _NFS_read_blocks(r, file, ptr, position, len, block_len);
+	}
+	_NFS_block_update(nfsmount, &nfsmount->readctl, nfs_now() - start);
+	return ret;
+}
+
+// Reads through the block cache, every block which isn't cached is read from the server as a whole
+static ssize_t _NFS_read_cached(struct _reent *r, NFS_FILE_STRUCT *file, char *ptr, uint32_t position, size_t len)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+	uint32_t blocksize = nfsmount->blocksize;
+
+	// Cached blocks are only used while the file has the same mtime and size
+	object_attributes attr;
+	if (nfs_attr_fetch(nfsmount, &file->handle, &attr) != 0) {
+		return _NFS_read_uncached(r, file, ptr, position, len);
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		uint32_t index = (position + done) / blocksize;
+		uint32_t offset = (position + done) % blocksize;
+		uint32_t count = len - done < blocksize - offset ? len - done : blocksize - offset;
+
+		NFS_RCACHE_BLOCK *block;
+		int32_t copied = nfs_rcache_get(nfsmount, &file->handle, &attr, index, ptr + done, offset, count, &block);
+		if (copied < 0 && block == NULL) {
+			// Every block is being read already, read the rest without them
+			ssize_t ret = _NFS_read_uncached(r, file, ptr + done, position + done, len - done);
+			if (ret < 0) return done > 0 ? (ssize_t) done : -1;
+			return done + ret;
+		}
+		if (copied < 0) {
+			// The block is ours until it's done, take what we need before others can replace it
+			ssize_t ret = _NFS_read_uncached(r, file, block->data, index * blocksize, blocksize);
+			copied = ret > (ssize_t) offset ? (ret - offset < count ? ret - offset : count) : 0;
+			memcpy(ptr + done, block->data + offset, copied);
+			nfs_rcache_done(nfsmount, block, ret);
+			if (ret < 0) return done > 0 ? (ssize_t) done : -1;
 		}
-	} while (amount_of_data_read < len);
 
-	_NFS_unlock(&file->nfsmount->lock);
+		done += copied;
+		if (copied < count) break; // The end of the file
+	}
+
+	return done;
+}
 
-	return amount_of_data_read;
+// Reads up to len bytes at position, without moving the position of the file
+ssize_t _NFS_read_at(struct _reent *r, NFS_FILE_STRUCT *file, char *ptr, uint32_t position, size_t len)
+{
+	NFSMOUNT *nfsmount = file->nfsmount;
+	if (nfsmount->numblocks > 0 && len <= NFS_RCACHE_MAXBLOCKS * nfsmount->blocksize) {
+		return _NFS_read_cached(r, file, ptr, position, len);
+	}
+	return _NFS_read_uncached(r, file, ptr, position, len);
+}
+
+ssize_t _NFS_read_r (struct _reent *r, int32_t fd, char *ptr, size_t len)
+{
+	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) (intptr_t) fd;
+
+	ssize_t ret = _NFS_read_at(r, file, ptr, file->currentPosition, len);
+	if (ret < 0) return ret;
+
+	file->currentPosition += ret;
+
+	return ret;
 }
 
 off_t _NFS_seek_r (struct _reent *r, int32_t fd, off_t pos, int32_t dir)
 {
-	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) fd;
+	NFS_FILE_STRUCT *file = (NFS_FILE_STRUCT *) (intptr_t) fd;
 	if (file->isnew && dir == SEEK_END) {
 		r->_errno = EINVAL;
 		return -1;
@@ -459,24 +1118,32 @@ off_t _NFS_seek_r (struct _reent *r, int32_t fd, off_t pos, int32_t dir)
 	return (off_t) file->currentPosition;
 }
 
-int32_t _NFS_stat_r (struct _reent *r, const char *path, struct stat *st)
+static int32_t _NFS_stat(struct _reent *r, NFSMOUNT *nfsmount, const char *path, struct stat *st)
 {
-	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(path);
-	if (nfsmount == NULL) {
-		r->_errno = ENODEV;
+	// First, find the handle
+	fhandle3 handle = {0};
+	if (_NFS_get_handle(r, nfsmount, path, NULL, &handle, 0) < 0) {
 		return -1;
 	}
 
-	_NFS_lock(&nfsmount->lock);
+	int32_t ret = _NFS_stat_from_handle(r, nfsmount, &handle, st);
+	fhandle3_free(&handle);
+	return ret;
+}
 
-	// First, find the handle
-	fhandle3 handle;
-	if (_NFS_get_handle(r, nfsmount, path, NULL, &handle, 0) < 0) {
-		_NFS_unlock(&nfsmount->lock);
+int32_t _NFS_stat_r (struct _reent *r, const char *path, struct stat *st)
+{
+	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(path);
+	if (nfsmount == NULL) {
+		r->_errno = ENODEV;
 		return -1;
 	}
 
-	return _NFS_stat_from_handle(r, nfsmount, &handle, st);
+	uint32_t generation = nfsmount->generation;
+	r->_errno = 0;
+	int32_t ret = _NFS_stat(r, nfsmount, path, st);
+	if (_NFS_remounted(r, nfsmount, generation, ret)) ret = _NFS_stat(r, nfsmount, path, st);
+	return ret;
 }
 /*
 int32_t _NFS_link_r (struct _reent *r, const char *existing, const char *newLink)
@@ -485,24 +1152,11 @@ int32_t _NFS_link_r (struct _reent *r, const char *existing, const char *newLink
 	return -1;
 }
 */
-int32_t _NFS_unlink_r (struct _reent *r, const char *name)
+static int32_t _NFS_unlink(struct _reent *r, NFSMOUNT *nfsmount, const char *name)
 {
-	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(name);
-	if (nfsmount == NULL) {
-		r->_errno = ENODEV;
-		return -1;
-	}
-	if (nfsmount->readonly) {
-		r->_errno = EROFS;
-		return -1;
-	}
-
-	_NFS_lock(&nfsmount->lock);
-
 	fhandle3 baseDir = {0};
 	char *entryToDelete = _NFS_get_dir_handle(r, nfsmount, name, &baseDir);
 	if (entryToDelete == NULL) {
-		_NFS_unlock(&nfsmount->lock);
 		return -1;
 	}
 
@@ -512,36 +1166,47 @@ int32_t _NFS_unlink_r (struct _reent *r, const char *name)
 		return -1;
 	}
 
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) {
+		r->_errno = ENOMEM;
+		return -1;
+	}
+
 	// If this is a directory, use procedure RMDIR, otherwise REMOVE
-	int32_t headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, S_ISDIR(attr.st_mode) ? PROCEDURE_RMDIR : PROCEDURE_REMOVE, AUTH_UNIX);
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, S_ISDIR(attr.st_mode) ? PROCEDURE_RMDIR : PROCEDURE_REMOVE, AUTH_UNIX);
 
 	// Write a dir entry, first write the handle
 	uint32_t offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, &baseDir);
-	offset += rpc_write_string(nfsmount, offset, entryToDelete);
+	offset += rpc_write_fhandle(call, offset, &baseDir);
+	offset += rpc_write_string(call, offset, entryToDelete);
 
-	int32_t ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
-	if (ret < 0) return ret;
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return ret;
+	}
 
 	int32_t rpc_header_length = 0;
-	ret = rpc_parse_header(nfsmount, &rpc_header_length);
+	ret = rpc_parse_header(call, &rpc_header_length);
 	if (ret < 0) {
+		nfs_call_put(call);
 		return ret;
 	}
 
-	rpc_read_int(nfsmount, rpc_header_length, &r->_errno);
+	nfs_name_remove(nfsmount, &baseDir, entryToDelete);
 
-	_NFS_unlock(&nfsmount->lock);
+	offset = rpc_header_length;
+	offset += rpc_read_int(call, offset, &r->_errno);
+	nfs_attr_wcc(nfsmount, &baseDir, call, offset);
+
+	nfs_call_put(call);
 
 	return r->_errno == 0 ? 0 : -1;
 }
 
-// This method can be optimized, by checking the directories before renaming
-// If the directories are the same, then you don't have to retrieve the handle 
-// for the new directory
-int32_t _NFS_rename_r (struct _reent *r, const char *oldName, const char *newName)
+int32_t _NFS_unlink_r (struct _reent *r, const char *name)
 {
-	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(oldName);
+	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(name);
 	if (nfsmount == NULL) {
 		r->_errno = ENODEV;
 		return -1;
@@ -551,46 +1216,89 @@ int32_t _NFS_rename_r (struct _reent *r, const char *oldName, const char *newNam
 		return -1;
 	}
 
-	_NFS_lock(&nfsmount->lock);
+	uint32_t generation = nfsmount->generation;
+	r->_errno = 0;
+	int32_t ret = _NFS_unlink(r, nfsmount, name);
+	if (_NFS_remounted(r, nfsmount, generation, ret)) ret = _NFS_unlink(r, nfsmount, name);
+	return ret;
+}
 
+// This method can be optimized, by checking the directories before renaming
+// If the directories are the same, then you don't have to retrieve the handle 
+// for the new directory
+static int32_t _NFS_rename(struct _reent *r, NFSMOUNT *nfsmount, const char *oldName, const char *newName)
+{
 	fhandle3 oldDir = {0}, newDir = {0};
 	char *oldFile = _NFS_get_dir_handle(r, nfsmount, oldName, &oldDir);
 	if (oldFile == NULL) {
-		_NFS_unlock(&nfsmount->lock);
 		return -1;
 	}
 	char *newFile = _NFS_get_dir_handle(r, nfsmount, newName, &newDir);
 	if (newFile == NULL) {
-		_NFS_unlock(&nfsmount->lock);
+		return -1;
+	}
+
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) {
+		r->_errno = ENOMEM;
 		return -1;
 	}
 
 	// Create the MKDIR message
-	int32_t headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, PROCEDURE_RENAME, AUTH_UNIX);
+	int32_t headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_RENAME, AUTH_UNIX);
 
 	// Write a dir entry, first write the handle
 	uint32_t offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, &oldDir);
-	offset += rpc_write_string(nfsmount, offset, oldFile);
-	offset += rpc_write_fhandle(nfsmount, offset, &newDir);
-	offset += rpc_write_string(nfsmount, offset, newFile);
+	offset += rpc_write_fhandle(call, offset, &oldDir);
+	offset += rpc_write_string(call, offset, oldFile);
+	offset += rpc_write_fhandle(call, offset, &newDir);
+	offset += rpc_write_string(call, offset, newFile);
 
-	int32_t ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
-	if (ret < 0) return ret;
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return ret;
+	}
 
 	int32_t rpc_header_length = 0;
-	ret = rpc_parse_header(nfsmount, &rpc_header_length);
+	ret = rpc_parse_header(call, &rpc_header_length);
 	if (ret < 0) {
+		nfs_call_put(call);
 		return ret;
 	}
 
-	rpc_read_int(nfsmount, rpc_header_length, &r->_errno);
+	nfs_name_remove(nfsmount, &oldDir, oldFile);
+	nfs_name_remove(nfsmount, &newDir, newFile);
 
-	_NFS_unlock(&nfsmount->lock);
+	offset = rpc_header_length;
+	offset += rpc_read_int(call, offset, &r->_errno);
+	offset += nfs_attr_wcc(nfsmount, &oldDir, call, offset);
+	nfs_attr_wcc(nfsmount, &newDir, call, offset);
+
+	nfs_call_put(call);
 
 	return r->_errno == 0 ? 0 : -1;
 }
 
+int32_t _NFS_rename_r (struct _reent *r, const char *oldName, const char *newName)
+{
+	NFSMOUNT *nfsmount = _NFS_get_NfsMountFromPath(oldName);
+	if (nfsmount == NULL) {
+		r->_errno = ENODEV;
+		return -1;
+	}
+	if (nfsmount->readonly) {
+		r->_errno = EROFS;
+		return -1;
+	}
+
+	uint32_t generation = nfsmount->generation;
+	r->_errno = 0;
+	int32_t ret = _NFS_rename(r, nfsmount, oldName, newName);
+	if (_NFS_remounted(r, nfsmount, generation, ret)) ret = _NFS_rename(r, nfsmount, oldName, newName);
+	return ret;
+}
+
 void _NFS_copy_stat_from_attributes(struct stat *dest, object_attributes *attr)
 {
 	memset(dest, 0, sizeof(struct stat));
@@ -604,7 +1312,7 @@ void _NFS_copy_stat_from_attributes(struct stat *dest, object_attributes *attr)
 	{
 		dest->st_size = attr->size_u != 0 ? -1 : attr->size_l;
 	} else {
-		dest->st_size = ((int64_t) attr->size_u << 32) | attr->size_u;
+		dest->st_size = ((int64_t) attr->size_u << 32) | attr->size_l;
 	}
 	dest->st_atime = attr->atime;
 	dest->st_mtime = attr->mtime;
@@ -35,6 +35,14 @@
 #define CREATE_GUARDED		1
 #define CREATE_EXCLUSIVE	2
 
+#define NFS_MAX_WINDOW	16
+
+#define NFS_VERIFIER_CHANGED	-100	// The server lost unstable data, everything since the last COMMIT has to be written again
+#define NFS_MAX_RESENDS		3
+
+// Encodes a READ or WRITE request of a window and queues it to be sent with the others
+typedef int32_t (*NFS_QUEUE_FUNC)(NFS_FILE_STRUCT *file, NFS_IO_REQUEST *request, const char *data);
+
 int32_t _NFS_open_r (struct _reent *r, void *fileStruct, const char *path, int32_t flags, int32_t mode);
 int32_t _NFS_close_r (struct _reent *r, int32_t fd);
 ssize_t _NFS_write_r (struct _reent *r,int32_t fd, const char *ptr, size_t len);
@@ -44,7 +52,19 @@ int32_t _NFS_stat_r (struct _reent *r, const char *path, struct stat *st);
 //int32_t _NFS_link_r (struct _reent *r, const char *existing, const char *newLink);
 int32_t _NFS_unlink_r (struct _reent *r, const char *name);
 int32_t _NFS_rename_r (struct _reent *r, const char *oldName, const char *newName);
+int32_t _NFS_fsync_r (struct _reent *r, int32_t fd);
+
+ssize_t _NFS_read_at(struct _reent *r, NFS_FILE_STRUCT *file, char *ptr, uint32_t position, size_t len);
+ssize_t _NFS_write_at(struct _reent *r, NFS_FILE_STRUCT *file, const char *ptr, uint32_t position, size_t len);
+int32_t _NFS_fsync(struct _reent *r, NFS_FILE_STRUCT *file);
+
+// A server which restarted or exported the directory again doesn't know the handles anymore (NFS3ERR_STALE).
+// _NFS_remounted mounts again after a call failed like that and tells whether to try it again,
+// _NFS_reopen also looks an open file up again by its path.
+int32_t _NFS_remounted(struct _reent *r, NFSMOUNT *nfsmount, uint32_t generation, int32_t ret);
+int32_t _NFS_reopen(struct _reent *r, NFS_FILE_STRUCT *file);
 
+int32_t _NFS_stat_from_handle(struct _reent *r, NFSMOUNT *nfsmount, fhandle3 *handle, struct stat *st);
 void _NFS_copy_stat_from_attributes(struct stat *dest, object_attributes *attr);
 void _NFS_copy_stat(struct stat *dest, struct stat *src);
 
@@ -0,0 +1,214 @@
+/*
+ nfs_name.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <gctypes.h>
+#include <string.h>
+#include "common.h"
+#include "rpc.h"
+#include "nfs_name.h"
+#include "lock.h"
+
+// Without memory for the entries the names just aren't cached
+void nfs_name_init(NFSMOUNT *nfsmount, uint32_t entries)
+{
+	nfsmount->numnames = 0;
+	if (entries == 0) return;
+
+	nfsmount->names = _NFS_mem_allocate(entries * sizeof(NFS_NAME_ENTRY));
+	nfsmount->namebuckets = _NFS_mem_allocate(entries * sizeof(NFS_NAME_ENTRY *));
+	if (nfsmount->names == NULL || nfsmount->namebuckets == NULL) {
+		nfs_name_free(nfsmount);
+		return;
+	}
+	nfsmount->numnames = entries;
+	nfs_name_purge(nfsmount);
+}
+
+void nfs_name_free(NFSMOUNT *nfsmount)
+{
+	if (nfsmount->names) _NFS_mem_free(nfsmount->names);
+	if (nfsmount->namebuckets) _NFS_mem_free(nfsmount->namebuckets);
+	nfsmount->names = NULL;
+	nfsmount->namebuckets = NULL;
+	nfsmount->numnames = 0;
+}
+
+// Forgets everything, all entries are unused and in the list by use in the order they're in memory
+void nfs_name_purge(NFSMOUNT *nfsmount)
+{
+	if (nfsmount->numnames == 0) return;
+
+	_NFS_lock(&nfsmount->lock);
+	memset(nfsmount->names, 0, nfsmount->numnames * sizeof(NFS_NAME_ENTRY));
+	memset(nfsmount->namebuckets, 0, nfsmount->numnames * sizeof(NFS_NAME_ENTRY *));
+	uint32_t i;
+	for (i = 0; i < nfsmount->numnames; i++) {
+		nfsmount->names[i].newer = i > 0 ? &nfsmount->names[i - 1] : NULL;
+		nfsmount->names[i].older = i + 1 < nfsmount->numnames ? &nfsmount->names[i + 1] : NULL;
+	}
+	nfsmount->namesnew = &nfsmount->names[0];
+	nfsmount->namesold = &nfsmount->names[nfsmount->numnames - 1];
+	_NFS_unlock(&nfsmount->lock);
+}
+
+static NFS_NAME_ENTRY **nfs_name_bucket(NFSMOUNT *nfsmount, const uint8_t *parent, uint32_t parentlen, const char *name)
+{
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+	for (i = 0; i < parentlen; i++) hash = (hash ^ parent[i]) * 16777619;
+	for (; *name; name++) hash = (hash ^ (uint8_t) *name) * 16777619;
+	return &nfsmount->namebuckets[hash % nfsmount->numnames];
+}
+
+// Finds the entry of the name, and the pointer to it in its bucket
+static NFS_NAME_ENTRY **nfs_name_find(NFSMOUNT *nfsmount, fhandle3 *parent, const char *name)
+{
+	NFS_NAME_ENTRY **link = nfs_name_bucket(nfsmount, parent->val, parent->len, name);
+	for (; *link; link = &(*link)->next) {
+		NFS_NAME_ENTRY *entry = *link;
+		if (entry->parentlen == parent->len && memcmp(entry->parent, parent->val, parent->len) == 0 && strcmp(entry->name, name) == 0) break;
+	}
+	return link;
+}
+
+// Finds the pointer to an entry in its bucket
+static NFS_NAME_ENTRY **nfs_name_link(NFSMOUNT *nfsmount, NFS_NAME_ENTRY *entry)
+{
+	NFS_NAME_ENTRY **link = nfs_name_bucket(nfsmount, entry->parent, entry->parentlen, entry->name);
+	while (*link != entry) link = &(*link)->next;
+	return link;
+}
+
+// Moves the entry to the newest end of the list by use
+static void nfs_name_touch(NFSMOUNT *nfsmount, NFS_NAME_ENTRY *entry)
+{
+	if (nfsmount->namesnew == entry) return;
+
+	// Take it out
+	entry->newer->older = entry->older;
+	if (entry->older) entry->older->newer = entry->newer;
+	else nfsmount->namesold = entry->newer;
+
+	// And put it in front
+	entry->newer = NULL;
+	entry->older = nfsmount->namesnew;
+	nfsmount->namesnew->newer = entry;
+	nfsmount->namesnew = entry;
+}
+
+// Takes the entry out of its bucket, and moves it to the oldest end of the list to be used again first
+static void nfs_name_drop(NFSMOUNT *nfsmount, NFS_NAME_ENTRY **link)
+{
+	NFS_NAME_ENTRY *entry = *link;
+	*link = entry->next;
+	entry->next = NULL;
+	entry->parentlen = 0;
+
+	if (nfsmount->namesold == entry) return;
+	if (entry->newer) entry->newer->older = entry->older;
+	else nfsmount->namesnew = entry->older;
+	entry->older->newer = entry->newer;
+
+	entry->older = NULL;
+	entry->newer = nfsmount->namesold;
+	nfsmount->namesold->older = entry;
+	nfsmount->namesold = entry;
+}
+
+static int32_t nfs_name_cacheable(NFSMOUNT *nfsmount, fhandle3 *parent, const char *name)
+{
+	return nfsmount->numnames > 0 && parent->len > 0 && parent->len <= NFS3_FHSIZE && strlen(name) < NFS_NAME_MAX;
+}
+
+int32_t nfs_name_get(NFSMOUNT *nfsmount, fhandle3 *parent, object_attributes *parentattr, const char *name, fhandle3 *handle)
+{
+	if (!nfs_name_cacheable(nfsmount, parent, name)) return -1;
+
+	int32_t ret = -1;
+	_NFS_lock(&nfsmount->lock);
+	NFS_NAME_ENTRY **link = nfs_name_find(nfsmount, parent, name);
+	NFS_NAME_ENTRY *entry = *link;
+	if (entry != NULL && (entry->mtime != parentattr->mtime || entry->mtime_nsec != parentattr->mtime_nsec)) {
+		// The directory changed since
+		nfs_name_drop(nfsmount, link);
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		nfsmount->namemisses++;
+	} else if (entry->handlelen == 0) {
+		nfs_name_touch(nfsmount, entry);
+		nfsmount->namehits++;
+		ret = NFS3ERR_NOENT;
+	} else if ((handle->val = _NFS_mem_allocate(entry->handlelen)) != NULL) {
+		nfs_name_touch(nfsmount, entry);
+		nfsmount->namehits++;
+		handle->len = entry->handlelen;
+		memcpy(handle->val, entry->handle, entry->handlelen);
+		ret = 0;
+	}
+	_NFS_unlock(&nfsmount->lock);
+	return ret;
+}
+
+void nfs_name_add(NFSMOUNT *nfsmount, fhandle3 *parent, object_attributes *parentattr, const char *name, fhandle3 *handle)
+{
+	if (!nfs_name_cacheable(nfsmount, parent, name)) return;
+	if (handle != NULL && (handle->len <= 0 || handle->len > NFS3_FHSIZE)) return;
+
+	_NFS_lock(&nfsmount->lock);
+	NFS_NAME_ENTRY **link = nfs_name_find(nfsmount, parent, name);
+	NFS_NAME_ENTRY *entry = *link;
+	if (entry == NULL) {
+		// Replace the least recently used one
+		entry = nfsmount->namesold;
+		if (entry->parentlen > 0) nfs_name_drop(nfsmount, nfs_name_link(nfsmount, entry));
+
+		entry->parentlen = parent->len;
+		memcpy(entry->parent, parent->val, parent->len);
+		strcpy(entry->name, name);
+		link = nfs_name_bucket(nfsmount, entry->parent, entry->parentlen, entry->name);
+		entry->next = *link;
+		*link = entry;
+	}
+	entry->handlelen = handle != NULL ? handle->len : 0;
+	if (handle != NULL) memcpy(entry->handle, handle->val, handle->len);
+	entry->mtime = parentattr->mtime;
+	entry->mtime_nsec = parentattr->mtime_nsec;
+	nfs_name_touch(nfsmount, entry);
+	_NFS_unlock(&nfsmount->lock);
+}
+
+void nfs_name_remove(NFSMOUNT *nfsmount, fhandle3 *parent, const char *name)
+{
+	if (!nfs_name_cacheable(nfsmount, parent, name)) return;
+
+	_NFS_lock(&nfsmount->lock);
+	NFS_NAME_ENTRY **link = nfs_name_find(nfsmount, parent, name);
+	if (*link != NULL) nfs_name_drop(nfsmount, link);
+	_NFS_unlock(&nfsmount->lock);
+}
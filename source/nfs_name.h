@@ -0,0 +1,50 @@
+/*
+ nfs_name.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef _NFS_NAME_H_
+#define _NFS_NAME_H_
+
+#include "common.h"
+
+/*
+The handles the names in directories were looked up to are kept per mount, and names which don't exist as well.
+An entry is used for as long as the directory keeps the mtime it had at the LOOKUP, the least recently used
+entry makes room for new ones.
+*/
+void nfs_name_init(NFSMOUNT *nfsmount, uint32_t entries);
+void nfs_name_free(NFSMOUNT *nfsmount);
+void nfs_name_purge(NFSMOUNT *nfsmount);
+
+// Returns 0 and allocates the handle when the name is known, NFS3ERR_NOENT when it's known not to exist, -1 if it has to be looked up
+int32_t nfs_name_get(NFSMOUNT *nfsmount, fhandle3 *parent, object_attributes *parentattr, const char *name, fhandle3 *handle);
+// Keeps the handle of a name, NULL for a name which doesn't exist
+void nfs_name_add(NFSMOUNT *nfsmount, fhandle3 *parent, object_attributes *parentattr, const char *name, fhandle3 *handle);
+// Forgets a name, after it was created, removed or renamed
+void nfs_name_remove(NFSMOUNT *nfsmount, fhandle3 *parent, const char *name);
+
+#endif //_NFS_NAME_H_
@@ -30,15 +30,104 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include "structs.h"
 #include "nfs_net.h"
+#include "nfs_reactor.h"
 #include "rpc.h"
+#include "lock.h"
 
 #define IOS_O_NONBLOCK 0x04
 
-int32_t udp_retries = 2;
+#define LAST_FRAGMENT 0x80000000
 
-int32_t udp_init(NFSMOUNT *nfsmount, const char *server, uint16_t clientport)
+// All transports, mounts of the same server share one
+static NFS_TRANSPORT *transports = NULL;
+
+#ifndef NET_HAS_IOVEC
+struct net_iovec {
+	void *base;
+	u32 len;
+};
+#endif
+
+#ifndef NET_HAS_MMSG
+// libogc sends and receives one message per call, these do the same for several.
+// Without vectored calls the messages have to be in one piece.
+struct net_msg {
+	struct net_iovec *iov;
+	s32 iovcnt;
+	struct sockaddr *addr;
+	socklen_t addrlen;
+	u32 len;
+};
+
+static s32 net_sendmmsg(s32 s, struct net_msg *msgs, s32 count, u32 flags)
+{
+	s32 i, ret = 0;
+	for (i = 0; i < count; i++) {
+		struct net_msg *msg = &msgs[i];
+#ifdef NET_HAS_IOVEC
+		ret = net_sendmsg(s, msg->iov, msg->iovcnt, flags, msg->addr, msg->addrlen);
+#else
+		if (msg->addr) ret = net_sendto(s, msg->iov[0].base, msg->iov[0].len, flags, msg->addr, msg->addrlen);
+		else ret = net_send(s, msg->iov[0].base, msg->iov[0].len, flags);
+#endif
+		if (ret < 0) break;
+		msg->len = ret;
+	}
+	return i > 0 ? i : ret;
+}
+
+static s32 net_recvmmsg(s32 s, struct net_msg *msgs, s32 count, u32 flags)
+{
+	s32 i, ret = 0;
+	for (i = 0; i < count; i++) {
+		struct net_msg *msg = &msgs[i];
+#ifdef NET_HAS_IOVEC
+		ret = net_recvmsg(s, msg->iov, msg->iovcnt, flags, msg->addr, &msg->addrlen);
+#else
+		ret = net_recvfrom(s, msg->iov[0].base, msg->iov[0].len, flags, msg->addr, &msg->addrlen);
+#endif
+		if (ret < 0) break;
+		msg->len = ret;
+	}
+	return i > 0 ? i : ret;
+}
+#endif
+
+#ifdef NET_HAS_IOVEC
+static int32_t nfs_expect_calls(NFS_TRANSPORT *transport, int32_t flow, NFS_CALL **calls, int32_t max);
+#endif
+static void nfs_placed(NFS_TRANSPORT *transport, NFS_CALL **calls, int32_t count);
+static NFS_CALL *nfs_place_call(NFS_TRANSPORT *transport, uint32_t *header, uint32_t *payloadlen);
+
+// Blocks until the socket is ready for the events or timeout microseconds passed.
+// Returns > 0 when ready, 0 on a timeout and < 0 when the socket can't be polled.
+static int32_t net_wait(int32_t socket, uint32_t events, uint32_t timeout)
+{
+	struct pollsd sd;
+	sd.socket = socket;
+	sd.events = events;
+	sd.revents = 0;
+
+	int32_t ret = net_poll(&sd, 1, (timeout + 999) / 1000);
+	if (ret < 0)
+	{
+		// Don't spin when polling fails, just wait a bit like before
+		usleep(timeout < 500 ? timeout : 500);
+	}
+	return ret;
+}
+
+// The socket of a flow, flow 0 uses the sockets the transport was set up with
+static int32_t *flow_socket(NFS_TRANSPORT *transport, int32_t flow)
+{
+	if (flow == 0) return transport->protocol == PROTO_TCP ? &transport->tcp_socket : &transport->socket;
+	return &transport->flows[flow].socket;
+}
+
+int32_t udp_init(NFS_TRANSPORT *transport, const char *server, uint16_t clientport)
 {
 	struct sockaddr_in client;
 	
@@ -49,85 +138,1500 @@ int32_t udp_init(NFSMOUNT *nfsmount, const char *server, uint16_t clientport)
 		return ret;
 	}
 
-	uint32_t  ip = net_gethostip();
-	struct in_addr addr;
-	addr.s_addr = ip;
-
-	nfsmount->socket = net_socket(AF_INET, SOCK_DGRAM, 0);
-	if (nfsmount->socket < 0)
+	transport->clientport = clientport;
+	transport->socket = net_socket(AF_INET, SOCK_DGRAM, 0);
+	if (transport->socket < 0)
 	{
 		return -2;
 	}
 
-	nfsmount->remote.sin_family = AF_INET;
-	nfsmount->remote.sin_addr.s_addr = inet_addr((char *) server);
+	transport->remote.sin_family = AF_INET;
+	transport->remote.sin_addr.s_addr = inet_addr((char *) server);
 
 	memset(&client, 0, sizeof(struct sockaddr));
 	client.sin_family = AF_INET;
 	client.sin_port = clientport;
 	client.sin_addr.s_addr = INADDR_ANY;
 
-	ret = net_bind(nfsmount->socket, (struct sockaddr*) &client, sizeof(struct sockaddr));
+	ret = net_bind(transport->socket, (struct sockaddr*) &client, sizeof(struct sockaddr));
 	if (ret < 0)
 	{
 		return -4;
 	}
 
-	int32_t flags = net_fcntl(nfsmount->socket, F_GETFL, 0);
-	net_fcntl(nfsmount->socket, F_SETFL, flags | IOS_O_NONBLOCK); 
+	int32_t flags = net_fcntl(transport->socket, F_GETFL, 0);
+	net_fcntl(transport->socket, F_SETFL, flags | IOS_O_NONBLOCK); 
 
 	return 0;
 }
 
-int32_t udp_connect(NFSMOUNT *nfsmount, uint16_t port)
+// The socket stays unconnected, the mounts of the server share it, and one of them may be talking to the
+// portmapper or the MOUNT service while the others have NFS calls in flight
+int32_t udp_send(NFS_TRANSPORT *transport, const void *buffer, uint32_t sendbuflen, uint16_t port)
+{
+	struct sockaddr_in server;
+	memcpy(&server, &transport->remote, sizeof(struct sockaddr_in));
+	server.sin_port = port;
+
+	if (net_sendto(transport->socket, buffer, sendbuflen, 0, (struct sockaddr *) &server, sizeof(struct sockaddr)) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// Sends calls which are in the table over a UDP flow, each as one datagram with its data behind it. Where the
+// network can, they all go in one call. Flow 0 sends to the NFS port, the sockets of the other flows are connected.
+static int32_t udp_send_calls(NFS_TRANSPORT *transport, int32_t flow, NFS_CALL **calls, int32_t count)
+{
+#ifdef NET_HAS_IOVEC
+	static const uint32_t padding = 0;
+#endif
+	struct net_iovec iov[NFS_MAX_WINDOW][3];
+	struct net_msg msgs[NFS_MAX_WINDOW];
+	struct sockaddr_in server;
+	int32_t i, sent = 0;
+
+	memcpy(&server, &transport->remote, sizeof(struct sockaddr_in));
+	server.sin_port = transport->nfs_port;
+
+	for (i = 0; i < count; i++) {
+		NFS_CALL *call = calls[i];
+		uint32_t datalen = call->datalen;
+		msgs[i].iov = iov[i];
+		msgs[i].addr = flow == 0 ? (struct sockaddr *) &server : NULL;
+		msgs[i].addrlen = flow == 0 ? sizeof(struct sockaddr) : 0;
+		iov[i][0].base = call->buffer;
+		iov[i][0].len = call->sendlen;
+#ifdef NET_HAS_IOVEC
+		// The data goes straight from the buffer of the caller
+		iov[i][1].base = (void *) call->data;
+		iov[i][1].len = datalen;
+		iov[i][2].base = (void *) &padding;
+		iov[i][2].len = (4 - (datalen & 3)) & 3;
+		msgs[i].iovcnt = 3;
+#else
+		// Without vectored sends the data is copied behind the call
+		if (datalen > 0) {
+			if (call->sendlen + datalen + 3 > call->bufferlen) return -1;
+			memcpy(call->buffer + call->sendlen, call->data, datalen);
+			while (datalen & 3) ((char *) call->buffer)[call->sendlen + datalen++] = 0;
+		}
+		iov[i][0].len += datalen;
+		msgs[i].iovcnt = 1;
+#endif
+	}
+
+	_NFS_lock(&transport->sendlock);
+	transport->calls += count;
+	int32_t socket = flow == 0 ? transport->socket : transport->flows[flow].socket;
+	while (sent < count) {
+		int32_t ret = net_sendmmsg(socket, msgs + sent, count - sent, 0);
+		if (ret <= 0) break;
+		sent += ret;
+	}
+	_NFS_unlock(&transport->sendlock);
+	return sent < count ? -1 : 0;
+}
+
+// The buffers the other datagrams of a batch are received in, they're allocated when first needed.
+// Returns how many datagrams can be received at once. The buffers of TCP transports are too large for this,
+// there only the portmapper and mount replies arrive as datagrams.
+static int32_t udp_batch_size(NFS_TRANSPORT *transport)
+{
+	if (transport->protocol == PROTO_TCP) return 1;
+	int32_t i;
+	for (i = 1; i < NFS_RECV_BATCH; i++) {
+		if (transport->batch[i].buffer == NULL && nfs_allocate_buffer(&transport->batch[i].buffer, transport->bufferlen) != 0) return i;
+	}
+	return NFS_RECV_BATCH;
+}
+
+// Receives the datagrams which arrived on a flow, as many as fit in a batch, the first one in the receive buffer.
+// With place set the data of READ replies goes straight to the buffers of the readers. A datagram can't be
+// received in pieces, so its data has to go where the READ expected next on the flow wants it before its
+// header is seen. A datagram which turns out to be something else is put back together in its buffer.
+// Returns the amount of datagrams received.
+static int32_t udp_recv_batch(NFS_TRANSPORT *transport, int32_t flow, int32_t place)
+{
+	struct net_iovec iov[NFS_RECV_BATCH][3];
+	struct net_msg msgs[NFS_RECV_BATCH];
+	struct sockaddr_in from[NFS_RECV_BATCH];
+	NFS_CALL *expected[NFS_RECV_BATCH];
+	uint32_t headerlen = READ_REPLY_HEADER;
+	int32_t count = udp_batch_size(transport);
+	int32_t numexpected = 0, i;
+
+#ifdef NET_HAS_IOVEC
+	if (place && headerlen < transport->bufferlen) numexpected = nfs_expect_calls(transport, flow, expected, count);
+#endif
+	for (i = 0; i < count; i++) {
+		char *buffer = i == 0 ? transport->rxbuffer : transport->batch[i].buffer;
+		msgs[i].iov = iov[i];
+		msgs[i].addr = (struct sockaddr *) &from[i];
+		msgs[i].addrlen = sizeof(struct sockaddr);
+		iov[i][0].base = buffer;
+		iov[i][0].len = transport->bufferlen;
+		msgs[i].iovcnt = 1;
+		if (i < numexpected) {
+			uint32_t len = transport->bufferlen - headerlen;
+			if (expected[i]->payloadlen < len) len = expected[i]->payloadlen;
+			iov[i][0].len = headerlen;
+			iov[i][1].base = expected[i]->payload;
+			iov[i][1].len = len;
+			iov[i][2].base = buffer + headerlen;
+			iov[i][2].len = transport->bufferlen - headerlen - len;
+			msgs[i].iovcnt = 3;
+		}
+	}
+
+	int32_t socket = flow == 0 ? transport->socket : transport->flows[flow].socket;
+	int32_t ret = net_recvmmsg(socket, msgs, count, 0);
+	for (i = 0; i < ret; i++) {
+		NFS_DATAGRAM *d = &transport->batch[i];
+		char *buffer = iov[i][0].base;
+		d->length = msgs[i].len;
+		d->placed = NULL;
+		if (i < numexpected && (uint32_t) d->length > headerlen) {
+			uint32_t len = iov[i][1].len;
+			uint32_t payloadlen = d->length - headerlen < len ? d->length - headerlen : len;
+			uint32_t rest = d->length - headerlen - payloadlen;
+			int32_t datalen = rpc_read_reply_datalen((uint32_t *) buffer);
+			if (*(uint32_t *) buffer == expected[i]->xid && datalen >= 0 && (uint32_t) datalen <= payloadlen) {
+				d->placed = expected[i];
+				d->length = headerlen + rest;
+			} else {
+				memmove(buffer + headerlen + payloadlen, buffer + headerlen, rest);
+				memcpy(buffer + headerlen, expected[i]->payload, payloadlen);
+			}
+		}
+
+		// The socket of flow 0 isn't connected, so anyone can send to it, only the server's messages count
+		if (flow == 0 && from[i].sin_addr.s_addr != transport->remote.sin_addr.s_addr) d->length = -1;
+	}
+	if (numexpected > 0) nfs_placed(transport, expected, numexpected);
+
+	if (ret < 0) return 0;
+	transport->batchpos = 0;
+	transport->batchcount = ret;
+	return ret;
+}
+
+// Hands out the next datagram of the batch in the receive buffer, returns -2 when there is none
+static int32_t udp_take(NFS_TRANSPORT *transport)
 {
-	nfsmount->remote.sin_port = port;
-	int32_t ret = net_connect(nfsmount->socket, (struct sockaddr*) &nfsmount->remote, sizeof(struct sockaddr));
+	while (transport->batchpos < transport->batchcount) {
+		int32_t i = transport->batchpos++;
+		NFS_DATAGRAM *d = &transport->batch[i];
+		if (d->length < 0) continue;
+		if (i > 0) {
+			void *buffer = transport->rxbuffer;
+			transport->rxbuffer = d->buffer;
+			d->buffer = buffer;
+		}
+		transport->rxplaced = d->placed;
+		return d->length;
+	}
+	return -2;
+}
+
+#ifdef NET_HAS_RING
+#define NFS_RING_BUFFERS 64 // Datagrams the ring holds before the others have to wait in the sockets
+
+// Makes the completion ring of a UDP transport when its mounts asked for it, the sockets are polled without it
+static void udp_ring_init(NFS_TRANSPORT *transport)
+{
+	if (!transport->usering || transport->protocol == PROTO_TCP || transport->socket < 0) return;
+	transport->ring = net_ring_create(transport->bufferlen, NFS_RING_BUFFERS);
+	if (transport->ring >= 0 && net_ring_recv(transport->ring, transport->socket) < 0) {
+		net_ring_close(transport->ring);
+		transport->ring = -1;
+	}
+}
+
+// Takes the datagrams which arrived on any flow out of the ring, waiting up to timeout microseconds for the first.
+// They're copied out of the buffers of the ring, with place set the data of READ replies straight into the payload
+// of their call. Returns the amount of datagrams received.
+static int32_t udp_ring_batch(NFS_TRANSPORT *transport, uint32_t timeout, int32_t place)
+{
+	struct net_ring_msg msgs[NFS_RECV_BATCH];
+	NFS_CALL *placed[NFS_RECV_BATCH];
+	int32_t numplaced = 0, i;
+
+	int32_t ret = net_ring_wait(transport->ring, msgs, udp_batch_size(transport), timeout);
+	if (ret <= 0) return 0;
+	for (i = 0; i < ret; i++) {
+		NFS_DATAGRAM *d = &transport->batch[i];
+		char *buffer = i == 0 ? transport->rxbuffer : d->buffer;
+		char *data = msgs[i].data;
+		uint32_t len = msgs[i].len;
+		d->length = len;
+		d->placed = NULL;
+
+		// The socket of flow 0 isn't connected, so anyone can send to it, only the server's messages count
+		if (msgs[i].socket == transport->socket && msgs[i].from.sin_addr.s_addr != transport->remote.sin_addr.s_addr) {
+			d->length = -1;
+			continue;
+		}
+
+		uint32_t payloadlen = len > READ_REPLY_HEADER ? len - READ_REPLY_HEADER : 0;
+		NFS_CALL *call = place && payloadlen > 0 ? nfs_place_call(transport, (uint32_t *) data, &payloadlen) : NULL;
+		if (call) {
+			memcpy(buffer, data, READ_REPLY_HEADER);
+			memcpy(call->payload, data + READ_REPLY_HEADER, payloadlen);
+			memcpy(buffer + READ_REPLY_HEADER, data + READ_REPLY_HEADER + payloadlen, len - READ_REPLY_HEADER - payloadlen);
+			d->length = len - payloadlen;
+			d->placed = placed[numplaced++] = call;
+		} else {
+			memcpy(buffer, data, len);
+		}
+	}
+	net_ring_release(transport->ring, msgs, ret);
+	if (numplaced > 0) nfs_placed(transport, placed, numplaced);
+
+	transport->batchpos = 0;
+	transport->batchcount = ret;
 	return ret;
 }
 
-int32_t udp_sendrecv(NFSMOUNT *nfsmount, uint32_t sendbuflen, uint16_t port)
+// Receives a datagram from any flow through the ring, which waits for it itself
+static int32_t udp_ring_recv(NFS_TRANSPORT *transport, uint32_t timeout, int32_t place)
 {
-	int32_t ret = -1;
-	if (nfsmount->remote.sin_port != port) {
-		// Connect to this server
-		if (udp_connect(nfsmount, port) != 0) {
-			return -1;
+	uint64_t deadline = nfs_now() + timeout;
+	while (1)
+	{
+		uint64_t now = nfs_now();
+		if (udp_ring_batch(transport, now < deadline ? deadline - now : 0, place) > 0) {
+			int32_t ret = udp_take(transport);
+			if (ret >= 0) return ret;
+			continue;
 		}
+		if (nfs_now() >= deadline) return -2;
 	}
+}
+#endif
+
+// Receives a datagram in the receive buffer, waiting up to timeout microseconds for it. The ones which arrived
+// with it are received in the same go and handed out first by the next receives, from any flow.
+// With a completion ring the flow doesn't matter, the datagrams of all flows arrive there.
+int32_t udp_recv(NFS_TRANSPORT *transport, int32_t flow, uint32_t timeout, int32_t place)
+{
+	int32_t ret = udp_take(transport);
+	if (ret >= 0) return ret;
+#ifdef NET_HAS_RING
+	if (transport->ring >= 0) return udp_ring_recv(transport, timeout, place);
+#endif
 
-	struct sockaddr from;
-	memset(&from, 0, sizeof(struct sockaddr));
+	// Wait up to timeout microseconds for any message, the caller has to check the xid
+	uint64_t deadline = nfs_now() + timeout;
+	while (1)
+	{
+		if (udp_recv_batch(transport, flow, place) > 0) {
+			ret = udp_take(transport);
+			if (ret >= 0) return ret;
+			continue;
+		}
+
+		uint64_t now = nfs_now();
+		if (now >= deadline) break;
+		net_wait(flow == 0 ? transport->socket : transport->flows[flow].socket, POLLIN, deadline - now);
+	}
 
-	uint32_t length = sizeof(struct sockaddr);
+	// No message
+	return -2;
+}
 
-	int32_t retr = 0;
-	while (retr < udp_retries)
+void udp_close(NFS_TRANSPORT *transport)
+{
+	if (transport->socket >= 0) net_close(transport->socket);
+	transport->socket = -1;
+}
+
+int32_t tcp_connect(NFS_TRANSPORT *transport, int32_t flow)
+{
+	struct sockaddr_in client, server;
+	int32_t *socket = flow_socket(transport, flow);
+
+	memcpy(&server, &transport->remote, sizeof(struct sockaddr_in));
+	server.sin_port = transport->nfs_port;
+
+	// Try the (privileged) client port of the flow first, servers may require it.
+	// That port can still be in use by an old connection, so fall back to any port.
+	int32_t attempt;
+	for (attempt = 0; attempt < 2; attempt++)
 	{
-		// We should resend after 500 ms
-		ret = net_sendto(nfsmount->socket, nfsmount->buffer, sendbuflen, 0, (struct sockaddr *) &nfsmount->remote, sizeof(struct sockaddr));
-		if (ret < 0)
+		*socket = net_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+		if (*socket < 0)
 		{
-			return -1;
+			return -2;
 		}
 
-		int32_t rec = 0;
-		while (rec < 1000)
+		if (attempt == 0)
 		{
-			ret = net_recvfrom(nfsmount->socket, nfsmount->buffer, nfsmount->bufferlen, 0, (struct sockaddr *) &from, &length);
-			if (ret >= 0)
-			{
-				// Is this the expected message?
-				if (rpc_is_expected_message(nfsmount)) return ret;
+			memset(&client, 0, sizeof(struct sockaddr));
+			client.sin_family = AF_INET;
+			client.sin_port = transport->clientport + flow;
+			client.sin_addr.s_addr = INADDR_ANY;
+			net_bind(*socket, (struct sockaddr*) &client, sizeof(struct sockaddr));
+		}
+
+		if (net_connect(*socket, (struct sockaddr*) &server, sizeof(struct sockaddr)) >= 0)
+		{
+			// Calls are written in one go, don't let Nagle hold back the next call of a window
+			int32_t nodelay = 1;
+			net_setsockopt(*socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+			int32_t flags = net_fcntl(*socket, F_GETFL, 0);
+			net_fcntl(*socket, F_SETFL, flags | IOS_O_NONBLOCK);
+
+			// Whatever was read ahead belonged to the old connection
+			transport->flows[flow].stashpos = 0;
+			transport->flows[flow].stashlen = 0;
+			return 0;
+		}
+		tcp_close(transport, flow);
+	}
 
-				// Xid is invalid, drop this message
+	return -3;
+}
+
+void tcp_close(NFS_TRANSPORT *transport, int32_t flow)
+{
+	int32_t *socket = flow_socket(transport, flow);
+	if (*socket >= 0) net_close(*socket);
+	*socket = -1;
+}
+int32_t tcp_write(int32_t socket, const void *buf, uint32_t len)
+{
+	uint32_t sent = 0;
+	uint64_t deadline = nfs_now() + TCP_PATIENCE;
+	while (sent < len)
+	{
+		int32_t ret = net_send(socket, buf + sent, len - sent, 0);
+		if (ret > 0)
+		{
+			sent += ret;
+			deadline = nfs_now() + TCP_PATIENCE;
+			continue;
+		}
+		if (ret != -EAGAIN) return -1;
+
+		// Wait for room in the send buffer
+		uint64_t now = nfs_now();
+		if (now >= deadline) return -1;
+		net_wait(socket, POLLOUT, deadline - now);
+	}
+	return sent;
+}
+
+// Reads at least min and at most max bytes, gives up when no data arrived for timeout microseconds
+static int32_t tcp_read_some(int32_t socket, void *buf, uint32_t min, uint32_t max, uint32_t timeout)
+{
+	uint32_t received = 0;
+	uint64_t deadline = nfs_now() + timeout;
+	while (received < min)
+	{
+		int32_t ret = net_recv(socket, buf + received, max - received, 0);
+		if (ret > 0)
+		{
+			received += ret;
+			deadline = nfs_now() + timeout;
+			continue;
+		}
+		if (ret != -EAGAIN) return -1; // Connection closed or broken
+
+		uint64_t now = nfs_now();
+		if (now >= deadline) return received == 0 ? -2 : -1;
+		net_wait(socket, POLLIN, deadline - now);
+	}
+	return received;
+}
+
+// Reads exactly len bytes, gives up when no data arrived for timeout microseconds
+int32_t tcp_read(int32_t socket, void *buf, uint32_t len, uint32_t timeout)
+{
+	return tcp_read_some(socket, buf, len, len, timeout);
+}
+
+// Reads exactly len bytes of the stream of a flow, starting with the bytes which were read ahead
+static int32_t tcp_take(NFS_FLOW *f, int32_t socket, void *buf, uint32_t len, uint32_t timeout)
+{
+	uint32_t stashed = f->stashlen - f->stashpos;
+	if (stashed > len) stashed = len;
+	memcpy(buf, f->stash + f->stashpos, stashed);
+	f->stashpos += stashed;
+	if (stashed == len) return len;
+
+	int32_t ret = tcp_read(socket, buf + stashed, len - stashed, timeout);
+	if (ret < 0) return stashed > 0 ? -1 : ret;
+	return len;
+}
+
+// Sends the call in the buffer, followed by datalen bytes of data from somewhere else (padded to 4 bytes)
+int32_t tcp_send(NFS_TRANSPORT *transport, int32_t flow, void *buffer, uint32_t sendbuflen, const void *data, uint32_t datalen)
+{
+	int32_t *socket = flow_socket(transport, flow);
+	static const char padding[4] = { 0, 0, 0, 0 };
+	uint32_t padlen = (4 - (datalen & 3)) & 3;
+
+	// Record marking, the whole call is sent as a single fragment in front of which room is reserved in the buffer
+	*(uint32_t *) (buffer - RECORD_MARK_SIZE) = htonl(LAST_FRAGMENT | (sendbuflen + datalen + padlen));
+
+	// Reconnect once if the server closed the connection in the meantime
+	int32_t attempt;
+	for (attempt = 0; attempt < 2; attempt++)
+	{
+		if (*socket < 0 && tcp_connect(transport, flow) != 0) return -1;
+		if (tcp_write(*socket, buffer - RECORD_MARK_SIZE, sendbuflen + RECORD_MARK_SIZE) >= 0
+			&& (datalen == 0 || tcp_write(*socket, data, datalen) >= 0)
+			&& (padlen == 0 || tcp_write(*socket, padding, padlen) >= 0)) return 0;
+		tcp_close(transport, flow);
+	}
+	return -1;
+}
+
+int32_t tcp_recv(NFS_TRANSPORT *transport, int32_t flow, uint32_t timeout, uint32_t headerlen, NFS_SCATTER_FUNC scatter, void *arg)
+{
+	int32_t socket = *flow_socket(transport, flow);
+	if (socket < 0) return -2;
+	NFS_FLOW *f = &transport->flows[flow];
+	transport->rxplaced = NULL;
+
+	uint32_t length = 0, last = 0;
+	while (!last)
+	{
+		if (f->stashpos == f->stashlen)
+		{
+			// Read ahead, so a small reply or the header of a large one takes a single receive.
+			// What belongs to the next replies is kept for them.
+			int32_t ret = tcp_read_some(socket, f->stash, 1, TCP_STASH_SIZE, length == 0 ? timeout : TCP_PATIENCE);
+			if (ret == -2 && length == 0) return -2; // Nothing arrived
+			if (ret < 0) break;
+			f->stashpos = 0;
+			f->stashlen = ret;
+		}
+
+		uint32_t marker;
+		if (tcp_take(f, socket, &marker, RECORD_MARK_SIZE, TCP_PATIENCE) < 0) break;
+
+		marker = ntohl(marker);
+		last = marker & LAST_FRAGMENT;
+		uint32_t fragment = marker & ~LAST_FRAGMENT;
+
+		if (scatter && length == 0 && fragment >= headerlen && headerlen <= transport->bufferlen)
+		{
+			// Read the header first, the caller may want the payload somewhere else
+			if (tcp_take(f, socket, transport->rxbuffer, headerlen, TCP_PATIENCE) < 0) break;
+			length = headerlen;
+			fragment -= headerlen;
+
+			uint32_t payloadlen = fragment;
+			void *payload = scatter((uint32_t *) transport->rxbuffer, &payloadlen, arg);
+			if (payload)
+			{
+				int32_t ret = tcp_take(f, socket, payload, payloadlen, TCP_PATIENCE);
+				nfs_placed(transport, &transport->rxplaced, 1);
+				if (ret < 0) break;
+				fragment -= payloadlen;
 			}
-			usleep(500);
-			rec++;
 		}
-		retr++;
+
+		// Whatever doesn't fit in the buffer is dropped
+		uint32_t fits = fragment > transport->bufferlen - length ? transport->bufferlen - length : fragment;
+		if (tcp_take(f, socket, transport->rxbuffer + length, fits, TCP_PATIENCE) < 0) break;
+		length += fits;
+		fragment -= fits;
+		while (fragment > 0)
+		{
+			char discard[64];
+			uint32_t chunk = fragment < sizeof(discard) ? fragment : sizeof(discard);
+			if (tcp_take(f, socket, discard, chunk, TCP_PATIENCE) < 0) break;
+			fragment -= chunk;
+		}
+		if (fragment > 0) break;
+		if (last) return length;
 	}
 
-	// No message
+	// The stream is out of sync, start over with a new connection, unless a sender did so already
+	_NFS_lock(&transport->sendlock);
+	if (*flow_socket(transport, flow) == socket) tcp_close(transport, flow);
+	_NFS_unlock(&transport->sendlock);
 	return -2;
 }
+
+uint64_t nfs_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int32_t nfs_rtt_class(uint32_t program, uint32_t procedure)
+{
+	if (program != PROGRAM_NFS) return NFS_RTT_OTHER;
+
+	switch (procedure)
+	{
+		case 0: // NULL
+		case PROCEDURE_GETATTR:
+		case PROCEDURE_LOOKUP:
+		case PROCEDURE_ACCESS:
+		case PROCEDURE_FSSTAT:
+		case PROCEDURE_FSINFO:
+		case PROCEDURE_PATHCONF:
+			return NFS_RTT_FAST;
+		case PROCEDURE_READ:
+		case PROCEDURE_READDIR:
+		case PROCEDURE_READDIRPLUS:
+			return NFS_RTT_READ;
+		default:
+			return NFS_RTT_WRITE; // WRITE, COMMIT and everything else that changes the server state
+	}
+}
+
+// The retransmit timeout (RTO) of a class, including the backoff after timeouts.
+// The round trip times are measured per server, the bounds are those of the mount.
+uint32_t nfs_rtt_timeout(NFSMOUNT *nfsmount, int32_t rttclass)
+{
+	NFS_RTT *rtt = &nfsmount->transport->rtt[rttclass];
+	uint32_t timeout = rtt->srtt == 0 ? nfsmount->rto_initial : (rtt->srtt >> 3) + rtt->rttvar;
+	if (timeout < nfsmount->rto_min) timeout = nfsmount->rto_min;
+
+	// TCP recovers lost segments itself, a call only has to be sent again when the connection stalls
+	if (nfsmount->transport->protocol == PROTO_TCP && rttclass != NFS_RTT_OTHER && timeout < TCP_RTO_MIN) timeout = TCP_RTO_MIN;
+	timeout <<= rtt->backoff;
+	return timeout > nfsmount->rto_max ? nfsmount->rto_max : timeout;
+}
+
+// Jacobson/Karels estimator, srtt is scaled by 8 and rttvar by 4 so that RTO = srtt/8 + rttvar.
+// Called with the lock of the transport held, like nfs_rtt_backoff.
+void nfs_rtt_update(NFSMOUNT *nfsmount, int32_t rttclass, uint32_t sample)
+{
+	NFS_RTT *rtt = &nfsmount->transport->rtt[rttclass];
+	if (sample == 0) sample = 1;
+
+	if (rtt->srtt == 0) {
+		rtt->srtt = sample << 3;
+		rtt->rttvar = sample << 1;
+	} else {
+		int32_t err = (int32_t) sample - (int32_t) (rtt->srtt >> 3);
+		rtt->srtt += err;
+		if (err < 0) err = -err;
+		rtt->rttvar += err - (int32_t) (rtt->rttvar >> 2);
+	}
+	rtt->backoff = 0;
+}
+
+// Keeps how long a caller waited for a reply, hedged calls wait for a percentile of these
+static void nfs_rtt_recent(NFS_RTT *rtt, uint32_t sample)
+{
+	rtt->recent[rtt->numrecent++ % NFS_RTT_RECENT] = sample;
+}
+
+// The percentile of the recent round trip times of a class, 0 until enough were measured. The lock has to be held.
+static uint32_t nfs_rtt_percentile(NFS_RTT *rtt, uint32_t percentile)
+{
+	uint32_t sorted[NFS_RTT_RECENT];
+	uint32_t count = rtt->numrecent < NFS_RTT_RECENT ? rtt->numrecent : NFS_RTT_RECENT;
+	if (count < NFS_HEDGE_SAMPLES) return 0;
+
+	uint32_t i, j;
+	for (i = 0; i < count; i++) {
+		uint32_t sample = rtt->recent[i];
+		for (j = i; j > 0 && sorted[j - 1] > sample; j--) sorted[j] = sorted[j - 1];
+		sorted[j] = sample;
+	}
+	i = count * percentile / 100;
+	return sorted[i < count ? i : count - 1];
+}
+
+// Measures the round trip of a call which has its reply, with the lock of the transport held. Returns whether it
+// updated the estimate: replies to calls which were sent again are ambiguous. A hedged call is measured from its
+// first send for the percentiles only, leaving out the slow calls would only lower them.
+int32_t nfs_rtt_measure(NFS_CALL *call)
+{
+	uint32_t sample = nfs_now() - call->sent;
+	if (call->sends > 1) return 0;
+
+	nfs_rtt_recent(&call->nfsmount->transport->rtt[call->rttclass], sample ? sample : 1);
+	if (call->hedged) return 0;
+
+	nfs_rtt_update(call->nfsmount, call->rttclass, sample);
+	return 1;
+}
+
+// Called when a call timed out, the next calls of this class wait longer until a reply is measured again.
+// Called with the lock of the transport held.
+uint32_t nfs_rtt_backoff(NFSMOUNT *nfsmount, int32_t rttclass, uint32_t timeout)
+{
+	NFS_RTT *rtt = &nfsmount->transport->rtt[rttclass];
+	if (rtt->backoff < RTO_MAX_BACKOFF) rtt->backoff++;
+	nfsmount->transport->retransmits++;
+
+	timeout <<= 1;
+	return timeout > nfsmount->rto_max ? nfsmount->rto_max : timeout;
+}
+
+// (Re)allocates a buffer with room for the record mark in front of it
+int32_t nfs_allocate_buffer(void **buffer, uint32_t len)
+{
+	void *mem = _NFS_mem_reallocate(*buffer ? *buffer - RECORD_MARK_SIZE : NULL, len + RECORD_MARK_SIZE);
+	if (!mem) return -1;
+	*buffer = mem + RECORD_MARK_SIZE;
+	return 0;
+}
+
+void nfs_free_buffer(void *buffer)
+{
+	if (buffer) _NFS_mem_free(buffer - RECORD_MARK_SIZE);
+}
+
+// Finds a transport to the server which was made with the same settings, and starts using it
+NFS_TRANSPORT *nfs_transport_find(const char *server, uint32_t protocol, uint16_t clientport, int32_t numflows, uint32_t bufferlen, uint16_t portmapper_port, int32_t ring)
+{
+	uint32_t addr = inet_addr((char *) server);
+	NFS_TRANSPORT *transport;
+	for (transport = transports; transport; transport = transport->next) {
+		if (transport->remote.sin_addr.s_addr == addr && transport->protocol == protocol &&
+			transport->maxflows == numflows && transport->buffersize == bufferlen &&
+			transport->portmapper_port == portmapper_port && transport->usering == ring &&
+			(clientport == 0 || transport->clientport == clientport)) {
+			transport->users++;
+			return transport;
+		}
+	}
+	return NULL;
+}
+
+// Makes a transport to the server with an unconnected UDP socket on clientport, and its completion ring if asked for
+NFS_TRANSPORT *nfs_transport_create(const char *server, uint32_t protocol, uint16_t clientport, int32_t numflows, uint32_t bufferlen, uint16_t portmapper_port, int32_t ring)
+{
+	NFS_TRANSPORT *transport = _NFS_mem_allocate(sizeof(NFS_TRANSPORT));
+	if (!transport) return NULL;
+	memset(transport, 0, sizeof(NFS_TRANSPORT));
+
+	// Allocate the buffer replies are received in, calls allocate their own buffers of the same size
+	if (nfs_allocate_buffer(&transport->rxbuffer, bufferlen) != 0) {
+		_NFS_mem_free(transport);
+		return NULL;
+	}
+	transport->bufferlen = bufferlen;
+	transport->buffersize = bufferlen;
+
+	transport->socket = -1;
+	transport->tcp_socket = -1;
+	transport->ring = -1;
+	transport->usering = ring;
+	int32_t i;
+	for (i = 0; i < NFS_MAX_FLOWS; i++) {
+		transport->flows[i].socket = -1;
+		transport->flows[i].cwnd = NFS_MAX_WINDOW;
+	}
+	transport->numflows = 1;
+	transport->maxflows = numflows;
+	transport->protocol = protocol;
+	transport->portmapper_port = portmapper_port;
+	transport->users = 1;
+
+	_NFS_lock_init(&transport->lock);
+	_NFS_lock_init(&transport->sendlock);
+	_NFS_lock_init(&transport->setuplock);
+	_NFS_cond_init(&transport->replied);
+	_NFS_cond_init(&transport->probewake);
+
+	udp_init(transport, server, clientport);
+#ifdef NET_HAS_RING
+	udp_ring_init(transport);
+#endif
+
+	transport->next = transports;
+	transports = transport;
+	nfs_reactor_add(transport);
+	return transport;
+}
+
+// All transports, for the reactor
+NFS_TRANSPORT *nfs_transports()
+{
+	return transports;
+}
+
+// Stops using a transport, the last mount of the server closes it
+void nfs_transport_put(NFS_TRANSPORT *transport)
+{
+	if (--transport->users > 0) return;
+
+	NFS_TRANSPORT **t = &transports;
+	while (*t != transport) t = &(*t)->next;
+	*t = transport->next;
+	nfs_reactor_remove(transport);
+
+#ifdef NET_HAS_RING
+	// The receives of the ring hold on to the sockets until it's closed
+	if (transport->ring >= 0) net_ring_close(transport->ring);
+#endif
+	nfs_close_flows(transport);
+	tcp_close(transport, 0);
+	udp_close(transport);
+
+	// Clear the buffers
+	nfs_free_calls(transport);
+	nfs_free_buffer(transport->rxbuffer);
+	int32_t i;
+	for (i = 0; i < NFS_RECV_BATCH; i++) nfs_free_buffer(transport->batch[i].buffer);
+
+	_NFS_cond_deinit(&transport->probewake);
+	_NFS_cond_deinit(&transport->replied);
+	_NFS_lock_deinit(&transport->setuplock);
+	_NFS_lock_deinit(&transport->sendlock);
+	_NFS_lock_deinit(&transport->lock);
+	_NFS_mem_free(transport);
+}
+
+// The table with the calls waiting for a reply, the lock has to be held
+static NFS_CALL *nfs_find_call(NFS_TRANSPORT *transport, uint32_t xid)
+{
+	NFS_CALL *call = transport->pending[xid % NFS_CALL_TABLE];
+	while (call && call->xid != xid) call = call->next;
+	return call;
+}
+
+static void nfs_link_call(NFS_CALL *call)
+{
+	NFS_CALL **bucket = &call->nfsmount->transport->pending[call->xid % NFS_CALL_TABLE];
+	call->next = *bucket;
+	*bucket = call;
+	call->pending = 1;
+}
+
+static void nfs_unlink_call(NFS_CALL *call)
+{
+	NFS_CALL **c = &call->nfsmount->transport->pending[call->xid % NFS_CALL_TABLE];
+	while (*c != call) c = &(*c)->next;
+	*c = call->next;
+	call->next = NULL;
+	call->pending = 0;
+}
+
+// Takes a thread out of the line to receive, when it is in there
+static void nfs_unlink_waiter(NFS_TRANSPORT *transport, NFS_CALL *waiter)
+{
+	NFS_CALL **w = &transport->waiters;
+	while (*w && *w != waiter) w = &(*w)->nextwaiter;
+	if (*w) *w = waiter->nextwaiter;
+	waiter->nextwaiter = NULL;
+}
+
+// Wakes the next thread in line to take over receiving, unless the reactor does it. The lock has to be held.
+static void nfs_wake_next(NFS_TRANSPORT *transport)
+{
+	if (transport->reactor || transport->waiters == NULL) return;
+	NFS_CALL *next = transport->waiters;
+	nfs_unlink_waiter(transport, next);
+	_NFS_cond_signal(&next->replied);
+}
+
+// Takes an unused call of the transport of the mount, with buffers of the current size of the receive buffer
+NFS_CALL *nfs_call_get(NFSMOUNT *nfsmount)
+{
+	NFS_TRANSPORT *transport = nfsmount->transport;
+
+	_NFS_lock(&transport->lock);
+	NFS_CALL *call = transport->unused;
+	if (call) transport->unused = call->next;
+	uint32_t len = transport->bufferlen;
+	_NFS_unlock(&transport->lock);
+
+	if (call == NULL) {
+		call = _NFS_mem_allocate(sizeof(NFS_CALL));
+		if (call == NULL) return NULL;
+		memset(call, 0, sizeof(NFS_CALL));
+		_NFS_cond_init(&call->replied);
+	}
+
+	// The buffers are traded with the receive buffer, so they have to be the same size
+	if (call->bufferlen != len) {
+		if (nfs_allocate_buffer(&call->buffer, len) != 0 || nfs_allocate_buffer(&call->rxbuffer, len) != 0) {
+			nfs_free_buffer(call->buffer);
+			nfs_free_buffer(call->rxbuffer);
+			_NFS_cond_deinit(&call->replied);
+			_NFS_mem_free(call);
+			return NULL;
+		}
+		call->bufferlen = len;
+	}
+
+	// The unused calls are shared by the mounts of the transport
+	call->nfsmount = nfsmount;
+	call->next = NULL;
+	call->waiter = NULL;
+	call->length = -1;
+	call->placed = 0;
+	return call;
+}
+
+// Gives a call back, a late reply to it will be ignored
+void nfs_call_put(NFS_CALL *call)
+{
+	if (call == NULL) return;
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	if (call->armed) nfs_reactor_disarm(call);
+
+	_NFS_lock(&transport->lock);
+	if (call->pending) nfs_unlink_call(call);
+
+	// Another thread may still be receiving the payload of a reply into the buffer of the caller
+	while (call->placing) _NFS_cond_wait(&transport->replied, &transport->lock, TCP_PATIENCE);
+
+	call->next = transport->unused;
+	transport->unused = call;
+	_NFS_unlock(&transport->lock);
+}
+
+void nfs_free_calls(NFS_TRANSPORT *transport)
+{
+	while (transport->unused) {
+		NFS_CALL *call = transport->unused;
+		transport->unused = call->next;
+		nfs_free_buffer(call->buffer);
+		nfs_free_buffer(call->rxbuffer);
+		_NFS_cond_deinit(&call->replied);
+		_NFS_mem_free(call);
+	}
+}
+
+// How long after its first send a call is sent a second time, when its reply is late. Only calls which can be
+// answered twice without harm are hedged, and only over UDP: TCP sends lost segments again itself.
+// The lock has to be held.
+static uint32_t nfs_hedge_delay(NFS_CALL *call, uint32_t program, uint32_t procedure)
+{
+	NFSMOUNT *nfsmount = call->nfsmount;
+	if (nfsmount->hedge == 0 || nfsmount->transport->protocol == PROTO_TCP || program != PROGRAM_NFS) return 0;
+	if (procedure != PROCEDURE_READ && procedure != PROCEDURE_GETATTR && procedure != PROCEDURE_LOOKUP && procedure != PROCEDURE_READDIRPLUS) return 0;
+
+	uint32_t delay = nfs_rtt_percentile(&nfsmount->transport->rtt[call->rttclass], nfsmount->hedge);
+	return delay < call->timeout ? delay : 0;
+}
+
+// Puts the call in the table before it is sent, so a fast reply is never missed, and remembers how it is sent.
+// The first send of a call picks its retransmit timeout. Returns the buffer to send, or NULL when the reply arrived already.
+static void *nfs_register_call(NFS_CALL *call, uint16_t port, int32_t flow, uint32_t sendbuflen, const void *data, uint32_t datalen)
+{
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	void *buffer = NULL;
+
+	_NFS_lock(&transport->lock);
+	if (call->length < 0) {
+		if (!call->pending) nfs_link_call(call);
+		call->port = port;
+		call->flow = flow;
+		call->sendlen = sendbuflen;
+		call->data = data;
+		call->datalen = datalen;
+		if (call->sends == 0) {
+			uint32_t *words = (uint32_t *) call->buffer;
+			call->rttclass = nfs_rtt_class(words[3], words[5]);
+			call->timeout = nfs_rtt_timeout(call->nfsmount, call->rttclass);
+			call->hedge = nfs_hedge_delay(call, words[3], words[5]);
+		}
+		buffer = call->buffer;
+	}
+	_NFS_unlock(&transport->lock);
+	return buffer;
+}
+
+// Counts a send of a call, its timeout starts now. The reactor sends it again if it receives for the transport.
+static void nfs_sent(NFS_CALL *call)
+{
+	call->sent = nfs_now();
+	call->sends++;
+	if (call->nfsmount->transport->reactor) nfs_reactor_arm(call);
+}
+
+// Hands a reply in the receive buffer to its call, by trading the receive buffer for the spare buffer of the call.
+// The lock has to be held.
+static void nfs_dispatch(NFS_TRANSPORT *transport, int32_t length)
+{
+	NFS_CALL *placed = transport->rxplaced;
+	transport->rxplaced = NULL;
+	if (length < 24) return; // Not even a reply header
+
+	// Anything from the server shows it's up
+	transport->replies++;
+	transport->down = 0;
+
+	NFS_CALL *call = nfs_find_call(transport, *(uint32_t *) transport->rxbuffer);
+	if (call == NULL) {
+		// Not expected (anymore), the other reply to a call which was sent twice was faster
+		transport->duplicates++;
+		return;
+	}
+
+	nfs_unlink_call(call);
+	void *spare = call->rxbuffer;
+	call->rxbuffer = call->buffer;
+	call->buffer = transport->rxbuffer;
+	transport->rxbuffer = spare;
+	call->placed = placed == call;
+	transport->placed += call->placed;
+	call->length = length;
+
+	// Only the thread waiting for this call is woken
+	if (call->waiter) _NFS_cond_signal(&call->waiter->replied);
+}
+
+// Marks the server down after it didn't answer the health probe. The calls waiting for it are given up on,
+// and new ones fail right away until it answers again.
+void nfs_transport_down(NFS_TRANSPORT *transport)
+{
+	_NFS_lock(&transport->lock);
+	transport->down = 1;
+	int32_t i;
+	for (i = 0; i < NFS_CALL_TABLE; i++) {
+		NFS_CALL *call;
+		for (call = transport->pending[i]; call; call = call->next) {
+			call->expired = 1;
+			if (call->waiter) _NFS_cond_signal(&call->waiter->replied);
+		}
+	}
+	_NFS_unlock(&transport->lock);
+}
+
+#ifdef NET_HAS_IOVEC
+// Before datagrams arrive on a flow, guesses the calls they answer: the oldest READs sent over the flow, in the
+// order they were sent. Their payload may be written to until nfs_placed. Returns the amount of calls found.
+static int32_t nfs_expect_calls(NFS_TRANSPORT *transport, int32_t flow, NFS_CALL **calls, int32_t max)
+{
+	int32_t count = 0, i, j;
+	_NFS_lock(&transport->lock);
+	for (i = 0; i < NFS_CALL_TABLE; i++) {
+		NFS_CALL *call;
+		for (call = transport->pending[i]; call; call = call->next) {
+			if (call->flow != flow || call->payload == NULL) continue;
+			for (j = count; j > 0 && (int32_t) (call->xid - calls[j - 1]->xid) < 0; j--) {
+				if (j < max) calls[j] = calls[j - 1];
+			}
+			if (j < max) calls[j] = call;
+			if (count < max) count++;
+		}
+	}
+	for (i = 0; i < count; i++) calls[i]->placing = 1;
+	_NFS_unlock(&transport->lock);
+	return count;
+}
+#endif
+
+// The receive which could write into the payload of the calls is done
+static void nfs_placed(NFS_TRANSPORT *transport, NFS_CALL **calls, int32_t count)
+{
+	int32_t i;
+	_NFS_lock(&transport->lock);
+	for (i = 0; i < count; i++) {
+		if (calls[i]) calls[i]->placing = 0;
+	}
+	_NFS_cond_broadcast(&transport->replied);
+	_NFS_unlock(&transport->lock);
+}
+
+// Finds the call a READ reply belongs to, when its data fits in the payload of the call and in payloadlen,
+// which is set to the length of the data. The payload can be written to until nfs_placed.
+static NFS_CALL *nfs_place_call(NFS_TRANSPORT *transport, uint32_t *header, uint32_t *payloadlen)
+{
+	int32_t count = rpc_read_reply_datalen(header);
+	if (count < 0 || (uint32_t) count > *payloadlen) return NULL;
+
+	_NFS_lock(&transport->lock);
+	NFS_CALL *call = nfs_find_call(transport, header[0]);
+	if (call && call->payload && (uint32_t) count <= call->payloadlen) {
+		call->placing = 1;
+		*payloadlen = count;
+	} else {
+		call = NULL;
+	}
+	_NFS_unlock(&transport->lock);
+	return call;
+}
+
+// Finds the call a READ reply belongs to, so its data can be received straight into the buffer of the caller.
+// The call stays in rxplaced with the reply, and can't be given back until the payload was received.
+static void *nfs_scatter_call(uint32_t *header, uint32_t *payloadlen, void *arg)
+{
+	NFS_TRANSPORT *transport = (NFS_TRANSPORT *) arg;
+	NFS_CALL *call = nfs_place_call(transport, header, payloadlen);
+	if (call == NULL) return NULL;
+	transport->rxplaced = call;
+	return call->payload;
+}
+
+int32_t nfs_send(NFS_CALL *call, uint32_t sendbuflen, uint16_t port)
+{
+	return nfs_send_gather(call, sendbuflen, NULL, 0, port);
+}
+
+int32_t nfs_send_gather(NFS_CALL *call, uint32_t sendbuflen, const void *data, uint32_t datalen, uint16_t port)
+{
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	if (port == transport->nfs_port) return nfs_send_flow(call, 0, sendbuflen, data, datalen);
+	if (transport->down && !call->probe) return -1;
+
+	void *buffer = nfs_register_call(call, port, -1, sendbuflen, data, datalen);
+	if (buffer == NULL) return 0;
+
+	_NFS_lock(&transport->sendlock);
+	transport->calls++;
+	int32_t ret = udp_send(transport, buffer, sendbuflen, port);
+	_NFS_unlock(&transport->sendlock);
+	nfs_sent(call);
+	return ret;
+}
+
+// Writes a call which is in the table to its flow the way nfs_register_call recorded, the caller counts the send
+static int32_t nfs_write_flow(NFS_CALL *call)
+{
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	if (transport->protocol != PROTO_TCP) return udp_send_calls(transport, call->flow, &call, 1);
+
+	_NFS_lock(&transport->sendlock);
+	transport->calls++;
+	int32_t ret = tcp_send(transport, call->flow, call->buffer, call->sendlen, call->data, call->datalen);
+	_NFS_unlock(&transport->sendlock);
+	return ret;
+}
+
+int32_t nfs_send_flow(NFS_CALL *call, int32_t flow, uint32_t sendbuflen, const void *data, uint32_t datalen)
+{
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	if (transport->down && !call->probe) return -1;
+
+	if (nfs_register_call(call, transport->nfs_port, flow, sendbuflen, data, datalen) == NULL) return 0;
+
+	int32_t ret = nfs_write_flow(call);
+	nfs_sent(call);
+	return ret;
+}
+
+// Puts a call in the table like nfs_send_flow, it's sent with the others of its window by nfs_send_queued
+int32_t nfs_queue_flow(NFS_CALL *call, int32_t flow, uint32_t sendbuflen, const void *data, uint32_t datalen)
+{
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	if (transport->down && !call->probe) return -1;
+
+	nfs_register_call(call, transport->nfs_port, flow, sendbuflen, data, datalen);
+	return 0;
+}
+
+// Sends up to NFS_MAX_WINDOW queued calls. Over UDP the calls of the same flow go in one go where the network can.
+// Returns -1 when any of them couldn't be sent.
+int32_t nfs_send_queued(NFS_CALL **calls, int32_t numcalls)
+{
+	if (numcalls <= 0) return 0;
+	NFS_TRANSPORT *transport = calls[0]->nfsmount->transport;
+	NFS_CALL *flowcalls[NFS_MAX_WINDOW];
+	int8_t done[NFS_MAX_WINDOW];
+	int32_t i, j, ret = 0;
+
+	memset(done, 0, sizeof(done));
+	for (i = 0; i < numcalls; i++) {
+		if (done[i]) continue;
+		if (transport->protocol == PROTO_TCP) {
+			if (nfs_write_flow(calls[i]) < 0) ret = -1;
+			continue;
+		}
+
+		int32_t count = 0;
+		for (j = i; j < numcalls; j++) {
+			if (!done[j] && calls[j]->flow == calls[i]->flow) {
+				flowcalls[count++] = calls[j];
+				done[j] = 1;
+			}
+		}
+		if (udp_send_calls(transport, calls[i]->flow, flowcalls, count) < 0) ret = -1;
+	}
+
+	for (i = 0; i < numcalls; i++) nfs_sent(calls[i]);
+	return ret;
+}
+
+// Sends a duplicate of a call whose reply is later than most, without backing off: it may just be slow.
+// The timeout of the first send keeps running, and whichever reply arrives first is taken.
+static int32_t nfs_hedge(NFS_CALL *call)
+{
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	void *buffer = nfs_register_call(call, transport->nfs_port, call->flow, call->sendlen, call->data, call->datalen);
+	if (buffer == NULL) return 0;
+
+	_NFS_lock(&transport->lock);
+	call->hedged = 1;
+	transport->hedges++;
+	_NFS_unlock(&transport->lock);
+
+	int32_t ret = nfs_write_flow(call);
+	if (transport->reactor) nfs_reactor_arm(call);
+	return ret < 0 ? -1 : 0;
+}
+
+// Sends a call again the way it was sent before, with a doubled timeout. The congestion window of its flow is halved,
+// the other flows keep theirs. Returns 0, -1 when it couldn't be sent, or -2 when it was sent as often as allowed.
+int32_t nfs_resend(NFS_CALL *call)
+{
+	NFSMOUNT *nfsmount = call->nfsmount;
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	if (call->expired || call->sends >= (call->maxsends > 0 ? call->maxsends : nfsmount->retries)) {
+		call->expired = 1;
+		return -2;
+	}
+
+	_NFS_lock(&transport->lock);
+	call->timeout = nfs_rtt_backoff(nfsmount, call->rttclass, call->timeout);
+	if (call->flow >= 0) {
+		NFS_FLOW *flow = &transport->flows[call->flow];
+		flow->cwnd = flow->cwnd > 1 ? flow->cwnd / 2 : 1;
+	}
+	_NFS_unlock(&transport->lock);
+
+	int32_t ret;
+	if (call->flow >= 0) ret = nfs_send_flow(call, call->flow, call->sendlen, call->data, call->datalen);
+	else ret = nfs_send_gather(call, call->sendlen, call->data, call->datalen, call->port);
+	return ret < 0 ? -1 : 0;
+}
+
+// Sends a call which is past its deadline again: a hedged call gets its duplicate first, after that it's retransmitted
+int32_t nfs_send_late(NFS_CALL *call)
+{
+	if (call->hedge && !call->hedged && !call->expired && nfs_now() < call->sent + call->timeout) return nfs_hedge(call);
+	return nfs_resend(call);
+}
+
+// Sends a call again when its reply is late. Returns 0, -1 when it couldn't be sent,
+// or -2 when it was sent as often as allowed.
+int32_t nfs_retransmit(NFS_CALL *call)
+{
+	if (call->expired) return -2;
+	if (call->armed || call->length >= 0 || nfs_now() < nfs_call_deadline(call)) return 0;
+	return nfs_send_late(call);
+}
+
+// When a call is sent again if no reply arrives before: a hedged call once after its hedge delay, then after its timeout
+uint64_t nfs_call_deadline(NFS_CALL *call)
+{
+	if (call->hedge && !call->hedged) return call->sent + call->hedge;
+	return call->sent + call->timeout;
+}
+
+// When the caller of a call has to look at it again, if no reply arrives before.
+// The reactor wakes the caller when it gives up on a call it sends again.
+uint64_t nfs_call_due(NFS_CALL *call)
+{
+	if (call->armed) return nfs_now() + call->nfsmount->rto_max;
+	return nfs_call_deadline(call);
+}
+
+// Wakes the thread waiting for a call
+void nfs_wake(NFS_CALL *call)
+{
+	NFS_TRANSPORT *transport = call->nfsmount->transport;
+	_NFS_lock(&transport->lock);
+	if (call->waiter) _NFS_cond_signal(&call->waiter->replied);
+	_NFS_unlock(&transport->lock);
+}
+
+// Receives any message in the receive buffer, the data of a READ reply may go straight to the caller of its call
+int32_t nfs_recv(NFS_TRANSPORT *transport, uint32_t timeout)
+{
+	return nfs_recv_flows(transport, timeout, READ_REPLY_HEADER, nfs_scatter_call, transport);
+}
+
+// Waits up to timeout microseconds until one of the calls has its reply, and returns the index of that call.
+// Whichever thread waits first receives the replies to all calls in flight on the transport, also those
+// of the other mounts of the server, the others sleep until theirs is handed to them. A reply only wakes
+// the thread it belongs to, and a thread which stops receiving wakes the next one in line to take over.
+// Returns -2 on a timeout.
+int32_t nfs_wait(NFS_TRANSPORT *transport, NFS_CALL **calls, int32_t numcalls, uint32_t timeout)
+{
+	uint64_t deadline = nfs_now() + timeout;
+	NFS_CALL *self = calls[0];
+	int32_t i, found = -2;
+
+	_NFS_lock(&transport->lock);
+	for (i = 0; i < numcalls; i++) calls[i]->waiter = self;
+
+	while (found < 0)
+	{
+		for (i = 0; i < numcalls && found < 0; i++) {
+			if (calls[i]->length >= 0 || calls[i]->expired) found = i;
+		}
+		if (found >= 0) break;
+
+		uint64_t now = nfs_now();
+		if (now >= deadline) break;
+
+		if (transport->receiving || transport->reactor) {
+			self->nextwaiter = transport->waiters;
+			transport->waiters = self;
+			_NFS_cond_wait(&self->replied, &transport->lock, deadline - now);
+			nfs_unlink_waiter(transport, self);
+			continue;
+		}
+
+		transport->receiving = 1;
+		_NFS_unlock(&transport->lock);
+		int32_t ret = nfs_recv(transport, deadline - now);
+		_NFS_lock(&transport->lock);
+
+		// The datagrams received with it are handed out right away, their threads don't wait for the next receive
+		while (ret >= 0) {
+			nfs_dispatch(transport, ret);
+			ret = udp_take(transport);
+		}
+		transport->receiving = 0;
+	}
+
+	// Someone else has to receive now
+	if (!transport->receiving) nfs_wake_next(transport);
+	for (i = 0; i < numcalls; i++) calls[i]->waiter = NULL;
+	_NFS_unlock(&transport->lock);
+
+	return found;
+}
+
+int32_t nfs_recv_flow(NFS_TRANSPORT *transport, int32_t flow, uint32_t timeout, uint32_t headerlen, NFS_SCATTER_FUNC scatter, void *arg)
+{
+	if (transport->protocol == PROTO_TCP) return tcp_recv(transport, flow, timeout, headerlen, scatter, arg);
+	return udp_recv(transport, flow, timeout, scatter != NULL);
+}
+
+// Receives from whichever flow has a message first. Over TCP the portmapper and mount calls use the UDP
+// socket, which is polled as well then, since another mount of the server may be in its handshake.
+// Sockets are only read once the poll says so, trying them first costs a receive for every reply which
+// didn't arrive yet.
+int32_t nfs_recv_flows(NFS_TRANSPORT *transport, uint32_t timeout, uint32_t headerlen, NFS_SCATTER_FUNC scatter, void *arg)
+{
+	int32_t numflows = transport->numflows;
+	int32_t udp = transport->protocol == PROTO_TCP && transport->socket >= 0;
+
+	struct pollsd sds[NFS_MAX_FLOWS + 1];
+	int32_t numsds = numflows + udp;
+	int32_t i;
+
+	// Replies received with an earlier one don't make the sockets readable anymore
+	int32_t ret = udp_take(transport);
+	if (ret >= 0) return ret;
+#ifdef NET_HAS_RING
+	// All flows arrive in the ring, there's nothing to poll
+	if (transport->ring >= 0) return udp_recv(transport, 0, timeout, scatter != NULL);
+#endif
+	for (i = 0; i < numflows; i++) {
+		NFS_FLOW *f = &transport->flows[i];
+		if (f->stashpos < f->stashlen && *flow_socket(transport, i) >= 0) {
+			ret = nfs_recv_flow(transport, i, TCP_PATIENCE, headerlen, scatter, arg);
+			if (ret >= 0) return ret;
+		}
+	}
+
+	uint64_t deadline = nfs_now() + timeout;
+	while (1)
+	{
+		for (i = 0; i < numsds; i++) {
+			sds[i].socket = i < numflows ? *flow_socket(transport, i) : transport->socket;
+			sds[i].events = POLLIN;
+			sds[i].revents = 0;
+		}
+
+		uint64_t now = nfs_now();
+		uint32_t wait = now < deadline ? deadline - now : 0;
+		int32_t ready = net_poll(sds, numsds, (wait + 999) / 1000);
+		if (ready < 0) {
+			// Can't poll, just try every flow
+			usleep(wait < 500 ? wait : 500);
+			for (i = 0; i < numsds; i++) sds[i].revents = POLLIN;
+		}
+
+		// Take turns, so a busy flow doesn't starve the others
+		for (i = 0; i < numsds; i++) {
+			int32_t flow = (transport->nextflow + i) % numsds;
+			if (sds[flow].socket < 0 || sds[flow].revents == 0) continue;
+
+			if (flow == numflows) {
+				ret = udp_recv(transport, 0, 0, 0);
+			} else {
+				// A readable TCP connection may still need a moment for the rest of the record
+				uint32_t patience = transport->protocol == PROTO_TCP && ready > 0 ? TCP_PATIENCE : 0;
+				ret = nfs_recv_flow(transport, flow, patience, headerlen, scatter, arg);
+			}
+			if (ret >= 0) {
+				transport->nextflow = (flow + 1) % numsds;
+				return ret;
+			}
+		}
+
+		if (nfs_now() >= deadline) return -2;
+	}
+}
+
+// Lets the reactor receive for a transport, once the thread receiving for it now is done.
+// Returns 1 when the reactor receives for it from now on.
+int32_t nfs_transport_claim(NFS_TRANSPORT *transport)
+{
+	int32_t claimed = 0;
+	_NFS_lock(&transport->lock);
+	transport->reactor = 1;
+	if (!transport->receiving) {
+		transport->receiving = 1;
+		claimed = 1;
+	}
+	_NFS_unlock(&transport->lock);
+	return claimed;
+}
+
+// The threads making calls receive for the transport themselves again
+void nfs_transport_release(NFS_TRANSPORT *transport, int32_t claimed)
+{
+	_NFS_lock(&transport->lock);
+	transport->reactor = 0;
+	if (claimed) {
+		transport->receiving = 0;
+		nfs_wake_next(transport);
+	}
+	_NFS_unlock(&transport->lock);
+}
+
+// Fills in the sockets of a transport for the poll of the reactor, and returns the amount.
+// Those are the flows, and the UDP socket for the portmapper and mount calls when the NFS calls use TCP.
+// A completion ring stands in for all flows, it's readable when datagrams arrived on any of them.
+int32_t nfs_poll_sockets(NFS_TRANSPORT *transport, struct pollsd *sds)
+{
+	int32_t numflows = transport->numflows;
+	int32_t numsds = numflows + (transport->protocol == PROTO_TCP);
+	int32_t i;
+#ifdef NET_HAS_RING
+	if (transport->ring >= 0) {
+		sds[0].socket = transport->ring;
+		sds[0].events = POLLIN;
+		sds[0].revents = 0;
+		return 1;
+	}
+#endif
+	for (i = 0; i < numsds; i++) {
+		sds[i].socket = i < numflows ? *flow_socket(transport, i) : transport->socket;
+		sds[i].events = POLLIN;
+		sds[i].revents = 0;
+	}
+	return numsds;
+}
+
+// Receives what the poll of the reactor found on the sockets of a transport, and what was read ahead on its
+// TCP connections, and hands the replies to their calls. Nothing else receives for the transport meanwhile.
+void nfs_receive_ready(NFS_TRANSPORT *transport, struct pollsd *sds, int32_t numsds)
+{
+	int32_t numflows = numsds - (transport->protocol == PROTO_TCP);
+	int32_t i;
+	for (i = 0; i < numsds; i++) {
+		if (sds[i].socket < 0) continue;
+		NFS_FLOW *f = i < numflows ? &transport->flows[i] : NULL;
+		int32_t ready = sds[i].revents != 0 || (f && f->stashpos < f->stashlen) || transport->batchpos < transport->batchcount;
+		while (ready)
+		{
+			int32_t ret;
+			if (f == NULL) ret = udp_recv(transport, 0, 0, 0);
+			else ret = nfs_recv_flow(transport, i, transport->protocol == PROTO_TCP ? TCP_PATIENCE : 0, READ_REPLY_HEADER, nfs_scatter_call, transport);
+			if (ret < 0) break;
+
+			_NFS_lock(&transport->lock);
+			nfs_dispatch(transport, ret);
+			_NFS_unlock(&transport->lock);
+
+			// More replies may have been received with this one
+			ready = (f && f->stashpos < f->stashlen) || transport->batchpos < transport->batchcount;
+		}
+	}
+}
+
+int32_t nfs_open_flows(NFS_TRANSPORT *transport, int32_t numflows)
+{
+	struct sockaddr_in client, server;
+
+	if (numflows > NFS_MAX_FLOWS) numflows = NFS_MAX_FLOWS;
+
+	memcpy(&server, &transport->remote, sizeof(struct sockaddr_in));
+	server.sin_port = transport->nfs_port;
+
+	transport->numflows = 1;
+	while (transport->numflows < numflows)
+	{
+		int32_t flow = transport->numflows;
+		NFS_FLOW *f = &transport->flows[flow];
+
+		if (transport->protocol == PROTO_TCP) {
+			if (tcp_connect(transport, flow) != 0) break;
+		} else {
+			f->socket = net_socket(AF_INET, SOCK_DGRAM, 0);
+			if (f->socket < 0) break;
+
+			// Every flow gets its own client port, so the server can spread them over its queues
+			memset(&client, 0, sizeof(struct sockaddr));
+			client.sin_family = AF_INET;
+			client.sin_port = transport->clientport + flow;
+			client.sin_addr.s_addr = INADDR_ANY;
+			net_bind(f->socket, (struct sockaddr*) &client, sizeof(struct sockaddr));
+
+			if (net_connect(f->socket, (struct sockaddr*) &server, sizeof(struct sockaddr)) < 0) {
+				net_close(f->socket);
+				f->socket = -1;
+				break;
+			}
+
+			int32_t flags = net_fcntl(f->socket, F_GETFL, 0);
+			net_fcntl(f->socket, F_SETFL, flags | IOS_O_NONBLOCK);
+#ifdef NET_HAS_RING
+			if (transport->ring >= 0 && net_ring_recv(transport->ring, f->socket) < 0) {
+				net_close(f->socket);
+				f->socket = -1;
+				break;
+			}
+#endif
+		}
+		transport->numflows++;
+	}
+
+	// Less flows are fine, the transfers are just spread over the ones which could be opened
+	return transport->numflows;
+}
+
+void nfs_close_flows(NFS_TRANSPORT *transport)
+{
+	int32_t flow;
+	for (flow = 1; flow < transport->numflows; flow++) {
+		NFS_FLOW *f = &transport->flows[flow];
+		if (f->socket >= 0) net_close(f->socket);
+		f->socket = -1;
+	}
+	transport->numflows = 1;
+}
+
+int32_t nfs_sendrecv(NFS_CALL *call, uint32_t sendbuflen, uint16_t port)
+{
+	NFSMOUNT *nfsmount = call->nfsmount;
+	NFS_TRANSPORT *transport = nfsmount->transport;
+
+	if (nfs_send(call, sendbuflen, port) < 0)
+	{
+		return -1;
+	}
+
+	while (1)
+	{
+		// Resend with a doubled timeout when the reply is late
+		int32_t ret = nfs_retransmit(call);
+		if (ret < 0) return ret;
+
+		// The reply may have been handed over since the last wait, so it's looked for even when the call is due
+		uint64_t now = nfs_now(), due = nfs_call_due(call);
+		if (nfs_wait(transport, &call, 1, due > now ? due - now : 0) >= 0 && call->length >= 0)
+		{
+			_NFS_lock(&transport->lock);
+			nfs_rtt_measure(call);
+			_NFS_unlock(&transport->lock);
+			return call->length;
+		}
+	}
+}
@@ -30,7 +30,100 @@
 
 #include "rpc_mount.h"
 
-int32_t udp_init(NFSMOUNT *nfsmount, const char *server, uint16_t clientport);
-int32_t udp_sendrecv(NFSMOUNT *nfsmount, uint32_t sendbuflen, uint16_t port);
+#define PROTO_TCP 6
+#define PROTO_UDP 17
+
+// Room reserved in front of the buffer for the TCP record mark
+#define RECORD_MARK_SIZE 4
+
+// The largest UDP payload IPv4 can carry
+#define UDP_MAX_DATAGRAM 65507
+
+// How long to wait for the rest of a TCP record, in microseconds
+#define TCP_PATIENCE 500000
+
+// Default retransmit timeout bounds, in microseconds
+#define RTO_INITIAL 500000	// Used until the first reply of a class is measured
+#define RTO_MIN 20000
+#define RTO_MAX 2000000
+#define RTO_MAX_BACKOFF 6
+#define TCP_RTO_MIN 1000000
+
+// The amount of round trip times of a class measured before calls of it are hedged
+#define NFS_HEDGE_SAMPLES 8
+
+// The amount of times a health probe is sent before the server is marked down
+#define NFS_PROBE_SENDS 2
+
+// Called with the first headerlen bytes of a message, and the amount of bytes after it in *payloadlen.
+// Returns where the payload of *payloadlen bytes which follows the header has to be received,
+// or NULL to receive the whole message in the buffer. Datagrams don't use it, they can't be received in pieces.
+typedef void *(*NFS_SCATTER_FUNC)(uint32_t *header, uint32_t *payloadlen, void *arg);
+
+int32_t udp_init(NFS_TRANSPORT *transport, const char *server, uint16_t clientport);
+int32_t udp_send(NFS_TRANSPORT *transport, const void *buffer, uint32_t sendbuflen, uint16_t port);
+int32_t udp_recv(NFS_TRANSPORT *transport, int32_t flow, uint32_t timeout, int32_t place);
+void udp_close(NFS_TRANSPORT *transport);
+
+int32_t tcp_connect(NFS_TRANSPORT *transport, int32_t flow);
+int32_t tcp_send(NFS_TRANSPORT *transport, int32_t flow, void *buffer, uint32_t sendbuflen, const void *data, uint32_t datalen);
+int32_t tcp_recv(NFS_TRANSPORT *transport, int32_t flow, uint32_t timeout, uint32_t headerlen, NFS_SCATTER_FUNC scatter, void *arg);
+void tcp_close(NFS_TRANSPORT *transport, int32_t flow);
+
+// Adaptive retransmit timeouts, per class of procedures
+uint64_t nfs_now();
+int32_t nfs_rtt_class(uint32_t program, uint32_t procedure);
+uint32_t nfs_rtt_timeout(NFSMOUNT *nfsmount, int32_t rttclass);
+void nfs_rtt_update(NFSMOUNT *nfsmount, int32_t rttclass, uint32_t sample);
+uint32_t nfs_rtt_backoff(NFSMOUNT *nfsmount, int32_t rttclass, uint32_t timeout);
+int32_t nfs_rtt_measure(NFS_CALL *call);
+
+// Buffers with room for the record mark in front of them
+int32_t nfs_allocate_buffer(void **buffer, uint32_t len);
+void nfs_free_buffer(void *buffer);
+
+// Mounts of the same server share a transport: the sockets, the xid space, the calls in flight and the portmapper results.
+// Only the first mount looks up the ports and connects, the others only do their own MNT and FSINFO.
+NFS_TRANSPORT *nfs_transport_find(const char *server, uint32_t protocol, uint16_t clientport, int32_t numflows, uint32_t bufferlen, uint16_t portmapper_port, int32_t ring);
+NFS_TRANSPORT *nfs_transport_create(const char *server, uint32_t protocol, uint16_t clientport, int32_t numflows, uint32_t bufferlen, uint16_t portmapper_port, int32_t ring);
+void nfs_transport_put(NFS_TRANSPORT *transport);
+void nfs_transport_down(NFS_TRANSPORT *transport);
+
+// Every call has its own buffers, so any number of threads can have calls in flight on a transport.
+// Replies are matched to their calls by xid, the reply ends up in call->buffer.
+NFS_CALL *nfs_call_get(NFSMOUNT *nfsmount);
+void nfs_call_put(NFS_CALL *call);
+void nfs_free_calls(NFS_TRANSPORT *transport);
+int32_t nfs_wait(NFS_TRANSPORT *transport, NFS_CALL **calls, int32_t numcalls, uint32_t timeout);
+
+// Calls remember how they were sent, and are sent again the same way when their reply is late
+int32_t nfs_retransmit(NFS_CALL *call);
+int32_t nfs_resend(NFS_CALL *call);
+int32_t nfs_send_late(NFS_CALL *call);
+uint64_t nfs_call_deadline(NFS_CALL *call);
+uint64_t nfs_call_due(NFS_CALL *call);
+void nfs_wake(NFS_CALL *call);
+
+// The reactor receives for the transports it claimed, instead of the threads making calls
+NFS_TRANSPORT *nfs_transports();
+int32_t nfs_transport_claim(NFS_TRANSPORT *transport);
+void nfs_transport_release(NFS_TRANSPORT *transport, int32_t claimed);
+int32_t nfs_poll_sockets(NFS_TRANSPORT *transport, struct pollsd *sds);
+void nfs_receive_ready(NFS_TRANSPORT *transport, struct pollsd *sds, int32_t numsds);
+
+// Send over the transport used for the port, NFS calls may use TCP, everything else UDP
+int32_t nfs_send(NFS_CALL *call, uint32_t sendbuflen, uint16_t port);
+int32_t nfs_send_gather(NFS_CALL *call, uint32_t sendbuflen, const void *data, uint32_t datalen, uint16_t port);
+int32_t nfs_recv(NFS_TRANSPORT *transport, uint32_t timeout);
+
+// NFS calls can be spread over several flows (sockets or connections), flow 0 is the one used for everything else
+int32_t nfs_open_flows(NFS_TRANSPORT *transport, int32_t numflows);
+void nfs_close_flows(NFS_TRANSPORT *transport);
+int32_t nfs_send_flow(NFS_CALL *call, int32_t flow, uint32_t sendbuflen, const void *data, uint32_t datalen);
+int32_t nfs_queue_flow(NFS_CALL *call, int32_t flow, uint32_t sendbuflen, const void *data, uint32_t datalen);
+int32_t nfs_send_queued(NFS_CALL **calls, int32_t numcalls);
+int32_t nfs_recv_flow(NFS_TRANSPORT *transport, int32_t flow, uint32_t timeout, uint32_t headerlen, NFS_SCATTER_FUNC scatter, void *arg);
+int32_t nfs_recv_flows(NFS_TRANSPORT *transport, uint32_t timeout, uint32_t headerlen, NFS_SCATTER_FUNC scatter, void *arg);
+int32_t nfs_sendrecv(NFS_CALL *call, uint32_t sendbuflen, uint16_t port);
 
 #endif //_NFS_NET_H
@@ -0,0 +1,227 @@
+/*
+ nfs_rcache.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#include <gctypes.h>
+#include <string.h>
+#include "common.h"
+#include "rpc.h"
+#include "nfs_rcache.h"
+#include "lock.h"
+
+// Without memory for the blocks reads just aren't cached
+void nfs_rcache_init(NFSMOUNT *nfsmount, uint32_t size, uint32_t blocksize)
+{
+	nfsmount->numblocks = 0;
+	uint32_t blocks = blocksize > 0 ? size / blocksize : 0;
+	if (blocks == 0) return;
+
+	nfsmount->blocks = _NFS_mem_allocate(blocks * sizeof(NFS_RCACHE_BLOCK));
+	nfsmount->blockbuckets = _NFS_mem_allocate(blocks * sizeof(NFS_RCACHE_BLOCK *));
+	nfsmount->blockdata = _NFS_mem_allocate(blocks * blocksize);
+	if (nfsmount->blocks == NULL || nfsmount->blockbuckets == NULL || nfsmount->blockdata == NULL) {
+		nfs_rcache_free(nfsmount);
+		return;
+	}
+	memset(nfsmount->blocks, 0, blocks * sizeof(NFS_RCACHE_BLOCK));
+	memset(nfsmount->blockbuckets, 0, blocks * sizeof(NFS_RCACHE_BLOCK *));
+
+	// All blocks are unused and in the list by use in the order they're in memory
+	uint32_t i;
+	for (i = 0; i < blocks; i++) {
+		nfsmount->blocks[i].data = nfsmount->blockdata + i * blocksize;
+		nfsmount->blocks[i].newer = i > 0 ? &nfsmount->blocks[i - 1] : NULL;
+		nfsmount->blocks[i].older = i + 1 < blocks ? &nfsmount->blocks[i + 1] : NULL;
+	}
+	nfsmount->blocksnew = &nfsmount->blocks[0];
+	nfsmount->blocksold = &nfsmount->blocks[blocks - 1];
+	nfsmount->blocksize = blocksize;
+	nfsmount->numblocks = blocks;
+}
+
+void nfs_rcache_free(NFSMOUNT *nfsmount)
+{
+	if (nfsmount->blocks) _NFS_mem_free(nfsmount->blocks);
+	if (nfsmount->blockbuckets) _NFS_mem_free(nfsmount->blockbuckets);
+	if (nfsmount->blockdata) _NFS_mem_free(nfsmount->blockdata);
+	nfsmount->blocks = NULL;
+	nfsmount->blockbuckets = NULL;
+	nfsmount->blockdata = NULL;
+	nfsmount->numblocks = 0;
+}
+
+static NFS_RCACHE_BLOCK **nfs_rcache_bucket(NFSMOUNT *nfsmount, const uint8_t *handle, uint32_t handlelen, uint32_t index)
+{
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+	for (i = 0; i < handlelen; i++) hash = (hash ^ handle[i]) * 16777619;
+	hash = (hash ^ index) * 16777619;
+	return &nfsmount->blockbuckets[hash % nfsmount->numblocks];
+}
+
+// Finds the block of the file, and the pointer to it in its bucket
+static NFS_RCACHE_BLOCK **nfs_rcache_find(NFSMOUNT *nfsmount, fhandle3 *handle, uint32_t index)
+{
+	NFS_RCACHE_BLOCK **link = nfs_rcache_bucket(nfsmount, handle->val, handle->len, index);
+	for (; *link; link = &(*link)->next) {
+		NFS_RCACHE_BLOCK *block = *link;
+		if (block->index == index && block->handlelen == handle->len && memcmp(block->handle, handle->val, handle->len) == 0) break;
+	}
+	return link;
+}
+
+// Finds the pointer to a block in its bucket
+static NFS_RCACHE_BLOCK **nfs_rcache_link(NFSMOUNT *nfsmount, NFS_RCACHE_BLOCK *block)
+{
+	NFS_RCACHE_BLOCK **link = nfs_rcache_bucket(nfsmount, block->handle, block->handlelen, block->index);
+	while (*link != block) link = &(*link)->next;
+	return link;
+}
+
+// Moves the block to the newest end of the list by use
+static void nfs_rcache_touch(NFSMOUNT *nfsmount, NFS_RCACHE_BLOCK *block)
+{
+	if (nfsmount->blocksnew == block) return;
+
+	// Take it out
+	block->newer->older = block->older;
+	if (block->older) block->older->newer = block->newer;
+	else nfsmount->blocksold = block->newer;
+
+	// And put it in front
+	block->newer = NULL;
+	block->older = nfsmount->blocksnew;
+	nfsmount->blocksnew->newer = block;
+	nfsmount->blocksnew = block;
+}
+
+// Takes the block out of its bucket, and moves it to the oldest end of the list to be used again first
+static void nfs_rcache_drop(NFSMOUNT *nfsmount, NFS_RCACHE_BLOCK **link)
+{
+	NFS_RCACHE_BLOCK *block = *link;
+	*link = block->next;
+	block->next = NULL;
+	block->handlelen = 0;
+
+	if (nfsmount->blocksold == block) return;
+	if (block->newer) block->newer->older = block->older;
+	else nfsmount->blocksnew = block->older;
+	block->older->newer = block->newer;
+
+	block->older = NULL;
+	block->newer = nfsmount->blocksold;
+	nfsmount->blocksold->older = block;
+	nfsmount->blocksold = block;
+}
+
+// Forgets the blocks matching the handle, or all of them. Blocks being read are dropped by their reader.
+static void nfs_rcache_forget(NFSMOUNT *nfsmount, fhandle3 *handle)
+{
+	_NFS_lock(&nfsmount->lock);
+	uint32_t i;
+	for (i = 0; i < nfsmount->numblocks; i++) {
+		NFS_RCACHE_BLOCK *block = &nfsmount->blocks[i];
+		if (block->handlelen == 0) continue;
+		if (handle != NULL && (block->handlelen != handle->len || memcmp(block->handle, handle->val, handle->len) != 0)) continue;
+		if (block->reading) block->dropped = 1;
+		else nfs_rcache_drop(nfsmount, nfs_rcache_link(nfsmount, block));
+	}
+	_NFS_unlock(&nfsmount->lock);
+}
+
+void nfs_rcache_purge(NFSMOUNT *nfsmount)
+{
+	nfs_rcache_forget(nfsmount, NULL);
+}
+
+void nfs_rcache_invalidate(NFSMOUNT *nfsmount, fhandle3 *handle)
+{
+	if (nfsmount->numblocks == 0 || handle->len <= 0 || handle->len > NFS3_FHSIZE) return;
+	nfs_rcache_forget(nfsmount, handle);
+}
+
+int32_t nfs_rcache_get(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr, uint32_t index, char *ptr, uint32_t offset, uint32_t len, NFS_RCACHE_BLOCK **read)
+{
+	*read = NULL;
+	if (nfsmount->numblocks == 0 || handle->len <= 0 || handle->len > NFS3_FHSIZE) return -1;
+
+	_NFS_lock(&nfsmount->lock);
+	NFS_RCACHE_BLOCK **link, *block;
+	while ((block = *(link = nfs_rcache_find(nfsmount, handle, index))) != NULL && block->reading) {
+		// Another reader is reading it, wait for what it gets
+		_NFS_cond_wait(&nfsmount->blockread, &nfsmount->lock, 1000000);
+	}
+	if (block != NULL && block->mtime == attr->mtime && block->mtime_nsec == attr->mtime_nsec &&
+			block->size_u == attr->size_u && block->size_l == attr->size_l) {
+		nfs_rcache_touch(nfsmount, block);
+		nfsmount->blockhits++;
+		int32_t copied = offset < block->len ? (block->len - offset < len ? block->len - offset : len) : 0;
+		memcpy(ptr, block->data + offset, copied);
+		_NFS_unlock(&nfsmount->lock);
+		return copied;
+	}
+	nfsmount->blockmisses++;
+
+	if (block == NULL) {
+		// Replace the least recently used block which isn't being read
+		for (block = nfsmount->blocksold; block != NULL && block->reading; block = block->newer);
+		if (block != NULL) {
+			if (block->handlelen > 0) nfs_rcache_drop(nfsmount, nfs_rcache_link(nfsmount, block));
+			block->handlelen = handle->len;
+			memcpy(block->handle, handle->val, handle->len);
+			block->index = index;
+			link = nfs_rcache_bucket(nfsmount, block->handle, block->handlelen, index);
+			block->next = *link;
+			*link = block;
+		}
+	}
+	if (block != NULL) {
+		// The file changed since, or the block wasn't read yet
+		block->reading = 1;
+		block->dropped = 0;
+		block->len = 0;
+		block->mtime = attr->mtime;
+		block->mtime_nsec = attr->mtime_nsec;
+		block->size_u = attr->size_u;
+		block->size_l = attr->size_l;
+		nfs_rcache_touch(nfsmount, block);
+	}
+	*read = block;
+	_NFS_unlock(&nfsmount->lock);
+	return -1;
+}
+
+void nfs_rcache_done(NFSMOUNT *nfsmount, NFS_RCACHE_BLOCK *block, int32_t len)
+{
+	_NFS_lock(&nfsmount->lock);
+	block->reading = 0;
+	if (len < 0 || block->dropped) nfs_rcache_drop(nfsmount, nfs_rcache_link(nfsmount, block));
+	else block->len = len;
+	_NFS_cond_broadcast(&nfsmount->blockread);
+	_NFS_unlock(&nfsmount->lock);
+}
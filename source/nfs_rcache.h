@@ -0,0 +1,52 @@
+/*
+ nfs_rcache.h for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#ifndef _NFS_RCACHE_H_
+#define _NFS_RCACHE_H_
+
+#include "common.h"
+
+/*
+Blocks of data read from files are kept per mount, by the handle of the file and where in the file they are.
+A block is used for as long as the file keeps the mtime and size it had when the block was read, the least
+recently used block makes room for new ones. Readers of the same block share a single READ of it.
+*/
+void nfs_rcache_init(NFSMOUNT *nfsmount, uint32_t size, uint32_t blocksize);
+void nfs_rcache_free(NFSMOUNT *nfsmount);
+void nfs_rcache_purge(NFSMOUNT *nfsmount);
+
+// Copies up to len bytes at offset in a block of the file when it's cached, and returns how many, less at the end of the file.
+// Otherwise returns -1 and a block in *read the caller reads and passes to nfs_rcache_done, or NULL when none is free.
+int32_t nfs_rcache_get(NFSMOUNT *nfsmount, fhandle3 *handle, object_attributes *attr, uint32_t index, char *ptr, uint32_t offset, uint32_t len, NFS_RCACHE_BLOCK **read);
+// Keeps the block read by the caller with len bytes of data, or drops it when len is negative
+void nfs_rcache_done(NFSMOUNT *nfsmount, NFS_RCACHE_BLOCK *block, int32_t len);
+// Forgets the blocks of a file, after it was written
+void nfs_rcache_invalidate(NFSMOUNT *nfsmount, fhandle3 *handle);
+
+#endif //_NFS_RCACHE_H_
@@ -0,0 +1,298 @@
+/*
+ nfs_reactor.c for libnfs
+
+ Copyright (c) 2012 r-win
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <network.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nfs.h"
+#include "nfs_net.h"
+#include "nfs_reactor.h"
+#include "lock.h"
+
+#define NFS_REACTOR_STACK_SIZE 32768
+#define NFS_REACTOR_PRIORITY 72 // Above the async threads, so replies are handed out before more calls are made
+#define NFS_REACTOR_TRANSPORTS 8
+#define NFS_WHEEL_SLOTS 256
+#define NFS_WHEEL_TICK 10000 // Microseconds per slot of the timer wheel, also the longest the reactor polls
+#define NFS_WHEEL_FIRE 32 // Calls sent again per pass at most, the others wait for the next pass
+
+static mutex_t reactor_lock;
+static cond_t reactor_passed; // Signalled after every pass of the reactor
+static lwp_t reactor_thread;
+static bool reactor_running = false;
+static bool reactor_stopping = false;
+static uint32_t reactor_passes = 0;
+
+// The transports the reactor receives for, and whether it claimed them already
+static NFS_TRANSPORT *reactor_transports[NFS_REACTOR_TRANSPORTS];
+static int8_t reactor_claimed[NFS_REACTOR_TRANSPORTS];
+
+// Calls by the tick their reply is due in, those due in a later round of the wheel wait in the same slot
+static NFS_CALL *reactor_wheel[NFS_WHEEL_SLOTS];
+static uint64_t reactor_tick = 0; // The next tick of the wheel to look at
+
+// Puts a call in the slot of the tick its reply is due in, the lock has to be held
+static void _NFS_reactor_link(NFS_CALL *call)
+{
+	call->timerslot = (nfs_call_deadline(call) / NFS_WHEEL_TICK) % NFS_WHEEL_SLOTS;
+	call->timernext = reactor_wheel[call->timerslot];
+	reactor_wheel[call->timerslot] = call;
+	call->armed = NFS_ARMED;
+}
+
+// Takes a call off the wheel, the lock has to be held
+static void _NFS_reactor_unlink(NFS_CALL *call)
+{
+	NFS_CALL **c = &reactor_wheel[call->timerslot];
+	while (*c && *c != call) c = &(*c)->timernext;
+	if (*c) *c = call->timernext;
+	call->timernext = NULL;
+}
+
+void nfs_reactor_arm(NFS_CALL *call)
+{
+	if (!reactor_running) return;
+
+	_NFS_lock(&reactor_lock);
+	if (call->armed == NFS_ARMED) _NFS_reactor_unlink(call);
+	_NFS_reactor_link(call);
+	_NFS_unlock(&reactor_lock);
+}
+
+// Takes a call off the wheel before it is given back, waits when the reactor is sending it right now
+void nfs_reactor_disarm(NFS_CALL *call)
+{
+	_NFS_lock(&reactor_lock);
+	while (call->armed == NFS_FIRING) _NFS_cond_wait(&reactor_passed, &reactor_lock, NFS_WHEEL_TICK);
+	if (call->armed == NFS_ARMED) _NFS_reactor_unlink(call);
+	call->armed = 0;
+	_NFS_unlock(&reactor_lock);
+}
+
+// Takes the calls of a transport off the wheel, their callers send them again themselves. The lock has to be held.
+static void _NFS_reactor_disarm_all(NFS_TRANSPORT *transport)
+{
+	int32_t slot;
+	for (slot = 0; slot < NFS_WHEEL_SLOTS; slot++) {
+		NFS_CALL **c = &reactor_wheel[slot];
+		while (*c) {
+			NFS_CALL *call = *c;
+			if (transport != NULL && call->nfsmount->transport != transport) {
+				c = &call->timernext;
+				continue;
+			}
+			*c = call->timernext;
+			call->timernext = NULL;
+			call->armed = 0;
+			nfs_wake(call);
+		}
+	}
+}
+
+void nfs_reactor_add(NFS_TRANSPORT *transport)
+{
+	if (!reactor_running) return;
+
+	_NFS_lock(&reactor_lock);
+	int32_t i;
+	for (i = 0; i < NFS_REACTOR_TRANSPORTS; i++) {
+		if (reactor_transports[i] == NULL) {
+			reactor_transports[i] = transport;
+			reactor_claimed[i] = 0;
+			break;
+		}
+	}
+	// Without room the threads making calls keep receiving for it themselves
+	_NFS_unlock(&reactor_lock);
+}
+
+// Stops receiving for a transport which is closed, and waits until the reactor is done with it
+void nfs_reactor_remove(NFS_TRANSPORT *transport)
+{
+	if (!reactor_running) return;
+
+	_NFS_lock(&reactor_lock);
+	int32_t i;
+	for (i = 0; i < NFS_REACTOR_TRANSPORTS; i++) {
+		if (reactor_transports[i] != transport) continue;
+
+		reactor_transports[i] = NULL;
+		_NFS_reactor_disarm_all(transport);
+		uint32_t passes = reactor_passes;
+		while (reactor_running && reactor_passes == passes) _NFS_cond_wait(&reactor_passed, &reactor_lock, NFS_WHEEL_TICK);
+		nfs_transport_release(transport, reactor_claimed[i]);
+	}
+	_NFS_unlock(&reactor_lock);
+}
+
+// Sends the calls which are due again, or gives up on them. The lock has to be held.
+static void _NFS_reactor_fire(uint64_t now)
+{
+	NFS_CALL *due[NFS_WHEEL_FIRE];
+	int32_t numdue = 0, i;
+	uint64_t tick = now / NFS_WHEEL_TICK;
+	if (reactor_tick == 0 || tick - reactor_tick > NFS_WHEEL_SLOTS) reactor_tick = tick - NFS_WHEEL_SLOTS;
+
+	// Take the calls which are due off the wheel, from the slots of the ticks which are over
+	while (reactor_tick < tick && numdue < NFS_WHEEL_FIRE) {
+		NFS_CALL **c = &reactor_wheel[reactor_tick % NFS_WHEEL_SLOTS];
+		while (*c && numdue < NFS_WHEEL_FIRE) {
+			NFS_CALL *call = *c;
+			if (call->length < 0 && nfs_call_deadline(call) > now) {
+				c = &call->timernext; // Due in a later round
+				continue;
+			}
+			*c = call->timernext;
+			call->timernext = NULL;
+			if (call->length >= 0) {
+				call->armed = 0; // Replied already
+				continue;
+			}
+			call->armed = NFS_FIRING;
+			due[numdue++] = call;
+		}
+		if (*c == NULL) reactor_tick++;
+	}
+	if (numdue == 0) return;
+
+	// Sending them again arms them again, and their callers can't give them back meanwhile
+	_NFS_unlock(&reactor_lock);
+	for (i = 0; i < numdue; i++) nfs_send_late(due[i]);
+	_NFS_lock(&reactor_lock);
+
+	for (i = 0; i < numdue; i++) {
+		NFS_CALL *call = due[i];
+		if (call->armed != NFS_FIRING) continue; // It's on the wheel again
+
+		// Given up on, or replied to before it was sent again
+		call->armed = 0;
+		nfs_wake(call);
+	}
+}
+
+static void *_NFS_reactor_loop(void *arg)
+{
+	struct pollsd sds[NFS_REACTOR_TRANSPORTS * (NFS_MAX_FLOWS + 1)];
+	NFS_TRANSPORT *polled[NFS_REACTOR_TRANSPORTS];
+	int32_t numsds[NFS_REACTOR_TRANSPORTS];
+	int32_t i;
+
+	_NFS_lock(&reactor_lock);
+	while (!reactor_stopping)
+	{
+		// Receive for the transports which aren't received for by a thread making calls anymore
+		int32_t numpolled = 0, total = 0;
+		for (i = 0; i < NFS_REACTOR_TRANSPORTS; i++) {
+			NFS_TRANSPORT *transport = reactor_transports[i];
+			if (transport == NULL) continue;
+			if (!reactor_claimed[i]) reactor_claimed[i] = nfs_transport_claim(transport);
+			if (!reactor_claimed[i]) continue;
+
+			polled[numpolled] = transport;
+			numsds[numpolled] = nfs_poll_sockets(transport, &sds[total]);
+			total += numsds[numpolled++];
+		}
+		_NFS_unlock(&reactor_lock);
+
+		// The transports stay open until this pass is done
+		if (total > 0) {
+			int32_t ready = net_poll(sds, total, NFS_WHEEL_TICK / 1000);
+			if (ready < 0) {
+				// Can't poll, just try every socket
+				usleep(500);
+				for (i = 0; i < total; i++) sds[i].revents = POLLIN;
+			}
+			for (i = 0, total = 0; i < numpolled; i++) {
+				nfs_receive_ready(polled[i], &sds[total], numsds[i]);
+				total += numsds[i];
+			}
+		}
+
+		_NFS_lock(&reactor_lock);
+		_NFS_reactor_fire(nfs_now());
+		reactor_passes++;
+		_NFS_cond_broadcast(&reactor_passed);
+		if (total == 0) _NFS_cond_wait(&reactor_passed, &reactor_lock, NFS_WHEEL_TICK);
+	}
+	_NFS_unlock(&reactor_lock);
+	return NULL;
+}
+
+bool nfsReactorStart(void)
+{
+	if (reactor_running) return true;
+
+	_NFS_lock_init(&reactor_lock);
+	_NFS_cond_init(&reactor_passed);
+	memset(reactor_transports, 0, sizeof(reactor_transports));
+	memset(reactor_wheel, 0, sizeof(reactor_wheel));
+	reactor_tick = 0;
+	reactor_stopping = false;
+	reactor_running = true;
+
+	NFS_TRANSPORT *transport;
+	for (transport = nfs_transports(); transport; transport = transport->next) {
+		nfs_reactor_add(transport);
+	}
+
+	if (_NFS_thread_create(&reactor_thread, _NFS_reactor_loop, NULL, NFS_REACTOR_STACK_SIZE, NFS_REACTOR_PRIORITY) != 0) {
+		reactor_running = false;
+		for (transport = nfs_transports(); transport; transport = transport->next) {
+			nfs_transport_release(transport, 0);
+		}
+		_NFS_cond_deinit(&reactor_passed);
+		_NFS_lock_deinit(&reactor_lock);
+		return false;
+	}
+	return true;
+}
+
+void nfsReactorStop(void)
+{
+	if (!reactor_running) return;
+
+	_NFS_lock(&reactor_lock);
+	reactor_stopping = true;
+	_NFS_unlock(&reactor_lock);
+	_NFS_thread_join(reactor_thread);
+
+	// The callers take over receiving, and sending their calls again
+	_NFS_lock(&reactor_lock);
+	_NFS_reactor_disarm_all(NULL);
+	int32_t i;
+	for (i = 0; i < NFS_REACTOR_TRANSPORTS; i++) {
+		if (reactor_transports[i]) nfs_transport_release(reactor_transports[i], reactor_claimed[i]);
+		reactor_transports[i] = NULL;
+	}
+	reactor_running = false;
+	_NFS_unlock(&reactor_lock);
+
+	_NFS_cond_deinit(&reactor_passed);
+	_NFS_lock_deinit(&reactor_lock);
+}
@@ -29,41 +29,84 @@
 #include "nfs_net.h"
 #include "portmap.h"
 #include "rpc.h"
+#include "lock.h"
 
-#define PROTO_UDP 17
-
-extern uint16_t _nfs_portmapper_port;
+// Looks up a port in the portmapper results of the transport, the lock has to be held
+static NFS_PORT *portmap_cached(NFS_TRANSPORT *transport, u32 program, u32 protocol)
+{
+	int32_t i;
+	for (i = 0; i < NFS_PORT_CACHE; i++) {
+		NFS_PORT *entry = &transport->ports[i];
+		if (entry->port != 0 && entry->program == program && entry->protocol == protocol) return entry;
+	}
+	return NULL;
+}
 
-uint16_t portmap_find_port(NFSMOUNT *nfsmount, uint16_t *port, u32 program)
+uint16_t portmap_find_port(NFSMOUNT *nfsmount, uint16_t *port, u32 program, u32 protocol)
 {
-	int headerSize = rpc_create_header(nfsmount, PROGRAM_PORTMAP, 2, PROCEDURE_GETPORT, AUTH_NULL);
+	NFS_TRANSPORT *transport = nfsmount->transport;
+
+	// Another mount of the server asked already
+	_NFS_lock(&transport->lock);
+	NFS_PORT *entry = portmap_cached(transport, program, protocol);
+	if (entry) *port = entry->port;
+	_NFS_unlock(&transport->lock);
+	if (entry) return 0;
+
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) return -1;
 
-	headerSize += rpc_write_int(nfsmount, headerSize, program);	// Write the program
-	headerSize += rpc_write_int(nfsmount, headerSize, 3);		// Write the portmap version
-	headerSize += rpc_write_int(nfsmount, headerSize, PROTO_UDP);	// Write the protocol
-	headerSize += 4;						// Write a 0 value
+	int headerSize = rpc_create_header(call, PROGRAM_PORTMAP, 2, PROCEDURE_GETPORT, AUTH_NULL);
 
-	int32_t ret = udp_sendrecv(nfsmount, headerSize, _nfs_portmapper_port); // Portmapper listens on port 111
+	headerSize += rpc_write_int(call, headerSize, program);	// Write the program
+	headerSize += rpc_write_int(call, headerSize, 3);		// Write the portmap version
+	headerSize += rpc_write_int(call, headerSize, protocol);	// Write the protocol
+	headerSize += rpc_write_int(call, headerSize, 0);		// Write a 0 value
+
+	int32_t ret = nfs_sendrecv(call, headerSize, transport->portmapper_port); // Portmapper listens on port 111 by default
 	if (ret < 0)
 	{
+		nfs_call_put(call);
 		return -1;
 	}
 
 	int32_t rpc_header_length = 0;
-	if (rpc_parse_header(nfsmount, &rpc_header_length) != 0)
+	if (rpc_parse_header(call, &rpc_header_length) != 0)
 	{
+		nfs_call_put(call);
 		return -2;
 	}
-	*port = *(uint32_t *) (nfsmount->buffer + rpc_header_length);
+	*port = *(uint32_t *) (call->buffer + rpc_header_length);
+	nfs_call_put(call);
+
+	// Remember it in a free entry, or in the last one when all are used
+	if (*port != 0) {
+		_NFS_lock(&transport->lock);
+		int32_t i;
+		for (i = 0; i < NFS_PORT_CACHE - 1 && transport->ports[i].port != 0; i++);
+		transport->ports[i].program = program;
+		transport->ports[i].protocol = protocol;
+		transport->ports[i].port = *port;
+		_NFS_unlock(&transport->lock);
+	}
 	return 0;
 }
 
+// Forgets a port which didn't answer, the server may have been restarted with other ports
+void portmap_forget_port(NFS_TRANSPORT *transport, u32 program, u32 protocol)
+{
+	_NFS_lock(&transport->lock);
+	NFS_PORT *entry = portmap_cached(transport, program, protocol);
+	if (entry) entry->port = 0;
+	_NFS_unlock(&transport->lock);
+}
+
 uint16_t portmap_find_mount_port(NFSMOUNT *nfsmount)
 {
-	return portmap_find_port(nfsmount, &nfsmount->mount_port, PROGRAM_MOUNT);
+	return portmap_find_port(nfsmount, &nfsmount->mount_port, PROGRAM_MOUNT, PROTO_UDP);
 }
 
 uint16_t portmap_find_nfs_port(NFSMOUNT *nfsmount)
 {
-	return portmap_find_port(nfsmount, &nfsmount->nfs_port, PROGRAM_NFS);
+	return portmap_find_port(nfsmount, &nfsmount->transport->nfs_port, PROGRAM_NFS, nfsmount->transport->protocol);
 }
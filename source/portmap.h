@@ -32,5 +32,6 @@
 
 uint16_t portmap_find_mount_port(NFSMOUNT *nfsmount);
 uint16_t portmap_find_nfs_port(NFSMOUNT *nfsmount);
+void portmap_forget_port(NFS_TRANSPORT *transport, u32 program, u32 protocol);
 
 #endif // _PORTMAP_H_
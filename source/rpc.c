@@ -30,30 +30,30 @@
 #include <network.h>
 #include <string.h>
 #include "rpc.h"
+#include "lock.h"
 
 #define TYPE_CALL 0
 #define TYPE_REPLY 1
 
 #define SUCCESS 0
 
-int32_t rpc_create_header(NFSMOUNT *nfsmount, int32_t program, int32_t program_version, int32_t procedure, int32_t auth)
+// Encodes the part of a call header which is the same for every call of a program
+static void rpc_create_template(NFS_CALL *call, RPC_TEMPLATE *template, int32_t program, int32_t program_version, int32_t auth)
 {
-	if (nfsmount->bufferlen < 40) return -1;
-	if (auth != AUTH_NULL && auth != AUTH_UNIX) return -2;
+	NFSMOUNT *nfsmount = call->nfsmount;
 
-	uint32_t *buf = (u32 *) nfsmount->buffer;
-	memset(nfsmount->buffer, 0, nfsmount->bufferlen);
-	u32 offset = rpc_write_int(nfsmount, 0, ++nfsmount->xid); 	// Tranmission Id
-	offset += rpc_write_int(nfsmount, offset, TYPE_CALL);		// Message type (CALL)	 
-	offset += rpc_write_int(nfsmount, offset, 2);			// RPC Version
-	offset += rpc_write_int(nfsmount, offset, program);		// Program to be called
-	offset += rpc_write_int(nfsmount, offset, program_version);	// Program version
-	offset += rpc_write_int(nfsmount, offset, procedure);		// Procedure
-	offset += rpc_write_int(nfsmount, offset, auth);		// Authentication type
+	memset(call->buffer, 0, RPC_TEMPLATE_SIZE);
+	u32 offset = 4; 						// Tranmission Id, filled in per call
+	offset += rpc_write_int(call, offset, TYPE_CALL);		// Message type (CALL)	 
+	offset += rpc_write_int(call, offset, 2);			// RPC Version
+	offset += rpc_write_int(call, offset, program);		// Program to be called
+	offset += rpc_write_int(call, offset, program_version);	// Program version
+	offset += 4;							// Procedure, filled in per call
+	offset += rpc_write_int(call, offset, auth);		// Authentication type
 
 	if (auth == AUTH_NULL)
 	{
-		return offset + 12;	// 12 bytes extra, for length of auth header, verifier, and length of verifier
+		offset += 12;	// 12 bytes extra, for length of auth header, verifier, and length of verifier
 	}
 	else
 	{
@@ -65,33 +65,72 @@ int32_t rpc_create_header(NFSMOUNT *nfsmount, int32_t program, int32_t program_v
 		struct in_addr addr;
 		addr.s_addr = ip;
 		char *ipAddr = inet_ntoa(addr);
-		
-		uint32_t length = strlen(ipAddr);
 
 		u32 auth_length_offset = offset;
 		offset += 4; 	// Write auth header length when we know it
-		offset += rpc_write_int(nfsmount, offset, tv.tv_sec);		// Timestamp	
-		offset += rpc_write_string(nfsmount, offset, ipAddr);		// Write machine name
-		offset += rpc_write_int(nfsmount, offset, nfsmount->uid);	// Write UID
-		offset += rpc_write_int(nfsmount, offset, nfsmount->gid);	// Write GID
+		offset += rpc_write_int(call, offset, tv.tv_sec);		// Timestamp	
+		offset += rpc_write_string(call, offset, ipAddr);		// Write machine name
+		offset += rpc_write_int(call, offset, nfsmount->uid);	// Write UID
+		offset += rpc_write_int(call, offset, nfsmount->gid);	// Write GID
 		offset += 4;							// Additional GIDs (unsupported atm)
-		rpc_write_int(nfsmount, auth_length_offset, offset - (auth_length_offset + 4));	// Write auth header length
+		rpc_write_int(call, auth_length_offset, offset - (auth_length_offset + 4));	// Write auth header length
 		offset += 8;							// Verifier header
-		return offset;
 	}
+
+	template->program = program;
+	template->version = program_version;
+	template->auth = auth;
+	template->len = offset;
+	memcpy(template->data, call->buffer, offset);
 }
 
-int32_t rpc_is_expected_message(NFSMOUNT *nfsmount)
+int32_t rpc_create_header(NFS_CALL *call, int32_t program, int32_t program_version, int32_t procedure, int32_t auth)
 {
-	uint32_t xid;
-	rpc_read_int(nfsmount, 0, (int32_t *) &xid);
+	NFSMOUNT *nfsmount = call->nfsmount;
+	NFS_TRANSPORT *transport = nfsmount->transport;
+
+	if (call->bufferlen < RPC_TEMPLATE_SIZE) return -1;
+	if (auth != AUTH_NULL && auth != AUTH_UNIX) return -2;
 
-	return xid == nfsmount->xid ? 1 : 0;
+	// The templates have the credentials of the mount, the xid space is that of the transport it shares
+	_NFS_lock(&transport->lock);
+
+	// The header and credentials are encoded once per program, only the xid and procedure change per call
+	RPC_TEMPLATE *template = NULL;
+	int32_t i;
+	for (i = 0; i < RPC_TEMPLATES && !template; i++) {
+		RPC_TEMPLATE *t = &nfsmount->templates[i];
+		if (t->len != 0 && t->program == program && t->version == program_version && t->auth == auth) {
+			template = t;
+		} else if (t->len == 0 || i == RPC_TEMPLATES - 1) {
+			// Unused, or all are in use by other programs
+			rpc_create_template(call, t, program, program_version, auth);
+			template = t;
+		}
+	}
+
+	memcpy(call->buffer, template->data, template->len);
+	call->xid = ++transport->xid;
+	int32_t len = template->len;
+
+	_NFS_unlock(&transport->lock);
+
+	rpc_write_int(call, 0, call->xid);
+	rpc_write_int(call, 20, procedure);
+	call->length = -1;
+	call->payload = NULL;
+	call->payloadlen = 0;
+	call->sends = 0;
+	call->expired = 0;
+	call->hedged = 0;
+	call->maxsends = 0;
+	call->probe = 0;
+	return len;
 }
 
-int32_t rpc_parse_header(NFSMOUNT *nfsmount, int32_t *rpc_header_length)
+int32_t rpc_parse_header(NFS_CALL *call, int32_t *rpc_header_length)
 {
-	uint32_t *buf = (uint32_t *) nfsmount->buffer;
+	uint32_t *buf = (uint32_t *) call->buffer;
 
 	*rpc_header_length = 24; // Fixed length of the reply header, since we don't have verifier data
 
@@ -104,112 +143,136 @@ int32_t rpc_parse_header(NFSMOUNT *nfsmount, int32_t *rpc_header_length)
 	return (s32) buf[5]; // Contains the accepted bit
 }
 
-int32_t rpc_write_string(NFSMOUNT *nfsmount, int32_t offset, const char *str)
+// Checks whether a message starts with the READ_REPLY_HEADER bytes of a successful READ reply,
+// so the data follows right after it. Returns the length of the data, or -1 for any other reply.
+int32_t rpc_read_reply_datalen(uint32_t *header)
+{
+	if (header[1] != TYPE_REPLY || header[2] != SUCCESS) return -1;
+	if (header[4] != 0 || header[5] != SUCCESS) return -1; // Verifier data would move everything
+	if (header[6] != NFS3_OK || header[7] != 1) return -1; // Without attributes the data starts earlier
+
+	return (int32_t) header[READ_REPLY_HEADER / 4 - 1];
+}
+
+int32_t rpc_write_string(NFS_CALL *call, int32_t offset, const char *str)
 {
 	int32_t len = strlen(str);
-	*(uint32_t *) (nfsmount->buffer + offset) = len;
-	strncpy((char *) (nfsmount->buffer + offset + 4), str, len);
+	*(uint32_t *) (call->buffer + offset) = len;
+	*(uint32_t *) (call->buffer + offset + 4 + (len & ~3)) = 0; // Padding
+	memcpy(call->buffer + offset + 4, str, len);
 	return ((len + 3) & ~3) + 4; // Round length to 4 bytes, and add 4 bytes for the length
 }
 
-int32_t rpc_write_fhandle(NFSMOUNT *nfsmount, int32_t offset, fhandle3 *handle)
+int32_t rpc_write_fhandle(NFS_CALL *call, int32_t offset, fhandle3 *handle)
 {
-	*((int32_t *) (nfsmount->buffer + offset)) = handle->len;
-	memcpy((void *) (nfsmount->buffer + offset + 4), handle->val, handle->len);
+	*((int32_t *) (call->buffer + offset)) = handle->len;
+	memcpy((void *) (call->buffer + offset + 4), handle->val, handle->len);
 	return handle->len + 4;
 }
 
-int32_t rpc_write_sattr(NFSMOUNT *nfsmount, int32_t offset, sattr3 *attr)
+int32_t rpc_write_sattr(NFS_CALL *call, int32_t offset, sattr3 *attr)
 {
 	int32_t len = 0;
-	len += rpc_write_int(nfsmount, offset + len, attr->setmode);
-	if (attr->setmode) len += rpc_write_int(nfsmount, offset + len, attr->mode);
-	len += rpc_write_int(nfsmount, offset + len, attr->setuid);
-	if (attr->setuid) len += rpc_write_int(nfsmount, offset + len, attr->uid);
-	len += rpc_write_int(nfsmount, offset + len, attr->setgid);
-	if (attr->setgid) len += rpc_write_int(nfsmount, offset + len, attr->gid);
-	len += rpc_write_int(nfsmount, offset + len, attr->setsize);
-	if (attr->setsize) len += rpc_write_long(nfsmount, offset + len, attr->size);
-	len += rpc_write_int(nfsmount, offset + len, attr->setatime);
-	len += rpc_write_int(nfsmount, offset + len, attr->setmtime);
+	len += rpc_write_int(call, offset + len, attr->setmode);
+	if (attr->setmode) len += rpc_write_int(call, offset + len, attr->mode);
+	len += rpc_write_int(call, offset + len, attr->setuid);
+	if (attr->setuid) len += rpc_write_int(call, offset + len, attr->uid);
+	len += rpc_write_int(call, offset + len, attr->setgid);
+	if (attr->setgid) len += rpc_write_int(call, offset + len, attr->gid);
+	len += rpc_write_int(call, offset + len, attr->setsize);
+	if (attr->setsize) len += rpc_write_long(call, offset + len, attr->size);
+	len += rpc_write_int(call, offset + len, attr->setatime);
+	len += rpc_write_int(call, offset + len, attr->setmtime);
 	return len;
 }
 
-int32_t rpc_write_long(NFSMOUNT *nfsmount, int32_t offset, int64_t value)
+int32_t rpc_write_long(NFS_CALL *call, int32_t offset, int64_t value)
 {
-	*((int32_t *) (nfsmount->buffer + offset)) = (int32_t)((value >> 32) & 0xFFFFFFFF);
-	*((int32_t *) (nfsmount->buffer + offset + 4)) = (int32_t)(value & 0xFFFFFFFF);
+	*((int32_t *) (call->buffer + offset)) = (int32_t)((value >> 32) & 0xFFFFFFFF);
+	*((int32_t *) (call->buffer + offset + 4)) = (int32_t)(value & 0xFFFFFFFF);
 	return sizeof(int64_t);
 }
 
-int32_t rpc_write_int(NFSMOUNT *nfsmount, int32_t offset, int32_t value)
+int32_t rpc_write_int(NFS_CALL *call, int32_t offset, int32_t value)
 {
-	*((int32_t *) (nfsmount->buffer + offset)) = value;
+	*((int32_t *) (call->buffer + offset)) = value;
 	return sizeof(int);
 }
 
-int32_t rpc_write_block(NFSMOUNT *nfsmount, int32_t offset, void *buf, int32_t len)
+int32_t rpc_write_block(NFS_CALL *call, int32_t offset, void *buf, int32_t len)
 {
-	offset += rpc_write_int(nfsmount, offset, len);
-	memcpy(nfsmount->buffer + offset, buf, len);
+	offset += rpc_write_int(call, offset, len);
+	memcpy(call->buffer + offset, buf, len);
 	return len + 4;
 }
 
-int32_t rpc_read_fhandle(NFSMOUNT *nfsmount, int32_t offset, fhandle3 *handle)
+int32_t rpc_skip_wcc_data(NFS_CALL *call, int32_t offset)
+{
+	int32_t len = 0, intVal;
+	len += rpc_read_int(call, offset + len, &intVal);
+	if (intVal) len += 24; // Skip "before" attributes (size, mtime and ctime)
+	len += rpc_read_int(call, offset + len, &intVal);
+	if (intVal) len += sizeof(object_attributes); // Skip "after" object attributes
+	return len;
+}
+
+int32_t rpc_read_fhandle(NFS_CALL *call, int32_t offset, fhandle3 *handle)
 {
-	handle->len = *(u32 *) (nfsmount->buffer + offset);
+	handle->len = *(u32 *) (call->buffer + offset);
 	handle->val = _NFS_mem_allocate(handle->len);
-	memcpy(handle->val, nfsmount->buffer + offset + 4, handle->len);
+	memcpy(handle->val, call->buffer + offset + 4, handle->len);
 
 	return handle->len + 4;
 }
 
-int32_t rpc_read_objectattr(NFSMOUNT *nfsmount, int32_t offset, object_attributes *attr)
+int32_t rpc_read_objectattr(NFS_CALL *call, int32_t offset, object_attributes *attr)
 {
-	if (attr != NULL) memcpy(attr, nfsmount->buffer + offset, sizeof(object_attributes));
+	if (attr != NULL) memcpy(attr, call->buffer + offset, sizeof(object_attributes));
 	return sizeof(object_attributes);
 }
 
-int32_t rpc_read_stat(NFSMOUNT *nfsmount, int32_t offset, struct stat *stat)
+int32_t rpc_read_stat(NFS_CALL *call, int32_t offset, struct stat *stat)
 {
-	object_attributes *attr = (object_attributes *) (nfsmount->buffer + offset);
+	object_attributes *attr = (object_attributes *) (call->buffer + offset);
 	_NFS_copy_stat_from_attributes(stat, attr);
 	return sizeof(object_attributes);
 }
 
-int32_t rpc_read_sattr(NFSMOUNT *nfsmount, int32_t offset, sattr3 *attr)
+int32_t rpc_read_sattr(NFS_CALL *call, int32_t offset, sattr3 *attr)
 {
-	int32_t len = 0;
-	len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->setmode);
-	if (attr->setmode) len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->mode);
-	len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->setuid);
-	if (attr->setuid) len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->uid);
-	len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->setgid);
-	if (attr->setgid) len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->gid);
-	len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->setsize);
-	if (attr->setsize) len += rpc_read_long(nfsmount, offset + len, (int64_t *) &attr->size);
-	len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->setatime);
-	len += rpc_read_int(nfsmount, offset + len, (int32_t *) &attr->setmtime);
+	// The struct is packed, so its members are read through aligned copies
+	int32_t len = 0, val;
+	int64_t size;
+	len += rpc_read_int(call, offset + len, &val); attr->setmode = val;
+	if (attr->setmode) { len += rpc_read_int(call, offset + len, &val); attr->mode = val; }
+	len += rpc_read_int(call, offset + len, &val); attr->setuid = val;
+	if (attr->setuid) { len += rpc_read_int(call, offset + len, &val); attr->uid = val; }
+	len += rpc_read_int(call, offset + len, &val); attr->setgid = val;
+	if (attr->setgid) { len += rpc_read_int(call, offset + len, &val); attr->gid = val; }
+	len += rpc_read_int(call, offset + len, &val); attr->setsize = val;
+	if (attr->setsize) { len += rpc_read_long(call, offset + len, &size); attr->size = size; }
+	len += rpc_read_int(call, offset + len, &val); attr->setatime = val;
+	len += rpc_read_int(call, offset + len, &val); attr->setmtime = val;
 	return len;
 }
 
-int32_t rpc_read_string(NFSMOUNT *nfsmount, int32_t offset, char **str)
+int32_t rpc_read_string(NFS_CALL *call, int32_t offset, char **str)
 {
-	int32_t len = *((int32_t *) (nfsmount->buffer + offset));
+	int32_t len = *((int32_t *) (call->buffer + offset));
 	*str = _NFS_mem_allocate(len + 1);
 	memset(*str, 0, len + 1);
-	strncpy(*str, nfsmount->buffer + offset + 4, len);
+	strncpy(*str, call->buffer + offset + 4, len);
 	return 4 + len + (len % 4 == 0 ? 0 : 4 - (len % 4));
 }
 
-int32_t rpc_read_long(NFSMOUNT *nfsmount, int32_t offset, int64_t *val)
+int32_t rpc_read_long(NFS_CALL *call, int32_t offset, int64_t *val)
 {
-	*val = *((int64_t *) (nfsmount->buffer + offset));
+	*val = *((int64_t *) (call->buffer + offset));
 	return sizeof(int64_t);
 }
 
-int32_t rpc_read_int(NFSMOUNT *nfsmount, int32_t offset, int32_t *val)
+int32_t rpc_read_int(NFS_CALL *call, int32_t offset, int32_t *val)
 {
-	*val = *((int32_t *) (nfsmount->buffer + offset));
+	*val = *((int32_t *) (call->buffer + offset));
 	return sizeof(int);
 }
@@ -74,6 +74,9 @@
 #define WRITE_DATA_SYNC			1
 #define WRITE_FILE_SYNC			2
 
+#define NF3REG					1
+#define NF3DIR					2
+
 #define NFS3_OK					0
 #define NFS3ERR_PERM			1
 #define NFS3ERR_NOENT			2
@@ -104,28 +107,32 @@
 #define NFS3ERR_BADTYPE			10007
 #define NFS3ERR_JUKEBOX			10008
 
-int32_t rpc_create_header(NFSMOUNT *nfsmount, int32_t program, int32_t program_version, int32_t procedure, int32_t auth);
-int32_t rpc_is_expected_message(NFSMOUNT *nfsmount);
-int32_t rpc_parse_header(NFSMOUNT *nfsmount, int32_t *rpc_header_length);
+#define RPC_MAX_HEADER			512	// Room for the RPC and NFS headers in front of the data of a READ or WRITE
+#define READ_REPLY_HEADER		128	// The RPC header and READ3resok up to the data, when the attributes are included
+
+int32_t rpc_create_header(NFS_CALL *call, int32_t program, int32_t program_version, int32_t procedure, int32_t auth);
+int32_t rpc_parse_header(NFS_CALL *call, int32_t *rpc_header_length);
+int32_t rpc_read_reply_datalen(uint32_t *header);
 
-int32_t rpc_write_string(NFSMOUNT *nfsmount, int32_t offset, const char *str);
-int32_t rpc_write_fhandle(NFSMOUNT *nfsmount, int32_t offset, fhandle3 *handle);
+int32_t rpc_write_string(NFS_CALL *call, int32_t offset, const char *str);
+int32_t rpc_write_fhandle(NFS_CALL *call, int32_t offset, fhandle3 *handle);
 
-int32_t rpc_write_sattr(NFSMOUNT *nfsmount, int32_t offset, sattr3 *attr);
+int32_t rpc_write_sattr(NFS_CALL *call, int32_t offset, sattr3 *attr);
 
-int32_t rpc_write_long(NFSMOUNT *nfsmount, int32_t offset, int64_t value);
-int32_t rpc_write_int(NFSMOUNT *nfsmount, int32_t offset, int32_t value);
+int32_t rpc_write_long(NFS_CALL *call, int32_t offset, int64_t value);
+int32_t rpc_write_int(NFS_CALL *call, int32_t offset, int32_t value);
 
-int32_t rpc_write_block(NFSMOUNT *nfsmount, int32_t offset, void *buf, int32_t len);
+int32_t rpc_write_block(NFS_CALL *call, int32_t offset, void *buf, int32_t len);
 
-int32_t rpc_read_fhandle(NFSMOUNT *nfsmount, int32_t offset, fhandle3 *handle);
-int32_t rpc_read_objectattr(NFSMOUNT *nfsmount, int32_t offset, object_attributes *attr);
-int32_t rpc_read_stat(NFSMOUNT *nfsmount, int32_t offset, struct stat *stat);
-int32_t rpc_read_sattr(NFSMOUNT *nfsmount, int32_t offset, sattr3 *attr);
+int32_t rpc_skip_wcc_data(NFS_CALL *call, int32_t offset);
+int32_t rpc_read_fhandle(NFS_CALL *call, int32_t offset, fhandle3 *handle);
+int32_t rpc_read_objectattr(NFS_CALL *call, int32_t offset, object_attributes *attr);
+int32_t rpc_read_stat(NFS_CALL *call, int32_t offset, struct stat *stat);
+int32_t rpc_read_sattr(NFS_CALL *call, int32_t offset, sattr3 *attr);
 
-int32_t rpc_read_string(NFSMOUNT *nfsmount, int32_t offset, char **str);
+int32_t rpc_read_string(NFS_CALL *call, int32_t offset, char **str);
 
-int32_t rpc_read_long(NFSMOUNT *nfsmount, int32_t offset, int64_t *val);
-int32_t rpc_read_int(NFSMOUNT *nfsmount, int32_t offset, int32_t *val);
+int32_t rpc_read_long(NFS_CALL *call, int32_t offset, int64_t *val);
+int32_t rpc_read_int(NFS_CALL *call, int32_t offset, int32_t *val);
 
 #endif // _RPC_H_
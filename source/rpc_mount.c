@@ -26,143 +26,367 @@
 */
 
 #include <string.h>
+#include <stdio.h>
 #include <sys/iosupport.h>
 
 #include "common.h"
 #include "rpc.h"
 #include "rpc_mount.h"
 #include "nfs_net.h"
+#include "nfs_attr.h"
+#include "nfs_name.h"
+#include "nfs_rcache.h"
 #include "portmap.h"
+#include "nfs_file.h"
+#include "nfs_dir.h"
 #include "lock.h"
 
-extern int _nfs_buffer_size;
+#define TCP_MAX_BLOCK 65536
 
-s32 rpc_domount(NFSMOUNT *nfsmount, s32 procedure, s32 mountport, const char *mountdir)
+s32 rpc_domount(NFSMOUNT *nfsmount, s32 procedure, s32 mountport, const char *mountdir, fhandle3 *handle)
 {
-	int headerSize = rpc_create_header(nfsmount, PROGRAM_MOUNT, 3, procedure, AUTH_UNIX);
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) return -1;
+
+	int headerSize = rpc_create_header(call, PROGRAM_MOUNT, 3, procedure, AUTH_UNIX);
 
 	int offset = headerSize;
-	offset += rpc_write_string(nfsmount, offset, mountdir);
+	offset += rpc_write_string(call, offset, mountdir);
 
-	s32 ret = udp_sendrecv(nfsmount, offset, mountport);
+	s32 ret = nfs_sendrecv(call, offset, mountport);
 	if (ret < 0)
 	{
+		nfs_call_put(call);
 		return ret;
 	}
 
 	s32 rpc_header_length = 0;
-	if (rpc_parse_header(nfsmount, &rpc_header_length) != 0)
+	if (rpc_parse_header(call, &rpc_header_length) != 0)
 	{
+		nfs_call_put(call);
 		return -10;
 	}
 
-	if (procedure == PROCEDURE_UNMOUNT) return 0; // The RPC header status is 0, unmount will not supply additional information
-
-	int32_t status;
-	rpc_read_int(nfsmount, rpc_header_length, &status);
-	if (status == 0) // Status of the mount call
+	// The RPC header status is 0, unmount will not supply additional information
+	ret = 0;
+	if (procedure != PROCEDURE_UNMOUNT)
 	{
-		return rpc_header_length;
+		int32_t status;
+		rpc_read_int(call, rpc_header_length, &status);
+		if (status == 0) // Status of the mount call
+		{
+			// Skip the status field, and get the handle of the mountpoint
+			rpc_read_fhandle(call, rpc_header_length + 4, handle);
+		}
+		else ret = -11;
 	}
-	return -11;
+	nfs_call_put(call);
+	return ret;
 }
 
-void rpc_fsinfo(NFSMOUNT *nfsmount)
+// Asks the server for the sizes it prefers for READ and WRITE calls. Returns -1 when it didn't tell.
+int32_t rpc_fsinfo(NFSMOUNT *nfsmount)
 {
-	int headerSize = rpc_create_header(nfsmount, PROGRAM_NFS, 3, PROCEDURE_FSINFO, AUTH_UNIX);
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) return -1;
+
+	int headerSize = rpc_create_header(call, PROGRAM_NFS, 3, PROCEDURE_FSINFO, AUTH_UNIX);
 
 	int offset = headerSize;
-	offset += rpc_write_fhandle(nfsmount, offset, &nfsmount->handle);
+	offset += rpc_write_fhandle(call, offset, &nfsmount->handle);
 
-	s32 ret = udp_sendrecv(nfsmount, offset, nfsmount->nfs_port);
-	if (ret < 0) return;
+	s32 ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
+	if (ret < 0) {
+		nfs_call_put(call);
+		return -1;
+	}
 
 	int32_t rpc_header_length = 0;
-	if (rpc_parse_header(nfsmount, &rpc_header_length) == 0)
+	ret = -1;
+	if (rpc_parse_header(call, &rpc_header_length) == 0)
 	{
 		offset = rpc_header_length;
 		int32_t status;
-		offset += rpc_read_int(nfsmount, offset, &status);
+		offset += rpc_read_int(call, offset, &status);
 		if (status == 0)
 		{
 			// Did we receive the object attributes entry (which is useless anyway :P)
-			offset += rpc_read_int(nfsmount, offset, &status);
+			offset += rpc_read_int(call, offset, &status);
 			if (status) {
 				struct stat attr = {0};
-				offset += rpc_read_stat(nfsmount, offset, &attr);
+				offset += rpc_read_stat(call, offset, &attr);
 			}
-			offset += rpc_read_int(nfsmount, offset, &nfsmount->rtmax);
-			offset += rpc_read_int(nfsmount, offset, &nfsmount->rtpref);
-			offset += rpc_read_int(nfsmount, offset, &nfsmount->rtmult);
-			offset += rpc_read_int(nfsmount, offset, &nfsmount->wtmax);
-			offset += rpc_read_int(nfsmount, offset, &nfsmount->wtpref);
-			offset += rpc_read_int(nfsmount, offset, &nfsmount->wtmult);
-			offset += rpc_read_int(nfsmount, offset, &nfsmount->dtpref);
+			offset += rpc_read_int(call, offset, &nfsmount->rtmax);
+			offset += rpc_read_int(call, offset, &nfsmount->rtpref);
+			offset += rpc_read_int(call, offset, &nfsmount->rtmult);
+			offset += rpc_read_int(call, offset, &nfsmount->wtmax);
+			offset += rpc_read_int(call, offset, &nfsmount->wtpref);
+			offset += rpc_read_int(call, offset, &nfsmount->wtmult);
+			offset += rpc_read_int(call, offset, &nfsmount->dtpref);
+			ret = 0;
 		}
 	}
+	nfs_call_put(call);
+	return ret;
 }
 
-int32_t rpc_mount(NFSMOUNT *nfsmount, const char *mountdir)
+// Calls the NULL procedure of the NFS program, which is only given a couple of tries. Returns -1 without a reply.
+int32_t rpc_null(NFSMOUNT *nfsmount)
 {
-	// Initialize the NFS lock
-	_NFS_lock_init(&nfsmount->lock);
+	NFS_CALL *call = nfs_call_get(nfsmount);
+	if (call == NULL) return -1;
 
-	_NFS_lock(&nfsmount->lock);
+	int32_t offset = rpc_create_header(call, PROGRAM_NFS, 3, 0, AUTH_UNIX);
+	call->probe = 1;
+	call->maxsends = NFS_PROBE_SENDS;
 
-	// Allocate the buffer, which will be used for sending and retrieving
-	nfsmount->buffer = _NFS_mem_allocate(_nfs_buffer_size);
-	nfsmount->bufferlen = _nfs_buffer_size;
-	if (!nfsmount->buffer) goto error;
+	int32_t ret = nfs_sendrecv(call, offset, nfsmount->transport->nfs_port);
+	nfs_call_put(call);
+	return ret < 0 ? -1 : 0;
+}
 
-	if (portmap_find_mount_port(nfsmount) != 0) goto error;
-	if (portmap_find_nfs_port(nfsmount) != 0) goto error;
+// (Re)allocates the receive buffer, the buffers of the calls follow its size
+static int32_t rpc_allocate_buffer(NFS_TRANSPORT *transport, uint32_t len)
+{
+	if (nfs_allocate_buffer(&transport->rxbuffer, len) != 0) return -1;
+	transport->bufferlen = len;
+	return 0;
+}
 
-	s32 ret = rpc_domount(nfsmount, PROCEDURE_MOUNT, nfsmount->mount_port, mountdir); // ret will contain the length of the header
-	if (ret > 0)
+// Reads the ports, root handle and FSINFO of an earlier mount of the same export from the state file
+static int32_t rpc_load_state(NFSMOUNT *nfsmount, const char *mountdir)
+{
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	FILE *f = fopen(nfsmount->statefile, "rb");
+	if (f == NULL) return -1;
+
+	NFS_MOUNT_STATE state;
+	char dir[NFS_MOUNT_STATE_DIRLEN];
+	int32_t ret = -1;
+	if (fread(&state, sizeof(state), 1, f) == 1 && fread(dir, sizeof(dir), 1, f) == 1 &&
+		state.magic == NFS_MOUNT_STATE_MAGIC &&
+		state.server == transport->remote.sin_addr.s_addr &&
+		state.transport == transport->protocol &&
+		state.handlelen > 0 && state.handlelen <= NFS3_FHSIZE &&
+		strncmp(dir, mountdir, sizeof(dir)) == 0)
 	{
-		// First, get the length of the handle
-		int offset = ret + 4; // 4 bytes to skip the status field, that was already checked in the rpc_domount
-		offset += rpc_read_fhandle(nfsmount, offset, &nfsmount->handle);
+		nfsmount->mount_port = state.mount_port;
+		if (!transport->ready) transport->nfs_port = state.nfs_port; // Another mount of the server knows it already
+		nfsmount->handle.len = state.handlelen;
+		nfsmount->handle.val = _NFS_mem_allocate(state.handlelen);
+		memcpy(nfsmount->handle.val, state.handle, state.handlelen);
+		nfsmount->rtmax = state.rtmax;
+		nfsmount->rtpref = state.rtpref;
+		nfsmount->rtmult = state.rtmult;
+		nfsmount->wtmax = state.wtmax;
+		nfsmount->wtpref = state.wtpref;
+		nfsmount->wtmult = state.wtmult;
+		nfsmount->dtpref = state.dtpref;
+		ret = 0;
+	}
+	fclose(f);
+	return ret;
+}
 
-		// Copy mountdir into nfsmount
-		nfsmount->mountdir = _NFS_mem_allocate(strlen(mountdir) + 1);
-		memset(nfsmount->mountdir, 0, strlen(mountdir) + 1);
-		strncpy(nfsmount->mountdir, mountdir, strlen(mountdir));
+static void rpc_save_state(NFSMOUNT *nfsmount, const char *mountdir)
+{
+	if (strlen(mountdir) >= NFS_MOUNT_STATE_DIRLEN || nfsmount->handle.len > NFS3_FHSIZE) return;
+
+	NFS_MOUNT_STATE state;
+	char dir[NFS_MOUNT_STATE_DIRLEN];
+	memset(&state, 0, sizeof(state));
+	memset(dir, 0, sizeof(dir));
+	state.magic = NFS_MOUNT_STATE_MAGIC;
+	state.server = nfsmount->transport->remote.sin_addr.s_addr;
+	state.transport = nfsmount->transport->protocol;
+	state.mount_port = nfsmount->mount_port;
+	state.nfs_port = nfsmount->transport->nfs_port;
+	state.handlelen = nfsmount->handle.len;
+	memcpy(state.handle, nfsmount->handle.val, nfsmount->handle.len);
+	state.rtmax = nfsmount->rtmax;
+	state.rtpref = nfsmount->rtpref;
+	state.rtmult = nfsmount->rtmult;
+	state.wtmax = nfsmount->wtmax;
+	state.wtpref = nfsmount->wtpref;
+	state.wtmult = nfsmount->wtmult;
+	state.dtpref = nfsmount->dtpref;
+	strcpy(dir, mountdir);
+
+	FILE *f = fopen(nfsmount->statefile, "wb");
+	if (f == NULL) return;
+	fwrite(&state, sizeof(state), 1, f);
+	fwrite(dir, sizeof(dir), 1, f);
+	fclose(f);
+}
 
-		// Do a call to FSINFO at this point
-		rpc_fsinfo(nfsmount);
+// Checks with a GETATTR on the root handle whether the saved state is still valid
+static int32_t rpc_validate_state(NFSMOUNT *nfsmount)
+{
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	int32_t ret = -1;
+	object_attributes attr;
 
-		_NFS_unlock(&nfsmount->lock);
-		return 0;
+	if (transport->ready || transport->protocol != PROTO_TCP || tcp_connect(transport, 0) == 0) {
+		// Send it once, a lost reply only costs the full handshake
+		ret = nfs_attr_getattr(nfsmount, &nfsmount->handle, &attr, 1);
 	}
-error:
-	_NFS_unlock(&nfsmount->lock);
-	_NFS_lock_deinit(&nfsmount->lock);
-	_NFS_mem_free(nfsmount);
-	return -1;
+
+	if (ret != 0 || attr.type != NF3DIR) {
+		// Stale handle or the server moved, forget everything and start over
+		if (!transport->ready) {
+			if (transport->protocol == PROTO_TCP) tcp_close(transport, 0);
+			transport->nfs_port = 0;
+		}
+		fhandle3_free(&nfsmount->handle);
+		nfsmount->mount_port = 0;
+		return -1;
+	}
+	return 0;
 }
 
-void rpc_unmount(NFSMOUNT *nfsmount)
+// Does the handshake of the mount, the first mount of a server sets up the transport as well
+static int32_t rpc_setup(NFSMOUNT *nfsmount)
 {
-	_NFS_lock(&nfsmount->lock);
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	const char *mountdir = nfsmount->mountdir;
+	int32_t connect = !transport->ready;
+
+	// Skip the portmapper, MNT and FSINFO calls when the state of the last mount is still valid
+	int32_t restored = nfsmount->statefile != NULL && rpc_load_state(nfsmount, mountdir) == 0 && rpc_validate_state(nfsmount) == 0;
 
-	rpc_domount(nfsmount, PROCEDURE_UNMOUNT, nfsmount->mount_port, nfsmount->mountdir);
+	if (!restored)
+	{
+		// The ports are looked up once per server, the other mounts find them in the cache of the transport
+		if (portmap_find_mount_port(nfsmount) != 0) return -1;
+		if (connect && portmap_find_nfs_port(nfsmount) != 0) return -1;
+
+		if (rpc_domount(nfsmount, PROCEDURE_MOUNT, nfsmount->mount_port, mountdir, &nfsmount->handle) != 0) {
+			// The server may have been restarted with other ports, ask again next time
+			portmap_forget_port(transport, PROGRAM_MOUNT, PROTO_UDP);
+			return -1;
+		}
+		if (connect && transport->protocol == PROTO_TCP && tcp_connect(transport, 0) != 0) return -1;
+	}
+
+	if (connect) nfs_open_flows(transport, transport->maxflows);
+
+	if (!restored)
+	{
+		// Do a call to FSINFO at this point, the state is only saved with its results
+		if (rpc_fsinfo(nfsmount) == 0 && nfsmount->statefile != NULL) rpc_save_state(nfsmount, mountdir);
+	}
+
+	// TCP doesn't fragment, so grow the buffer to fit the largest READ replies the server allows.
+	// WRITE data is sent from the buffer of the caller, so it doesn't need room in here.
+	// Only the first mount does this, the calls of the others may be using the buffer already.
+	if (connect && transport->protocol == PROTO_TCP) {
+		int32_t block = nfsmount->rtmax;
+		if (nfsmount->rsize > 0 && nfsmount->rsize < block) block = nfsmount->rsize;
+		if (block > TCP_MAX_BLOCK) block = TCP_MAX_BLOCK;
+		if (block + RPC_MAX_HEADER > transport->bufferlen) {
+			rpc_allocate_buffer(transport, block + RPC_MAX_HEADER);
+		}
+	}
+
+	transport->ready = 1;
+	return 0;
+}
+
+int32_t rpc_mount(NFSMOUNT *nfsmount)
+{
+	// Lazy mounts of the same server run their handshakes one at a time
+	_NFS_lock(&nfsmount->transport->setuplock);
+	int32_t ret = rpc_setup(nfsmount);
+	_NFS_unlock(&nfsmount->transport->setuplock);
+	return ret;
+}
+
+int32_t rpc_remount(NFSMOUNT *nfsmount, uint32_t generation)
+{
+	NFS_TRANSPORT *transport = nfsmount->transport;
+	int32_t ret = 0;
+
+	// Only the first call to find its handle stale mounts again, the others just use the new root handle
+	_NFS_lock(&transport->setuplock);
+	if (nfsmount->generation == generation)
+	{
+		fhandle3 handle = {0};
+		ret = rpc_domount(nfsmount, PROCEDURE_MOUNT, nfsmount->mount_port, nfsmount->mountdir, &handle);
+		if (ret != 0) {
+			// A restarted server may have its mount service on another port
+			portmap_forget_port(transport, PROGRAM_MOUNT, PROTO_UDP);
+			if (portmap_find_mount_port(nfsmount) == 0) {
+				ret = rpc_domount(nfsmount, PROCEDURE_MOUNT, nfsmount->mount_port, nfsmount->mountdir, &handle);
+			}
+		}
+
+		if (ret == 0) {
+			_NFS_lock(&nfsmount->lock);
+			fhandle3_free(&nfsmount->handle);
+			nfsmount->handle = handle;
+			fhandle3_free(&nfsmount->curdir);
+			char *curdirname = nfsmount->curdirname;
+			nfsmount->curdirname = NULL;
+			nfsmount->generation++;
+			_NFS_unlock(&nfsmount->lock);
+			nfs_attr_purge(nfsmount);
+			nfs_name_purge(nfsmount);
+			nfs_rcache_purge(nfsmount);
+			if (nfsmount->statefile != NULL && rpc_fsinfo(nfsmount) == 0) rpc_save_state(nfsmount, nfsmount->mountdir);
+
+			// The current directory is looked up again by its name
+			if (curdirname != NULL) {
+				struct _reent r;
+				memset(&r, 0, sizeof(r));
+				fhandle3 curdir = {0};
+				if (_NFS_get_handle(&r, nfsmount, curdirname, NULL, &curdir, 1) == 0) {
+					_NFS_lock(&nfsmount->lock);
+					nfsmount->curdir = curdir;
+					nfsmount->curdirname = curdirname;
+					_NFS_unlock(&nfsmount->lock);
+				} else {
+					_NFS_mem_free(curdirname);
+				}
+			}
+		}
+	}
+	_NFS_unlock(&transport->setuplock);
+	return ret;
+}
+
+void rpc_unmount(NFSMOUNT *nfsmount)
+{
+	// Only tell the server when the mount got that far
+	if (nfsmount->mountstate == NFS_MOUNT_DONE) {
+		rpc_domount(nfsmount, PROCEDURE_UNMOUNT, nfsmount->mount_port, nfsmount->mountdir, NULL);
+	}
 
 	// Always clear, even on unclean unmount. Leave the unclean unmount the problem of the server
 	
 	// Set mount_port to 0 and clear mountdir
-	_NFS_mem_free(nfsmount->mountdir);
+	if (nfsmount->mountdir) _NFS_mem_free(nfsmount->mountdir);
 	nfsmount->mountdir = NULL;
 	nfsmount->mount_port = 0;
-	nfsmount->nfs_port = 0;
 
 	fhandle3_free(&nfsmount->handle);
 	fhandle3_free(&nfsmount->curdir);
 
 	if (nfsmount->curdirname) _NFS_mem_free(nfsmount->curdirname);
+	nfsmount->curdirname = NULL;
+	if (nfsmount->statefile) _NFS_mem_free(nfsmount->statefile);
+	nfsmount->statefile = NULL;
+}
 
+// Waits for the handshake of a mount which is done in the background, returns -1 if it failed
+int32_t _NFS_wait_mounted(NFSMOUNT *nfsmount)
+{
+	_NFS_lock(&nfsmount->lock);
+	while (nfsmount->mountstate == NFS_MOUNT_PENDING) {
+		_NFS_cond_wait(&nfsmount->mounted, &nfsmount->lock, 1000000);
+	}
+	int32_t ret = nfsmount->mountstate == NFS_MOUNT_DONE ? 0 : -1;
 	_NFS_unlock(&nfsmount->lock);
-	_NFS_lock_deinit(&nfsmount->lock);
+	return ret;
 }
 
 NFSMOUNT *_NFS_get_NfsMountFromPath(const char *path)
@@ -175,7 +399,13 @@ NFSMOUNT *_NFS_get_NfsMountFromPath(const char *path)
 		return NULL;
 	}
 
-	return (NFSMOUNT*)devops->deviceData;
+	// The first calls on a lazy mount wait for its handshake
+	NFSMOUNT *nfsmount = (NFSMOUNT*)devops->deviceData;
+	if (_NFS_wait_mounted(nfsmount) != 0) {
+		return NULL;
+	}
+
+	return nfsmount;
 }
 
 void fhandle3_copy(fhandle3 *dest, fhandle3 *src)
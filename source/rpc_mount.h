@@ -32,15 +32,31 @@
 #include "lock.h"
 
 /*
-Calls the mount service to mount the specified directory at the specified port
+Calls the mount service to mount the directory in mountdir, and sets up the connection to the NFS service
 */
-int32_t rpc_mount(NFSMOUNT *nfsmount, const char *mountdir);
+int32_t rpc_mount(NFSMOUNT *nfsmount);
 
 /*
 Calls the mount program with the unmount procedure to unmount the mounted directory
 */
 void rpc_unmount(NFSMOUNT *nfsmount);
 
+/*
+Mounts the directory again after the server didn't know a handle anymore (NFS3ERR_STALE), unless the mount
+went past generation already. The current directory is looked up again, returns -1 if the server refused.
+*/
+int32_t rpc_remount(NFSMOUNT *nfsmount, uint32_t generation);
+
+/*
+Calls the NULL procedure, to check whether the server is still there. Returns -1 without a reply.
+*/
+int32_t rpc_null(NFSMOUNT *nfsmount);
+
+/*
+Waits until the mount is done, returns -1 if it failed
+*/
+int32_t _NFS_wait_mounted(NFSMOUNT *nfsmount);
+
 NFSMOUNT *_NFS_get_NfsMountFromPath(const char *path);
 
 #endif //_RPC_MOUNT_H_
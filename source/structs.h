@@ -32,12 +32,31 @@
 #include <sys/stat.h>
 #include <gccore.h>
 #include <network.h>
+#include "nfs.h"
 
 typedef struct {
 	int len;
 	void *val;
 } fhandle3;
 
+#define NFS3_FHSIZE 64
+
+// What a mount learns from the server before the first call, kept in a local file for the next mount
+#define NFS_MOUNT_STATE_MAGIC 0x4e465331
+#define NFS_MOUNT_STATE_DIRLEN 256
+typedef struct {
+	uint32_t magic;
+	uint32_t server;
+	uint32_t transport;
+	uint16_t mount_port;
+	uint16_t nfs_port;
+	int32_t rtmax, rtpref, rtmult;
+	int32_t wtmax, wtpref, wtmult;
+	int32_t dtpref;
+	uint32_t handlelen;
+	uint8_t handle[NFS3_FHSIZE];
+} NFS_MOUNT_STATE;
+
 typedef struct {
 	uint32_t setmode;
 	uint32_t mode;
@@ -51,13 +70,204 @@ typedef struct {
 	uint32_t setmtime;
 }  __attribute((packed)) sattr3;
 
+#define NFS_RTT_RECENT 32 // Round trip times kept per class, hedged calls wait for a percentile of them
+
 typedef struct {
-	// Buffer for UDP packets
+	int32_t srtt;		// Smoothed round trip time in microseconds, scaled by 8
+	int32_t rttvar;		// Round trip time variance in microseconds, scaled by 4
+	int32_t backoff;	// The amount of timeouts since the last measured reply
+	uint32_t recent[NFS_RTT_RECENT]; // The last round trip times, as long as the callers waited
+	uint32_t numrecent;	// The amount of round trip times measured, the last NFS_RTT_RECENT are kept
+} NFS_RTT;
+
+#define RPC_TEMPLATES 3			// NFS, MOUNT and the portmapper
+#define RPC_TEMPLATE_SIZE 128
+
+typedef struct {
+	int32_t program;
+	int32_t version;
+	int32_t auth;
+	uint32_t len;		// 0 when the template isn't used yet
+	char data[RPC_TEMPLATE_SIZE];
+} RPC_TEMPLATE;
+
+#define NFS_MAX_FLOWS 4
+
+#define TCP_STASH_SIZE 256 // Bytes read ahead of a TCP connection, fits a small reply or the header of a READ reply
+
+typedef struct {
+	int32_t socket;		// UDP socket or TCP connection, flow 0 uses the sockets of the transport instead
+	int32_t inflight;	// The amount of requests in flight on this flow
+	int32_t cwnd;		// Congestion window, the max amount of requests in flight on this flow
+
+	// Bytes of the next replies on a TCP connection which were received with the last one
+	uint8_t stash[TCP_STASH_SIZE];
+	uint32_t stashpos;
+	uint32_t stashlen;
+} NFS_FLOW;
+
+#define NFS_RECV_BATCH 8 // Datagrams received at once
+
+// A datagram received together with others, it waits here until it's handed out
+typedef struct {
+	void *buffer;		// Not used for the first datagram of a batch, it's received in the receive buffer
+	int32_t length;		// -1 when it isn't from the server
+	struct _NFS_CALL *placed; // The call of which the READ data was received straight into its payload
+} NFS_DATAGRAM;
+
+#define NFS_BLOCK_LEVELS 6	// READ and WRITE block sizes from the largest allowed one down to 1/32 of it
+#define NFS_BLOCK_MIN 1024	// The smallest block size the controller picks
+#define NFS_BLOCK_EPOCH 32	// The amount of replies the loss and throughput of a block size are measured over
+#define NFS_BLOCK_EPOCH_BYTES (512 * 1024)	// And the amount of data, so small blocks are measured long enough
+
+// Picks the READ or WRITE block size from the measured loss and throughput of the sizes tried so far
+typedef struct {
+	int32_t level;		// The block size is the largest allowed size shifted right by level
+	int32_t size;		// The block size used last
+	uint32_t replies;	// Replies in this epoch
+	uint32_t retransmitted;	// Replies in this epoch to blocks which were sent more than once
+	uint32_t bytes;		// Data transferred in this epoch
+	uint64_t busy;		// Microseconds spent transferring in this epoch
+	uint32_t epochs;
+	uint32_t rate[NFS_BLOCK_LEVELS];	// Throughput per level in bytes per millisecond, 0 when not measured
+} NFS_BLOCK_CTL;
+
+#define NFS_CALL_TABLE 16 // Buckets of the table with the calls waiting for a reply, by xid
+
+#define NFS_ARMED 1
+#define NFS_FIRING 2
+
+struct _NFSMOUNT;
+
+typedef struct _NFS_CALL {
+	struct _NFSMOUNT *nfsmount;
+
+	// The call is encoded in buffer, which holds the reply once it arrived
 	void *buffer;
+	void *rxbuffer; // Spare buffer of the same size, traded for the buffer the reply was received in
+	uint32_t bufferlen;
+
+	uint32_t xid;
+	uint16_t port;		// The port the call was sent to
+	int32_t length;		// The length of the reply, -1 while waiting for it
+	int8_t pending;		// The call is in the table, waiting for a reply
+	int8_t placed;		// The payload of the reply was received straight into payload
+	int8_t placing;		// A receive may be writing into payload right now
+
+	// Where the data of a READ reply should go
+	void *payload;
+	uint32_t payloadlen;
+
+	// How the call was sent, so it can be sent again when its reply is late
+	int32_t flow;		// The flow it went over, -1 for calls to other ports than the NFS port
+	uint32_t sendlen;	// The length of the encoded call, without the data
+	const void *data;	// The data sent behind the call, not copied over TCP
+	uint32_t datalen;
+	int32_t rttclass;
+	uint32_t hedge;		// How long after the first send a duplicate is sent, 0 when it isn't hedged
+	int8_t hedged;		// The duplicate was sent, the reply may be to either of them
+	uint64_t sent;		// When it was sent last, in microseconds
+	uint32_t timeout;	// How long to wait for the reply, in microseconds
+	int32_t sends;		// The amount of times it was sent
+	int8_t expired;		// It was sent as often as allowed, without a reply
+	int32_t maxsends;	// The amount of times it may be sent, 0 for the retries of the mount
+	int8_t probe;		// A health probe, which is sent while the server is down
+	int8_t armed;		// NFS_ARMED when the reactor sends it again, NFS_FIRING while it does
+	struct _NFS_CALL *timernext; // Next call in the same slot of the timer wheel of the reactor
+	uint32_t timerslot;	// The slot it went in, it may have been sent again since
+
+	// A thread waiting for several calls sleeps on the first one, the replies to the others wake it there
+	cond_t replied;
+	struct _NFS_CALL *waiter; // The call the thread waiting for this one sleeps on
+	struct _NFS_CALL *nextwaiter; // The next thread in line to take over receiving, by the call it sleeps on
+
+	struct _NFS_CALL *next; // Next call in the same bucket of the table, or in the list of unused calls
+} NFS_CALL;
+
+#define NFS_PORT_CACHE 4 // Portmapper results kept per server
+
+typedef struct {
+	uint32_t program;
+	uint32_t protocol;
+	uint16_t port;		// 0 when the entry isn't used
+} NFS_PORT;
+
+// The sockets, xid space and calls in flight of a server, shared by all mounts of that server
+typedef struct _NFS_TRANSPORT {
+	struct _NFS_TRANSPORT *next; // Next transport in the list of all of them
+	int32_t users;		// The amount of mounts using it
+
+	// Replies are received in here, and handed to the call they belong to by trading buffers
+	void *rxbuffer;
 	uint32_t bufferlen;
+	uint32_t buffersize; // The size asked for, over TCP the buffer grows to fit the largest READ replies
+
+	// Mutex for the shared state of the transport, it isn't held while waiting for replies
+	mutex_t lock;
+	mutex_t sendlock; // Serializes writing calls to the sockets
+	mutex_t setuplock; // Serializes the handshakes of the mounts, only the first one connects
+	int8_t ready; // The NFS port is known and the flows are open
+	int8_t down; // The server didn't answer the health probe, calls fail right away until it does
+
+	// Calls in flight, any thread can receive the replies for all of them
+	NFS_CALL *pending[NFS_CALL_TABLE];
+	NFS_CALL *unused;
+	NFS_CALL *rxplaced; // The call of which the payload of the message in rxbuffer was received in place
+	NFS_DATAGRAM batch[NFS_RECV_BATCH]; // Datagrams received with the last one, handed out from batchpos on
+	int32_t batchpos;
+	int32_t batchcount;
+	int32_t ring; // The completion ring the datagrams of all flows arrive in, -1 when the sockets are polled
+	int8_t usering; // The mounts asked for the ring, it's only made for UDP transports where the network has one
+	int8_t receiving; // A thread is receiving replies, the others wait for replies to be handed to them
+	int8_t reactor; // The reactor receives for this transport, or is about to
+	NFS_CALL *waiters; // The threads waiting for replies, by the call they sleep on
+	uint32_t replies; // The amount of replies received, the server isn't probed while they keep coming
+	cond_t replied;
+
+	// One thread probes the server for all mounts which asked for it, it stops when the last of them goes away
+	struct _NFSMOUNT *probers; // The mounts which asked for a probe, it's sent with the credentials of the first one
+	struct _NFSMOUNT *probing; // The mount the probe is being sent for right now
+	cond_t probewake;
+	lwp_t probethread;
+	int8_t hasprobethread;
+	int8_t probestop;
+
+	// Socket information
+	uint32_t xid;
+	int32_t socket;
+	struct sockaddr_in remote;
+	uint16_t clientport;
+	uint32_t protocol; // PROTO_UDP or PROTO_TCP, used for the NFS calls
+	int32_t tcp_socket; // Persistent connection to the NFS port when using TCP
+	uint16_t nfs_port;
+	uint16_t portmapper_port;
+	NFS_PORT ports[NFS_PORT_CACHE];
+
+	// Flows for striping READ and WRITE requests, flow 0 uses socket or tcp_socket
+	NFS_FLOW flows[NFS_MAX_FLOWS];
+	int32_t numflows;
+	int32_t maxflows; // The amount of flows asked for
+	int32_t nextflow; // The flow to receive from first
+
+	// Round trip times and counters of all calls to the server
+	NFS_RTT rtt[NFS_RTT_CLASSES];
+	uint32_t calls; // The amount of calls sent, including retransmits
+	uint32_t retransmits; // The amount of calls which timed out
+	uint32_t hedges; // The amount of duplicates sent of calls which were late
+	uint32_t duplicates; // The amount of replies to calls which had theirs already, or were given up on
+	uint32_t placed; // The amount of replies of which the payload was received in place
+} NFS_TRANSPORT;
+
+#define NFS_MOUNT_DONE 0
+#define NFS_MOUNT_PENDING 1
+#define NFS_MOUNT_FAILED 2
+
+typedef struct _NFSMOUNT {
+	NFS_TRANSPORT *transport;
 
 	// Handle to the mountpoint
 	fhandle3 handle;
+	uint32_t generation; // The amount of times the export was mounted again, after its handles went stale
 	
 	// Information for storing current directory
 	fhandle3 curdir;
@@ -65,19 +275,23 @@ typedef struct {
 
 	// Mount information
 	uint16_t mount_port;
-	uint16_t nfs_port;
 	uint32_t uid;
 	uint32_t gid;
 	uint32_t readonly;
 	char *mountdir;
+	const char *name; // The name of the mountpoint, kept with its devoptab entry
+	char *statefile; // Where the ports, root handle and FSINFO are kept between mounts, or NULL
+	int8_t mountstate; // NFS_MOUNT_PENDING while the handshake runs in the background
+	cond_t mounted;
+	lwp_t mountthread;
+	int8_t hasmountthread;
+	uint32_t probeinterval; // How long nothing has to arrive from the server before it's probed, 0 to not probe
+	struct _NFSMOUNT *nextprober; // The next mount of the transport which asked for a probe
 
-	// Mutex for preventing multiple actions
+	// Mutex for the state of the mount, the transport has its own
 	mutex_t lock;
 
-	// Socket information
-	uint32_t xid;
-	int32_t socket;
-	struct sockaddr_in remote;
+	RPC_TEMPLATE templates[RPC_TEMPLATES]; // Encoded call headers with the credentials of the mount, per program
 
 	// FS info
 	int32_t rtmax; // The max size for a READ request
@@ -87,6 +301,52 @@ typedef struct {
 	int32_t wtpref; // The preferred size for a WRITE request
 	int32_t wtmult; // The suggested multiple for a WRITE request
 	int32_t dtpref; // The preferred size for a READDIR request
+
+	// Transfer settings
+	int32_t rsize; // The max amount of data per READ request, 0 to pick one
+	int32_t wsize; // The max amount of data per WRITE request, 0 to pick one
+	uint32_t maxdatagram; // The largest datagram a WRITE request over UDP may use, 0 for no limit
+	NFS_BLOCK_CTL readctl; // Block sizes of the READ and WRITE requests, moved by the measured loss and throughput
+	NFS_BLOCK_CTL writectl;
+	int32_t read_window; // The max amount of READ requests in flight per file
+	int32_t write_window; // The max amount of WRITE requests in flight per file
+	uint32_t commit_buffer_size; // The amount of unstable data kept per file until it's committed
+	int32_t retries; // The amount of times a call is sent before giving up
+	uint32_t hedge; // The percentile of recent round trip times after which idempotent calls are sent a second time, 0 to not hedge
+	uint32_t rto_initial; // Retransmit timeout bounds, in microseconds
+	uint32_t rto_min;
+	uint32_t rto_max;
+
+	// Attributes of files and directories by their handle, guarded by lock
+	struct _NFS_ATTR_ENTRY *attrs;
+	uint32_t numattrs; // 0 when attributes aren't cached
+	uint32_t acregmin; // How long the attributes of files are kept, in microseconds
+	uint32_t acregmax;
+	uint32_t acdirmin; // How long the attributes of directories are kept, in microseconds
+	uint32_t acdirmax;
+	uint32_t attrhits; // The amount of times attributes were taken from the cache
+	uint32_t attrmisses; // The amount of times they had to be asked for
+
+	// Handles of names in directories, guarded by lock
+	struct _NFS_NAME_ENTRY *names;
+	struct _NFS_NAME_ENTRY **namebuckets;
+	struct _NFS_NAME_ENTRY *namesnew; // The most recently used entry
+	struct _NFS_NAME_ENTRY *namesold; // The least recently used entry, the next one to be replaced
+	uint32_t numnames; // 0 when names aren't cached
+	uint32_t namehits; // The amount of LOOKUP calls the cache saved
+	uint32_t namemisses;
+
+	// Blocks of data read from files, guarded by lock
+	struct _NFS_RCACHE_BLOCK *blocks;
+	struct _NFS_RCACHE_BLOCK **blockbuckets;
+	struct _NFS_RCACHE_BLOCK *blocksnew; // The most recently used block
+	struct _NFS_RCACHE_BLOCK *blocksold; // The least recently used block, the next one to be replaced
+	char *blockdata;
+	uint32_t numblocks; // 0 when reads aren't cached
+	uint32_t blocksize;
+	cond_t blockread; // Signalled when a block was read from the server, for the readers waiting on it
+	uint32_t blockhits; // The amount of blocks which were cached already
+	uint32_t blockmisses;
 } NFSMOUNT;
 
 typedef struct {
@@ -100,7 +360,7 @@ typedef struct {
 
 	// Dir handle
 	fhandle3 handle;	// The filehandle for the directory
-	long long cookie;
+	int64_t cookie;
 	int is_completed;
 
 	// File handles
@@ -129,11 +389,62 @@ typedef struct {
 	uint32_t ctime_nsec;
 } __attribute__((packed)) object_attributes;
 
+typedef struct _NFS_ATTR_ENTRY {
+	uint32_t handlelen;	// 0 when it isn't used
+	uint8_t handle[NFS3_FHSIZE];
+	object_attributes attr;
+	uint64_t expires;	// Until when the attributes are used without asking the server, in microseconds
+	uint32_t timeout;	// How long they were kept the last time
+	uint32_t xid;		// The call they came with, replies to older calls may cross it
+} NFS_ATTR_ENTRY;
+
+#define NFS_NAME_MAX 64 // Longer names aren't cached
+
+typedef struct _NFS_NAME_ENTRY {
+	uint32_t parentlen;	// 0 when it isn't used
+	uint8_t parent[NFS3_FHSIZE];
+	char name[NFS_NAME_MAX];
+	uint32_t handlelen;	// 0 when the name doesn't exist
+	uint8_t handle[NFS3_FHSIZE];
+	uint32_t mtime;		// The mtime of the directory when the name was looked up, the entry is only used while it's the same
+	uint32_t mtime_nsec;
+	struct _NFS_NAME_ENTRY *next; // Next entry in the same bucket
+	struct _NFS_NAME_ENTRY *newer; // The entries by when they were used
+	struct _NFS_NAME_ENTRY *older;
+} NFS_NAME_ENTRY;
+
+#define NFS_RCACHE_MAXBLOCKS 4 // Larger reads skip the block cache, they're sent in parallel and would push everything else out
+
+typedef struct _NFS_RCACHE_BLOCK {
+	uint32_t handlelen;	// 0 when it isn't used
+	uint8_t handle[NFS3_FHSIZE];
+	uint32_t index;		// Which block of the file it is
+	uint32_t len;		// Less than the block size at the end of the file
+	uint32_t mtime;		// The mtime and size of the file when it was read, the block is only used while they're the same
+	uint32_t mtime_nsec;
+	uint32_t size_u;
+	uint32_t size_l;
+	uint8_t reading;	// Being read from the server, other readers of the block wait for it
+	uint8_t dropped;	// The file changed while it was read, it's dropped instead of kept when the read is done
+	char *data;
+	struct _NFS_RCACHE_BLOCK *next; // Next block in the same bucket
+	struct _NFS_RCACHE_BLOCK *newer; // The blocks by when they were used
+	struct _NFS_RCACHE_BLOCK *older;
+} NFS_RCACHE_BLOCK;
+
+typedef struct {
+	uint32_t position;	// The position in the file
+	uint32_t bufoffset;	// The position of the data in the uncommitted buffer
+	uint32_t count;		// The amount of bytes written
+} NFS_WRITE_RANGE;
+
 typedef struct {
 	NFSMOUNT *nfsmount;
 
 	// Dir handle
 	fhandle3 handle;	// The filehandle for the file
+	char *path;		// The path it was opened with, to look it up again when the handle goes stale
+	uint32_t generation;	// The generation of the mount the handle is from
 	uint32_t size;     // The size of the file
 	uint32_t currentPosition;
 	int8_t isnew;
@@ -141,6 +452,22 @@ typedef struct {
 	int8_t write;
 	int8_t append;
 	int8_t shouldcommit;
+
+	// Unstable writes are kept until a COMMIT confirms them with the same verifier
+	int8_t hasverifier;
+	int64_t verifier;
+	char *uncommitted;
+	uint32_t uncommittedlen;
+	NFS_WRITE_RANGE *ranges;
+	uint32_t numranges;
 } NFS_FILE_STRUCT;
 
+typedef struct {
+	uint32_t position;	// The position in the file
+	uint32_t bufoffset;	// The position in the buffer of the caller
+	uint32_t count;		// The amount of bytes requested
+	int32_t flow;		// The flow the request is sent over
+	NFS_CALL *call;		// Sent again by itself when its reply is late
+} NFS_IO_REQUEST;
+
 #endif //_STRUCTS_H_